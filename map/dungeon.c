@@ -59,6 +59,14 @@
  * only one corridor _d_connecting it to the rest of the maze, then it could be turned into a secret room by hiding
  * said corridor.
  *
+ * Each `D_Dungeon` has its own random number generator (a [PCG32][pcg]), so a seed passed to `d_seed()`
+ * always reproduces the same dungeon, and several dungeons can be generated in different threads at once.
+ *
+ * The tiles are computed from the rooms and corridors, so a dungeon doesn't need to keep its tile map in memory.
+ * If `stream` is set, `d_generate()` doesn't allocate it, and `d_draw()` computes and writes out the map a block
+ * of rows at a time. The memory used then grows with the number of rooms rather than the number of tiles,
+ * which makes it possible to generate very large maps.
+ *
  * You could put tougher _boss_ monsters and/or better treasure in rooms colored 1, so that the flow is that the
  * player starts in the blue area, fights a couple of easier enemies, find the key, go through the door to
  * the red area, encounter a boss, loot some treasure and reach the exit.
@@ -68,6 +76,7 @@
  * * https://www.patreon.com/posts/hatching-in-1pdg-31716880
  * * This online tool [svg-path-editor](https://yqnn.github.io/svg-path-editor/) helped me create the SVG paths.
  *
+ * [pcg]: https://www.pcg-random.org/
  * [algorithm]: https://web.archive.org/web/20131025132021/http://kuoi.org/~kamikaze/GameDesign/art07_rogue_dungeon.php
  *
  * Author: Werner Stoop
@@ -78,6 +87,8 @@
 #ifndef DUNGEON_H
 #define DUNGEON_H
 
+#include <stdint.h>
+
 #define D_GRID_W 			5
 #define D_GRID_H 			3
 
@@ -121,13 +132,13 @@
 #define D_TILE_THRESHOLD	't'
 #define D_TILE_SECRET		's'
 
-/* Choose a random number in [0,N) */
+/* Choose a random number in [0,N) from dungeon M's generator */
 #ifndef D_RAND
-#  define D_RAND(N)  ((rand() >> 8) % (N))
+#  define D_RAND(M, N)  d_rand(M, N)
 #endif
 
 typedef struct {
-	short x, y;
+	int x, y;
 } D_Point;
 
 typedef struct {
@@ -136,55 +147,77 @@ typedef struct {
 	unsigned char flags;
 	char visited;
 
-	short x, y, w, h;
+	int x, y, w, h;
+
+	/* Index of the edges to the north, south, east and west, or -1 */
+	int edges[4];
 } D_Room;
 
 /* Connections between the rooms. An edge p,q means that
 there's a corridor between rooms[p] and rooms[q] */
 typedef struct {
-	short p, q;
+	int p, q;
 	char door, direction, offset;
-	short index;
 
-	short x, y, w, h;
+	/* 1 if the tile at x,y is a secret door;
+	2 if the one at x+w-1,y+h-1 is */
+	char secret;
+
+	int index;
+
+	int x, y, w, h;
 } D_Edge;
 
 typedef struct {
 
 	/* These fields are used for configuration */
 
-	short grid_w, grid_h;
+	int grid_w, grid_h;
+
+	int min_room_size, max_room_size;
 
-	short min_room_size, max_room_size;
+	int min_distance;
 
-	short min_distance;
+	int secret_prob;
 
-	short secret_prob;
+	int min_gone_rooms, max_gone_rooms;
 
-	short min_gone_rooms, max_gone_rooms;
+	/* Don't keep the tile map in memory */
+	char stream;
 
 	/* These fields are computed; don't mess with them: */
 
-	short map_w, map_h;
+	int map_w, map_h;
 
 	D_Room *rooms;
-	short n_rooms;
+	int n_rooms;
 
 	char *map;
 
 	D_Edge *edges;
-	short n_edges, max_edges;
+	int n_edges, max_edges;
 
-	short start_room, end_room;
+	int start_room, end_room;
+
+	D_Point entrance, exit;
 
 	/* Temporary indexes */
-	short *cells;
+	int *cells;
+
+	/* Random number generator state */
+	uint64_t rng;
 
 } D_Dungeon;
 
 
 void d_init(D_Dungeon *M);
 
+void d_seed(D_Dungeon *M, uint64_t seed);
+
+int d_rand(D_Dungeon *M, int n);
+
+float d_frand(D_Dungeon *M);
+
 void d_deinit(D_Dungeon *M);
 
 int d_generate(D_Dungeon *D);
@@ -193,6 +226,7 @@ int d_is_wall(D_Dungeon *M, int x, int y);
 
 int d_is_floor(D_Dungeon *M, int x, int y);
 
+/* Has no effect on a `stream`ed dungeon */
 void d_set_tile(D_Dungeon *M, int x, int y, char tile);
 
 char d_get_tile(D_Dungeon *M, int x, int y);
@@ -209,6 +243,48 @@ int d_random_wall(D_Dungeon *M, D_Room *room, D_Point *p);
 void d_draw(D_Dungeon *M, FILE *f);
 #endif
 
+/* Distance maps: The number of steps from every tile to the nearest of a
+set of source tiles, for pathfinding and flow fields.
+
+Entering a tile costs `cost[tile]`, where a cost of 0 means the tile can't
+be entered. If all the costs are 0 or 1 the distances are computed with a
+breadth-first search, otherwise with Dijkstra's algorithm on a bucket queue.
+*/
+#define D_FAR		0x7FFFFFFF
+
+typedef struct {
+	int w, h;
+
+	/* Distance to each tile, or D_FAR if it can't be reached */
+	int *dist;
+
+	/* Cost of entering each type of tile; you may change these */
+	unsigned char cost[256];
+
+	/* Used internally */
+	int *next, *prev;
+	int heads[256];
+	int queued;
+} D_DistMap;
+
+int d_dist_init(D_DistMap *D, D_Dungeon *M);
+
+void d_dist_deinit(D_DistMap *D);
+
+void d_dist_clear(D_DistMap *D);
+
+void d_dist_add_source(D_DistMap *D, int x, int y);
+
+void d_dist_compute(D_DistMap *D, D_Dungeon *M);
+
+void d_dist_from(D_DistMap *D, D_Dungeon *M, int x, int y);
+
+void d_dist_update(D_DistMap *D, D_Dungeon *M, int x, int y);
+
+int d_dist_get(D_DistMap *D, int x, int y);
+
+int d_dist_step(D_DistMap *D, int x, int y, D_Point *next);
+
 #ifdef DUNGEON_IMPLEMENTATION
 
 #include <stdio.h>
@@ -216,6 +292,11 @@ void d_draw(D_Dungeon *M, FILE *f);
 #include <string.h>
 #include <assert.h>
 
+/* Number of rows that d_draw() computes and writes at a time */
+#ifndef D_STREAM_ROWS
+#  define D_STREAM_ROWS		64
+#endif
+
 void d_init(D_Dungeon *M) {
 	M->grid_w = D_GRID_W;
 	M->grid_h = D_GRID_H;
@@ -230,10 +311,44 @@ void d_init(D_Dungeon *M) {
 	M->min_gone_rooms = D_MIN_GONE_ROOMS;
 	M->max_gone_rooms = D_MAX_GONE_ROOMS;
 
+	M->stream = 0;
+
 	M->rooms = NULL;
 	M->map = NULL;
 	M->edges = NULL;
 	M->cells = NULL;
+
+	d_seed(M, 0);
+}
+
+/* PCG32: https://www.pcg-random.org/ */
+#define D_PCG_MULT	6364136223846793005ULL
+#define D_PCG_INC	1442695040888963407ULL
+
+static uint32_t _d_rand32(D_Dungeon *M) {
+	uint64_t old = M->rng;
+	uint32_t xorshifted, rot;
+	M->rng = old * D_PCG_MULT + D_PCG_INC;
+	xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+	rot = (uint32_t)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+void d_seed(D_Dungeon *M, uint64_t seed) {
+	M->rng = 0;
+	_d_rand32(M);
+	M->rng += seed;
+	_d_rand32(M);
+}
+
+int d_rand(D_Dungeon *M, int n) {
+	assert(n > 0);
+	return (int)(((uint64_t)_d_rand32(M) * (uint32_t)n) >> 32);
+}
+
+/* Random number in [0,1) */
+float d_frand(D_Dungeon *M) {
+	return (_d_rand32(M) >> 8) * (1.0f / 16777216.0f);
 }
 
 void d_deinit(D_Dungeon *M) {
@@ -258,13 +373,17 @@ static void _d_reset_generator(D_Dungeon *M) {
 	int i;
 
 	memset(M->rooms, 0, M->n_rooms * sizeof *M->rooms);
-
-	for(i = 0; i < M->map_w * M->map_h; i++) {
-		M->map[i] = ' ';
+	for(i = 0; i < M->n_rooms; i++) {
+		M->rooms[i].edges[0] = -1;
+		M->rooms[i].edges[1] = -1;
+		M->rooms[i].edges[2] = -1;
+		M->rooms[i].edges[3] = -1;
 	}
 
 	M->n_edges = 0;
-	memset(M->edges, 0, M->max_edges * sizeof *M->edges);
+
+	M->entrance.x = M->entrance.y = -1;
+	M->exit.x = M->exit.y = -1;
 }
 
 static int _d_init_generator(D_Dungeon *M) {
@@ -279,18 +398,14 @@ static int _d_init_generator(D_Dungeon *M) {
 		return 0;
 	}
 
-	M->map = malloc(M->map_w * M->map_h * sizeof *M->map);
-	if(!M->map) {
-		free(M->rooms);
-		return 0;
-	}
+	/* The map is only allocated once the layout is done */
+	M->map = NULL;
 
 	/* Maximum number of edges in a M*N rooms graph is 2MN-M-N */
 	M->max_edges = (2 * M->grid_w * M->grid_h) - M->grid_w - M->grid_h;
 	M->edges = malloc(M->max_edges * sizeof *M->edges);
 	if(!M->edges) {
 		free(M->rooms);
-		free(M->map);
 		return 0;
 	}
 
@@ -303,15 +418,11 @@ static int _d_grid_index(D_Dungeon *M, int row, int col) {
 	return row * M->grid_w + col;
 }
 
-static int _d_get_unconnected(D_Dungeon *M) {
-	int i, n = 0;
-	assert(M->cells);
-	for(i = 0; i < M->n_rooms; i++) {
-		if(!M->rooms[i]._d_connected) {
-			M->cells[n++] = i;
-		}
-	}
-	return n;
+/* Index of the room in whose grid cell the tile x,y lies */
+static int _d_cell_at(D_Dungeon *M, int x, int y) {
+	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h)
+		return -1;
+	return ((y - 1) / (M->max_room_size + 1)) * M->grid_w + (x - 1) / (M->max_room_size + 1);
 }
 
 static int _d_get_unconnected_neighbors(D_Dungeon *M, int gi, int n[4]) {
@@ -360,14 +471,21 @@ static int _d_get_connected_neighbors(D_Dungeon *M, int gi, int n[4]) {
 	return count;
 }
 
+/* Index in D_Room.edges of the direction from room p to its neighbour q */
+static int _d_edge_slot(D_Dungeon *M, int p, int q) {
+	if(q == p - M->grid_w) return 0;
+	if(q == p + M->grid_w) return 1;
+	if(q == p + 1) return 2;
+	if(q == p - 1) return 3;
+	return -1;
+}
+
 static D_Edge *_d_get_edge(D_Dungeon *M, int p, int q) {
-	int i;
-	for(i = 0; i < M->n_edges; i++) {
-		D_Edge *e = &M->edges[i];
-		if((e->p == p && e->q == q) || (e->p == q && e->q == p))
-			return e;
-	}
-	return NULL;
+	int slot = _d_edge_slot(M, p, q), i;
+	if(slot < 0)
+		return NULL;
+	i = M->rooms[p].edges[slot];
+	return i >= 0 ? &M->edges[i] : NULL;
 }
 
 static D_Edge *_d_connect(D_Dungeon *M, int from, int to) {
@@ -375,29 +493,48 @@ static D_Edge *_d_connect(D_Dungeon *M, int from, int to) {
 	assert(!_d_get_edge(M, from, to));
 	assert(M->n_edges < M->max_edges);
 	e = &M->edges[M->n_edges];
+	memset(e, 0, sizeof *e);
 
 	e->index = M->n_edges;
 	e->p = from;
 	e->q = to;
 
+	M->rooms[from].edges[_d_edge_slot(M, from, to)] = e->index;
+	M->rooms[to].edges[_d_edge_slot(M, to, from)] = e->index;
+
 	M->n_edges++;
 	return e;
 }
 
 static int _d_count_exits(D_Dungeon *M, int room) {
 	int i, c = 0;
-	for(i = 0; i < M->n_edges; i++) {
-		if(M->edges[i].p == room || M->edges[i].q == room)
+	for(i = 0; i < 4; i++) {
+		if(M->rooms[room].edges[i] >= 0)
 			c++;
 	}
 	return c;
 }
 
+/* Adds the unconnected neighbours of room `gi` that aren't in it yet
+to the list in `M->cells` of rooms that can be connected next.
+`pos` is each room's position in the list, or -1 */
+static void _d_add_candidates(D_Dungeon *M, int gi, int *pos, int *n) {
+	int neighbours[4], c, j;
+	c = _d_get_unconnected_neighbors(M, gi, neighbours);
+	for(j = 0; j < c; j++) {
+		if(pos[neighbours[j]] < 0) {
+			pos[neighbours[j]] = *n;
+			M->cells[(*n)++] = neighbours[j];
+		}
+	}
+}
+
 static int _d_layout(D_Dungeon *M) {
 	int count;
 	int neighbours[4];
 
 	int curr, next, split, c, attempts = 0;
+	int *pos;
 	D_Edge *edge;
 
 	if(!_d_init_generator(M))
@@ -412,7 +549,7 @@ static int _d_layout(D_Dungeon *M) {
 
 		count = 0;
 
-		curr = D_RAND(M->n_rooms);
+		curr = D_RAND(M, M->n_rooms);
 		M->start_room = curr;
 		for(;;) {
 			M->cells[count++] = curr;
@@ -425,12 +562,17 @@ static int _d_layout(D_Dungeon *M) {
 				break;
 			}
 
-			next = neighbours[D_RAND(c)];
+			next = neighbours[D_RAND(M, c)];
 
 			_d_connect(M, curr, next);
 			curr = next;
 		}
-	} while (count < M->min_distance  && ++attempts < 10);
+	} while ((count < M->min_distance && ++attempts < 10) || (count < 3 && ++attempts < 100));
+
+	/* The locked door needs a room on either side of it, and a walk
+	can get stuck early on very narrow grids, so it gets more tries */
+	if(count < 3)
+		return 0;
 
 	/* Color the first half of the rooms BLUE and the
 	second half of the rooms RED. We put a locked door
@@ -453,16 +595,31 @@ static int _d_layout(D_Dungeon *M) {
 	}
 
 #if 1
-	/* Connect all the un_d_connected rooms... */
+	/* Connect all the un_d_connected rooms...
+	Picking a random un_d_connected room until one has a _d_connected
+	neighbour doesn't scale to large grids, so we choose among the
+	un_d_connected rooms next to _d_connected ones directly */
 	attempts = 0;
-	for(;;) {
-		c = _d_get_unconnected(M);
-		if(!c) break;
-		curr = M->cells[ D_RAND(c) ];
+	pos = malloc(M->n_rooms * sizeof *pos);
+	if(!pos)
+		return 0;
+	for(curr = 0; curr < M->n_rooms; curr++)
+		pos[curr] = -1;
+	c = 0;
+	for(curr = 0; curr < M->n_rooms; curr++) {
+		if(M->rooms[curr]._d_connected)
+			_d_add_candidates(M, curr, pos, &c);
+	}
+	while(c > 0) {
+		int k = D_RAND(M, c);
+		curr = M->cells[k];
+		M->cells[k] = M->cells[--c];
+		pos[M->cells[k]] = k;
+		pos[curr] = -1;
 
-		c = _d_get_connected_neighbors(M, curr, neighbours);
-		if(!c) continue;
-		next = neighbours[ D_RAND(c) ];
+		next = _d_get_connected_neighbors(M, curr, neighbours);
+		assert(next > 0);
+		next = neighbours[ D_RAND(M, next) ];
 
 		_d_connect(M, curr, next);
 		M->rooms[curr]._d_connected = 1;
@@ -474,7 +631,10 @@ static int _d_layout(D_Dungeon *M) {
 		use the knowledge to use the knowledge later to
 		hide a treasure there, or make it a secret room */
 		M->rooms[curr].flags |= D_FLAG_XTRA_ROOM;
+
+		_d_add_candidates(M, curr, pos, &c);
 	}
+	free(pos);
 #endif
 
 #if 1
@@ -502,10 +662,10 @@ static int _d_layout(D_Dungeon *M) {
 	M->rooms[M->end_room].flags |= D_FLAG_END_ROOM;
 
 #if 1
-	count = D_RAND((M->grid_w + M->grid_h + 1)/2) + 1;
+	count = D_RAND(M, (M->grid_w + M->grid_h + 1)/2) + 1;
 	while(count > 0) {
 		int row, col, door;
-		curr = D_RAND(M->n_rooms);
+		curr = D_RAND(M, M->n_rooms);
 		row = curr / M->grid_w;
 		col = curr % M->grid_w;
 
@@ -535,7 +695,7 @@ static int _d_layout(D_Dungeon *M) {
 			continue;
 		}
 
-		next = neighbours[ D_RAND(c) ];
+		next = neighbours[ D_RAND(M, c) ];
 
 		/* If the two rooms have different colors, put a locked door between them */
 		door = M->rooms[curr].color != M->rooms[next].color;
@@ -556,12 +716,12 @@ static int _d_layout(D_Dungeon *M) {
 
 #if 1
 	/* Make gone rooms */
-	count = D_RAND(M->max_gone_rooms - M->min_gone_rooms + 1) + M->min_gone_rooms;
+	count = D_RAND(M, M->max_gone_rooms - M->min_gone_rooms + 1) + M->min_gone_rooms;
 	attempts = 0;
 	while(count > 0) {
 		if(++attempts > 10) break;
 
-		curr = D_RAND(M->n_rooms);
+		curr = D_RAND(M, M->n_rooms);
 
 		if(_d_count_exits(M, curr) < 2)
 			continue;
@@ -588,8 +748,8 @@ static int _d_layout(D_Dungeon *M) {
 			room->y = row * (M->max_room_size + 1) + 1 + M->max_room_size/2;
 
 		} else {
-			room->w = D_RAND(M->max_room_size - M->min_room_size + 1) + M->min_room_size;
-			room->h = D_RAND(M->max_room_size - M->min_room_size + 1) + M->min_room_size;
+			room->w = D_RAND(M, M->max_room_size - M->min_room_size + 1) + M->min_room_size;
+			room->h = D_RAND(M, M->max_room_size - M->min_room_size + 1) + M->min_room_size;
 
 			room->x = col * (M->max_room_size + 1) + 1 + (M->max_room_size - room->w + 1)/2;
 			room->y = row * (M->max_room_size + 1) + 1 + (M->max_room_size - room->h + 1)/2;
@@ -598,7 +758,7 @@ static int _d_layout(D_Dungeon *M) {
 
 	/* Shift the edges up/down or left/right a bit */
 	for(curr = 0; curr < M->n_edges; curr++) {
-		M->edges[curr].offset = D_RAND(3)-1;
+		M->edges[curr].offset = D_RAND(M, 3)-1;
 	}
 
 	free(M->cells);
@@ -607,11 +767,220 @@ static int _d_layout(D_Dungeon *M) {
 	return 1;
 }
 
+/* Does room `r` occupy the tile x,y? Gone rooms are a
+single crossing tile, the others are floor */
+static int _d_room_covers(D_Dungeon *M, int r, int x, int y) {
+	D_Room *room = &M->rooms[r];
+	if(!room->_d_connected || (room->flags & D_FLAG_GONE_ROOM))
+		return x == room->x && y == room->y;
+	return x >= room->x && x < room->x + room->w && y >= room->y && y < room->y + room->h;
+}
+
+/* Computes the bounding box of an edge's corridor, which runs from the
+center of one room to the center of the other, around the rooms */
+static void _d_place_edge(D_Dungeon *M, D_Edge *edge) {
+	int i = edge->p > edge->q ? edge->p : edge->q;
+	int other = edge->p > edge->q ? edge->q : edge->p;
+	int row = i / M->grid_w;
+	int col = i % M->grid_w;
+	int j;
+
+	int x = col * (M->max_room_size + 1) + 1 + (M->max_room_size)/2;
+	int y = row * (M->max_room_size + 1) + 1 + (M->max_room_size)/2;
+
+	if(other == i - 1 && col > 0) {
+		int maxx, minx, tx = x;
+
+		edge->direction = D_ORIENT_EW;
+		if((M->rooms[i].flags & D_FLAG_GONE_ROOM) || (M->rooms[other].flags & D_FLAG_GONE_ROOM))
+			edge->y = y;
+		else
+			edge->y = y + edge->offset;
+
+		edge->h = 1;
+		maxx = x - (M->max_room_size + 1);
+		minx = x;
+
+		for(j = 0; j <= M->max_room_size + 1; j++, tx--) {
+			if(_d_room_covers(M, i, tx, edge->y) || _d_room_covers(M, other, tx, edge->y))
+				continue;
+
+			if(tx < minx)
+				minx = tx;
+			if(tx > maxx)
+				maxx = tx;
+		}
+
+		edge->x = minx;
+		edge->w = maxx - minx + 1;
+	} else {
+		int maxy, miny, ty = y;
+
+		edge->direction = D_ORIENT_NS;
+		if((M->rooms[i].flags & D_FLAG_GONE_ROOM) || (M->rooms[other].flags & D_FLAG_GONE_ROOM))
+			edge->x = x;
+		else
+			edge->x = x + edge->offset;
+
+		edge->w = 1;
+		maxy = y - (M->max_room_size + 1);
+		miny = y;
+
+		for(j = 0; j <= M->max_room_size; j++, ty--) {
+			if(_d_room_covers(M, i, edge->x, ty) || _d_room_covers(M, other, edge->x, ty))
+				continue;
+
+			if(ty < miny)
+				miny = ty;
+			if(ty > maxy)
+				maxy = ty;
+		}
+
+		edge->y = miny;
+		edge->h = maxy - miny + 1;
+	}
+}
+
+/* The locked door is halfway along the corridor,
+on the border between the two rooms' grid cells */
+static int _d_is_door_tile(D_Dungeon *M, D_Edge *edge, int x, int y) {
+	int i = edge->p > edge->q ? edge->p : edge->q;
+	if(edge->direction == D_ORIENT_EW)
+		return x == (i % M->grid_w) * (M->max_room_size + 1);
+	return y == (i / M->grid_w) * (M->max_room_size + 1);
+}
+
+static int _d_is_secret_tile(D_Edge *edge, int x, int y) {
+	if(edge->secret == 1)
+		return x == edge->x && y == edge->y;
+	if(edge->secret == 2)
+		return x == edge->x + edge->w - 1 && y == edge->y + edge->h - 1;
+	return 0;
+}
+
+/* The rooms, crossings, corridors and locked doors,
+before the walls and the rest are worked out */
+static char _d_base_tile(D_Dungeon *M, int x, int y) {
+	int i = _d_cell_at(M, x, y);
+	D_Edge *e;
+
+	if(i < 0)
+		return D_TILE_EMPTY;
+
+	if(_d_room_covers(M, i, x, y)) {
+		if(!M->rooms[i]._d_connected || (M->rooms[i].flags & D_FLAG_GONE_ROOM))
+			return D_TILE_CROSSING;
+		return D_TILE_FLOOR;
+	}
+
+	e = d_corridor_at(M, x, y);
+	if(e) {
+		if(e->door && _d_is_door_tile(M, e, x, y))
+			return D_TILE_LOCKED_DOOR;
+		return D_TILE_CORRIDOR;
+	}
+
+	return D_TILE_EMPTY;
+}
+
+/* Computes the tiles in the `w` by `h` rectangle at x0,y0 into `out`,
+which has `stride` bytes per row. `tmp` needs room for
+`(w + 4) * (h + 4) + (w + 2) * (h + 2)` bytes.
+
+Each pass looks at the neighbours of the tiles of the pass before it,
+so the rectangle is computed with a border of 2 tiles around it. */
+static void _d_render(D_Dungeon *M, int x0, int y0, int w, int h, char *out, int stride, char *tmp) {
+	int i, j, bw = w + 4, sw = w + 2;
+	char *base = tmp, *walls = tmp + bw * (h + 4);
+
+#define BASE(i, j)	base[((j) - y0 + 2) * bw + (i) - x0 + 2]
+#define WALLS(i, j)	walls[((j) - y0 + 1) * sw + (i) - x0 + 1]
+
+	for(j = y0 - 2; j < y0 + h + 2; j++)
+		for(i = x0 - 2; i < x0 + w + 2; i++)
+			BASE(i, j) = _d_base_tile(M, i, j);
+
+	/* Walls, thresholds, and the entrance and exit */
+	for(j = y0 - 1; j < y0 + h + 1; j++) {
+		for(i = x0 - 1; i < x0 + w + 1; i++) {
+			char t = BASE(i, j);
+			if(i < 0 || i >= M->map_w || j < 0 || j >= M->map_h) {
+				/* Outside the map */
+				WALLS(i, j) = 0;
+				continue;
+			}
+			if(t == D_TILE_EMPTY) {
+				if(BASE(i - 1, j) != D_TILE_EMPTY ||
+					BASE(i + 1, j) != D_TILE_EMPTY ||
+					BASE(i, j - 1) != D_TILE_EMPTY ||
+					BASE(i, j + 1) != D_TILE_EMPTY ||
+					/* Diagonal checks only makes it look nice in ASCII: */
+					BASE(i - 1, j - 1) != D_TILE_EMPTY ||
+					BASE(i + 1, j - 1) != D_TILE_EMPTY ||
+					BASE(i - 1, j + 1) != D_TILE_EMPTY ||
+					BASE(i + 1, j + 1) != D_TILE_EMPTY)
+					t = D_TILE_WALL;
+			} else if(t == D_TILE_CORRIDOR && (
+					BASE(i - 1, j) == D_TILE_FLOOR ||
+					BASE(i + 1, j) == D_TILE_FLOOR ||
+					BASE(i, j - 1) == D_TILE_FLOOR ||
+					BASE(i, j + 1) == D_TILE_FLOOR)) {
+				D_Edge * e = d_corridor_at(M, i, j);
+				if(!e->door)
+					t = D_TILE_THRESHOLD;
+			}
+			if(i == M->entrance.x && j == M->entrance.y)
+				t = D_TILE_ENTRANCE;
+			if(i == M->exit.x && j == M->exit.y)
+				t = D_TILE_EXIT;
+			WALLS(i, j) = t;
+		}
+	}
+
+	/* Floor edges and secret doors */
+	for(j = y0; j < y0 + h; j++) {
+		for(i = x0; i < x0 + w; i++) {
+			char t = WALLS(i, j), n[4];
+			int k, edge = 0, open = 0;
+			if(t == D_TILE_FLOOR) {
+				n[0] = WALLS(i - 1, j);
+				n[1] = WALLS(i + 1, j);
+				n[2] = WALLS(i, j - 1);
+				n[3] = WALLS(i, j + 1);
+				for(k = 0; k < 4; k++) {
+					if(n[k] == D_TILE_WALL)
+						edge = 1;
+					else if(n[k] == D_TILE_THRESHOLD || n[k] == D_TILE_CORRIDOR
+						|| n[k] == D_TILE_LOCKED_DOOR || n[k] == D_TILE_ENTRANCE
+						|| n[k] == D_TILE_EXIT || n[k] == D_TILE_SECRET)
+						open = 1;
+				}
+				if(edge && !open)
+					t = D_TILE_FLOOR_EDGE;
+			} else if(t == D_TILE_CORRIDOR || t == D_TILE_THRESHOLD || t == D_TILE_LOCKED_DOOR) {
+				D_Edge *e = d_corridor_at(M, i, j);
+				if(e && _d_is_secret_tile(e, i, j))
+					t = D_TILE_SECRET;
+			}
+			out[(j - y0) * stride + i - x0] = t;
+		}
+	}
+
+#undef BASE
+#undef WALLS
+}
+
+static char _d_compute_tile(D_Dungeon *M, int x, int y) {
+	char tmp[5 * 5 + 3 * 3], t;
+	_d_render(M, x, y, 1, 1, &t, 1, tmp);
+	return t;
+}
+
 int d_is_wall(D_Dungeon *M, int x, int y) {
 	char t;
 	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h)
 		return 1;
-	t = M->map[ y * M->map_w + x ];
+	t = d_get_tile(M, x, y);
 	return t == D_TILE_EMPTY || t == D_TILE_WALL;
 }
 
@@ -619,18 +988,12 @@ int d_is_floor(D_Dungeon *M, int x, int y) {
 	char t;
 	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h)
 		return 0;
-	t = M->map[ y * M->map_w + x ];
+	t = d_get_tile(M, x, y);
 	return t == D_TILE_FLOOR_EDGE || t == D_TILE_FLOOR;
 }
 
-static int _d_is_tile(D_Dungeon *M, int x, int y, char tile) {
-	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h)
-		return 0;
-	return (M->map[ y * M->map_w + x ] == tile);
-}
-
 void d_set_tile(D_Dungeon *M, int x, int y, char tile) {
-	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h)
+	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h || !M->map)
 		return;
 	M->map[ y * M->map_w + x ] = tile;
 }
@@ -638,23 +1001,18 @@ void d_set_tile(D_Dungeon *M, int x, int y, char tile) {
 char d_get_tile(D_Dungeon *M, int x, int y) {
 	if(x < 0 || x >= M->map_w || y < 0 || y >= M->map_h)
 		return D_TILE_EMPTY;
+	if(!M->map)
+		return _d_compute_tile(M, x, y);
 	return M->map[ y * M->map_w + x ];
 }
 
-static int _d_has_neighbour(D_Dungeon *M, int x, int y, char tile) {
-	return (_d_is_tile(M, x - 1, y, tile) ||
-			_d_is_tile(M, x + 1, y, tile) ||
-			_d_is_tile(M, x, y - 1, tile) ||
-			_d_is_tile(M, x, y + 1, tile));
-}
-
 int d_random_wall(D_Dungeon *M, D_Room *room, D_Point *p) {
 	int attempts = 0, x, y;
 	do {
-		switch(D_RAND(4)) {
+		switch(D_RAND(M, 4)) {
 		case 0:
 			x = room->x - 1;
-			y = room->y + D_RAND(room->h);
+			y = room->y + D_RAND(M, room->h);
 			if(d_is_floor(M, x + 1, y) && d_is_wall(M, x - 1, y) && d_is_wall(M, x, y - 1) && d_is_wall(M, x, y + 1)) {
 				p->x = x; p->y = y;
 				return 1;
@@ -662,14 +1020,14 @@ int d_random_wall(D_Dungeon *M, D_Room *room, D_Point *p) {
 			break;
 		case 1:
 			x = room->x + room->w;
-			y = room->y + D_RAND(room->h);
+			y = room->y + D_RAND(M, room->h);
 			if(d_is_floor(M, x - 1, y) && d_is_wall(M, x + 1, y) && d_is_wall(M, x, y - 1) && d_is_wall(M, x, y + 1)) {
 				p->x = x; p->y = y;
 				return 1;
 			}
 			break;
 		case 2:
-			x = room->x + D_RAND(room->w);
+			x = room->x + D_RAND(M, room->w);
 			y = room->y - 1;
 			if(d_is_floor(M, x, y + 1) && d_is_wall(M, x, y - 1) && d_is_wall(M, x - 1, y) && d_is_wall(M, x + 1, y)) {
 				p->x = x; p->y = y;
@@ -677,7 +1035,7 @@ int d_random_wall(D_Dungeon *M, D_Room *room, D_Point *p) {
 			}
 			break;
 		case 3:
-			x = room->x + D_RAND(room->w);
+			x = room->x + D_RAND(M, room->w);
 			y = room->y + room->h;
 			if(d_is_floor(M, x, y - 1) && d_is_wall(M, x, y + 1) && d_is_wall(M, x - 1, y) && d_is_wall(M, x + 1, y)) {
 				p->x = x; p->y = y;
@@ -705,6 +1063,7 @@ static int _d_edge_direction(int p, int q) {
 	}
 }
 
+#ifdef D_DEBUG
 static const char *_d_dir_name(int dir) {
 	switch(dir) {
 		case D_NORTH: return "North";
@@ -714,279 +1073,479 @@ static const char *_d_dir_name(int dir) {
 	}
 	return "";
 }
+#endif
 
-static int _d_traverse_room(D_Dungeon *M, int idx, int prev) {
-	int i, e = 0, exits[4];
-	D_Edge *edges[4];
-	D_Point exit_points[4];
-	D_Room *room = &M->rooms[idx];
-
-	if(room->visited) return 0;
-	room->visited = 1;
-	printf("Room %d:\n", idx);
-
-	for(i = 0; i < M->n_edges; i++) {
-		if(M->edges[i].p == idx) {
-			assert(e < 4);
-			exits[e] = M->edges[i].q;
-			edges[e] = &M->edges[i];
-			e++;
-		} else if(M->edges[i].q == idx) {
-			assert(e < 4);
-			exits[e] = M->edges[i].p;
-			edges[e] = &M->edges[i];
-			e++;
-		}
+/* The edges of a room, in the order they were made */
+static int _d_room_edges(D_Dungeon *M, int idx, int edges[4]) {
+	int i, j, e = 0;
+	for(i = 0; i < 4; i++) {
+		int k = M->rooms[idx].edges[i];
+		if(k < 0)
+			continue;
+		for(j = e; j > 0 && edges[j - 1] > k; j--)
+			edges[j] = edges[j - 1];
+		edges[j] = k;
+		e++;
 	}
+	return e;
+}
 
-	for(i = 0; i < e; i++) {
-		int dir = _d_edge_direction(idx, exits[i]);
-		printf(" * %s %d %c\n", _d_dir_name(dir), exits[i], exits[i]==prev?'*':' ');
-		switch(dir) {
-			case D_NORTH:
-				exit_points[i].x = edges[i]->x;
-				exit_points[i].y = edges[i]->y + edges[i]->h - 1;
-				break;
-			case D_SOUTH:
-				exit_points[i].x = edges[i]->x;
-				exit_points[i].y = edges[i]->y;
-				break;
-			case D_WEST:
-				exit_points[i].x = edges[i]->x + edges[i]->w - 1;
-				exit_points[i].y = edges[i]->y;
-				break;
-			case D_EAST:
-				exit_points[i].x = edges[i]->x;
-				exit_points[i].y = edges[i]->y;
-				break;
-		}
-	}
+/* Room `next` was reached from room `idx` through `edge`, and has `exits` exits.
+If it is an extra room at a dead end, it may become a secret room */
+static void _d_make_secret(D_Dungeon *M, int idx, int next, D_Edge *edge, int exits) {
+	int dir;
 
-	for(i = 0; i < e; i++) {
-		int s;
-		if(exits[i] == prev) continue;
-		s = _d_traverse_room(M, exits[i], idx);
-		if(s == 1 && !(room->flags & D_FLAG_GONE_ROOM) && (M->rooms[ exits[i] ].flags & D_FLAG_XTRA_ROOM)) {
-			if(D_RAND(100) > M->secret_prob) continue;
-			M->rooms[ exits[i] ].flags |= D_FLAG_SECRET_ROOM;
-			d_set_tile(M, exit_points[i].x, exit_points[i].y, D_TILE_SECRET);
-		}
-	}
+	if(exits != 1 || (M->rooms[idx].flags & D_FLAG_GONE_ROOM) || !(M->rooms[next].flags & D_FLAG_XTRA_ROOM))
+		return;
+	if(D_RAND(M, 100) > M->secret_prob)
+		return;
+	M->rooms[next].flags |= D_FLAG_SECRET_ROOM;
 
-	return e;
+	/* The secret door is at the end of the corridor next to room `idx` */
+	dir = _d_edge_direction(idx, next);
+	edge->secret = (dir == D_NORTH || dir == D_WEST) ? 2 : 1;
 }
 
-static void _d_postprocess(D_Dungeon *M) {
-	int i, j, start, placed;
-	D_Room *room;
-	D_Edge *edge;
-	D_Point point;
+/* Walks the rooms depth first from the start room to find the secret rooms.
+An explicit stack is used since the path may be as long as there are rooms */
+struct _d_frame {
+	int idx, prev, i;
+};
 
-	for(j = 0; j < M->grid_h; j++) {
-		for(i = 0; i < M->grid_w; i++) {
-			D_Room *room = &M->rooms[_d_grid_index(M, j, i)];
-			int p, q;
+static int _d_traverse_rooms(D_Dungeon *M) {
+	struct _d_frame *stack;
+	int sp = 0;
 
-			if(!room->_d_connected || (room->flags & D_FLAG_GONE_ROOM)) {
-				d_set_tile(M, room->x, room->y, D_TILE_CROSSING);
-				continue;
-			}
+	stack = malloc(M->n_rooms * sizeof *stack);
+	if(!stack)
+		return 0;
 
-			for(p = 0; p < room->w; p++) {
-				for(q = 0; q < room->h; q++) {
-					d_set_tile(M, room->x + p, room->y + q, D_TILE_FLOOR);
-				}
+	M->rooms[M->start_room].visited = 1;
+	stack[sp].idx = M->start_room;
+	stack[sp].prev = -1;
+	stack[sp].i = 0;
+	sp++;
+
+	while(sp > 0) {
+		struct _d_frame *f = &stack[sp - 1];
+		int edges[4], e, next;
+
+		e = _d_room_edges(M, f->idx, edges);
+		assert(e <= 4);
+
+#ifdef D_DEBUG
+		if(f->i == 0) {
+			int i;
+			printf("Room %d:\n", f->idx);
+			for(i = 0; i < e; i++) {
+				D_Edge *edge = &M->edges[edges[i]];
+				next = edge->p == f->idx ? edge->q : edge->p;
+				printf(" * %s %d %c\n", _d_dir_name(_d_edge_direction(f->idx, next)), next, next==f->prev?'*':' ');
 			}
 		}
-	}
-
-	/* Draw all the edges, computing their bounding boxes in the process */
-	for(i = 1; i < M->n_rooms; i++) {
-		int row = i / M->grid_w;
-		int col = i % M->grid_w;
-
-		int x = col * (M->max_room_size + 1) + 1 + (M->max_room_size)/2;
-		int y = row * (M->max_room_size + 1) + 1 + (M->max_room_size)/2;
-
-		if(col > 0) {
-			int left = i - 1;
-			int maxx, minx, tx = x;
-
-			edge = _d_get_edge(M, i, left);
-			if(edge) {
-				edge->direction = D_ORIENT_EW;
-				if((M->rooms[i].flags & D_FLAG_GONE_ROOM) || (M->rooms[left].flags & D_FLAG_GONE_ROOM))
-					edge->y = y;
-				else
-					edge->y = y + edge->offset;
-
-				start = edge->y * M->map_w + x;
-
-				edge->h = 1;
-				maxx = x - (M->max_room_size + 1);
-				minx = x;
-
-				for(j = 0; j <= M->max_room_size + 1; j++, tx--) {
-					if(M->map[ start - j ] != D_TILE_EMPTY)
-						continue;
-
-					if(tx < minx)
-						minx = tx;
-					if(tx > maxx)
-						maxx = tx;
-
-					if(edge->door && j == M->max_room_size/2 + 1)
-						M->map[ start - j ] = D_TILE_LOCKED_DOOR;
-					else
-						M->map[ start - j ] = D_TILE_CORRIDOR;
-				}
+#endif
 
-				edge->x = minx;
-				edge->w = maxx - minx + 1;
+		if(f->i < e) {
+			D_Edge *edge = &M->edges[edges[f->i]];
+			next = edge->p == f->idx ? edge->q : edge->p;
+			if(next == f->prev || M->rooms[next].visited) {
+				f->i++;
+				continue;
 			}
+			M->rooms[next].visited = 1;
+			stack[sp].idx = next;
+			stack[sp].prev = f->idx;
+			stack[sp].i = 0;
+			sp++;
+			continue;
 		}
-		if(row > 0) {
-			int up = i - M->grid_w;
-			int maxy, miny, ty = y;
-
-			edge = _d_get_edge(M, i, up);
-			if(edge) {
-				edge->direction = D_ORIENT_NS;
-				if((M->rooms[i].flags & D_FLAG_GONE_ROOM) || (M->rooms[up].flags & D_FLAG_GONE_ROOM))
-					edge->x = x;
-				else
-					edge->x = x + edge->offset;
-
-				start = y * M->map_w + edge->x;
-
-				edge->w = 1;
-				maxy = y - (M->max_room_size + 1);
-				miny = y;
-
-				for(j = 0; j <= M->max_room_size; j++, ty--) {
-					if(M->map[start - j * M->map_w] != D_TILE_EMPTY)
-						continue;
-
-					if(ty < miny)
-						miny = ty;
-					if(ty > maxy)
-						maxy = ty;
-
-					if(edge->door && j == M->max_room_size/2 + 1)
-						M->map[ start - j * M->map_w ] = D_TILE_LOCKED_DOOR;
-					else
-						M->map[ start - j * M->map_w ] = D_TILE_CORRIDOR;
-				}
 
-				edge->y = miny;
-				edge->h = maxy - miny + 1;
-			}
+		/* Done with this room; back to the room it was reached from */
+		next = f->idx;
+		if(--sp > 0) {
+			f = &stack[sp - 1];
+			_d_room_edges(M, f->idx, edges);
+			_d_make_secret(M, f->idx, next, &M->edges[edges[f->i]], e);
+			f->i++;
 		}
 	}
 
-	for(j = 0; j < M->map_h; j++) {
-		for(i = 0; i < M->map_w; i++) {
-			if(d_is_wall(M, i, j) && (
-				!d_is_wall(M, i - 1, j) ||
-				!d_is_wall(M, i + 1, j) ||
-				!d_is_wall(M, i, j - 1) ||
-				!d_is_wall(M, i, j + 1) ||
-				/* Diagonal checks only makes it look nice in ASCII: */
-				!d_is_wall(M, i - 1, j - 1) ||
-				!d_is_wall(M, i + 1, j - 1) ||
-				!d_is_wall(M, i - 1, j + 1) ||
-				!d_is_wall(M, i + 1, j + 1)
-			)) {
-				d_set_tile(M, i, j, D_TILE_WALL);
-			}
+	free(stack);
+	return 1;
+}
 
-			if(_d_is_tile(M, i, j, D_TILE_CORRIDOR) && _d_has_neighbour(M, i, j, D_TILE_FLOOR)) {
-				D_Edge * e = d_corridor_at(M, i, j);
-				if(!e->door)
-					d_set_tile(M, i, j, D_TILE_THRESHOLD);
-			}
-		}
-	}
+/* Computes rows `y` to `y + n` of the map into `out` */
+static void _d_render_rows(D_Dungeon *M, int y, int n, char *out, int stride, char *tmp) {
+	_d_render(M, 0, y, M->map_w, n, out, stride, tmp);
+}
+
+static char *_d_alloc_render_tmp(D_Dungeon *M) {
+	return malloc((M->map_w + 4) * (D_STREAM_ROWS + 4) + (M->map_w + 2) * (D_STREAM_ROWS + 2));
+}
+
+static int _d_postprocess(D_Dungeon *M) {
+	int i, placed;
+	D_Room *room;
+	D_Point point;
+	char *tmp;
+
+	/* Work out where all the corridors go */
+	for(i = 0; i < M->n_edges; i++)
+		_d_place_edge(M, &M->edges[i]);
 
 	/* Place the dungeon entrance and exit */
 	room = &M->rooms[M->start_room];
 	placed = d_random_wall(M, room, &point);
 	if(placed) {
-		d_set_tile(M, point.x, point.y, D_TILE_ENTRANCE);
+		M->entrance = point;
 	} else {
 		/* Ugly, but better than nothing */
-		d_set_tile(M, room->x + room->w/2, room->y + room->h/2, D_TILE_ENTRANCE);
+		M->entrance.x = room->x + room->w/2;
+		M->entrance.y = room->y + room->h/2;
 	}
 
 	room = &M->rooms[M->end_room];
 	placed = d_random_wall(M, room, &point);
 	if(placed) {
-		d_set_tile(M, point.x, point.y, D_TILE_EXIT);
+		M->exit = point;
 	} else {
-		d_set_tile(M, room->x + room->w/2, room->y + room->h/2, D_TILE_EXIT);
-	}
-
-	for(j = 0; j < M->map_h; j++) {
-		for(i = 0; i < M->map_w; i++) {
-			if(_d_is_tile(M, i, j, D_TILE_FLOOR) && _d_has_neighbour(M, i, j, D_TILE_WALL) &&
-			!(_d_has_neighbour(M, i, j, D_TILE_THRESHOLD)
-				|| _d_has_neighbour(M, i, j, D_TILE_CORRIDOR)
-				|| _d_has_neighbour(M, i, j, D_TILE_LOCKED_DOOR)
-				|| _d_has_neighbour(M, i, j, D_TILE_ENTRANCE)
-				|| _d_has_neighbour(M, i, j, D_TILE_EXIT)
-				|| _d_has_neighbour(M, i, j, D_TILE_SECRET)))
-				M->map[ j * M->map_w + i ] = D_TILE_FLOOR_EDGE;
-		}
+		M->exit.x = room->x + room->w/2;
+		M->exit.y = room->y + room->h/2;
+	}
+
+	if(!_d_traverse_rooms(M))
+		return 0;
+
+	if(M->stream)
+		return 1;
+
+	/* Compute the tile map */
+	M->map = malloc(M->map_w * M->map_h * sizeof *M->map);
+	tmp = _d_alloc_render_tmp(M);
+	if(!M->map || !tmp) {
+		free(M->map);
+		M->map = NULL;
+		free(tmp);
+		return 0;
+	}
+	for(i = 0; i < M->map_h; i += D_STREAM_ROWS) {
+		int n = M->map_h - i < D_STREAM_ROWS ? M->map_h - i : D_STREAM_ROWS;
+		_d_render_rows(M, i, n, M->map + i * M->map_w, M->map_w, tmp);
 	}
+	free(tmp);
 
-	_d_traverse_room(M, M->start_room, -1);
+	return 1;
 }
 
 int d_generate(D_Dungeon *D) {
 	if(!_d_layout(D))
 		return 0;
-	_d_postprocess(D);
-	return 1;
+	return _d_postprocess(D);
 }
 
 D_Room *d_room_at(D_Dungeon *M, int x, int y) {
-	int col = (x - 1) / (M->max_room_size + 1);
-	int row = (y - 1) / (M->max_room_size + 1);
-	int i = _d_grid_index(M, row, col);
-	D_Room *r = &M->rooms[i];
+	int i = _d_cell_at(M, x, y);
+	D_Room *r;
+	if(i < 0)
+		return NULL;
+	r = &M->rooms[i];
 	if(x >= r->x && x < r->x + r->w && y >= r->y && y < r->y + r->h)
 		return r;
 	return NULL;
 }
 
+/* A corridor only runs through the grid cells of the
+two rooms it connects, so only the edges of the room in
+this cell need to be checked */
 D_Edge *d_corridor_at(D_Dungeon *M, int x, int y) {
-	int i;
-	for(i = 0; i < M->n_edges; i++) {
-		D_Edge *e = &M->edges[i];
-		if(x >= e->x && x < e->x + e->w && y >= e->y && y < e->y + e->h)
-			return e;
+	int i = _d_cell_at(M, x, y), k;
+	D_Edge *found = NULL;
+	if(i < 0)
+		return NULL;
+	for(k = 0; k < 4; k++) {
+		D_Edge *e;
+		if(M->rooms[i].edges[k] < 0)
+			continue;
+		e = &M->edges[M->rooms[i].edges[k]];
+		if(x >= e->x && x < e->x + e->w && y >= e->y && y < e->y + e->h) {
+			/* Where corridors overlap, the first one wins */
+			if(!found || e->index < found->index)
+				found = e;
+		}
 	}
-	return NULL;
+	return found;
 }
 
 D_Room *d_random_room(D_Dungeon *M) {
 	D_Room *r;
 	do {
-		r = &M->rooms[D_RAND(M->n_rooms)];
+		r = &M->rooms[D_RAND(M, M->n_rooms)];
 	} while(r->flags & D_FLAG_GONE_ROOM);
 	return r;
 }
 
+/* Writes the map in blocks of D_STREAM_ROWS rows. If the dungeon
+is `stream`ed, each block is computed just before it is written */
 void d_draw(D_Dungeon *M, FILE *f) {
-	int i, j;
-	for(j = 0; j < M->map_h; j++) {
-		for(i = 0; i < M->map_w; i++) {
-			putc(d_get_tile(M, i, j), f);
+	int i, j, n;
+	char *rows, *tmp = NULL;
+
+	rows = malloc((M->map_w + 1) * D_STREAM_ROWS);
+	if(!M->map)
+		tmp = _d_alloc_render_tmp(M);
+	if(!rows || (!M->map && !tmp)) {
+		free(rows);
+		free(tmp);
+		return;
+	}
+
+	for(j = 0; j < M->map_h; j += n) {
+		n = M->map_h - j < D_STREAM_ROWS ? M->map_h - j : D_STREAM_ROWS;
+		if(M->map) {
+			for(i = 0; i < n; i++)
+				memcpy(rows + i * (M->map_w + 1), M->map + (j + i) * M->map_w, M->map_w);
+		} else
+			_d_render_rows(M, j, n, rows, M->map_w + 1, tmp);
+		for(i = 0; i < n; i++)
+			rows[i * (M->map_w + 1) + M->map_w] = '\n';
+		fwrite(rows, 1, n * (M->map_w + 1), f);
+	}
+
+	free(rows);
+	free(tmp);
+}
+
+/* Allocates a distance map for dungeon `M`, with no sources yet.
+Locked doors, walls and empty tiles can't be entered by default */
+int d_dist_init(D_DistMap *D, D_Dungeon *M) {
+	static const char open[] = {
+		D_TILE_FLOOR, D_TILE_FLOOR_EDGE, D_TILE_CORRIDOR, D_TILE_CROSSING, D_TILE_ENTRANCE,
+		D_TILE_EXIT, D_TILE_THRESHOLD, D_TILE_SECRET
+	};
+	int i, n = M->map_w * M->map_h;
+
+	D->w = M->map_w;
+	D->h = M->map_h;
+
+	memset(D->cost, 0, sizeof D->cost);
+	for(i = 0; i < (int)sizeof open; i++)
+		D->cost[(unsigned char)open[i]] = 1;
+
+	D->dist = malloc(n * sizeof *D->dist);
+	D->next = malloc(n * sizeof *D->next);
+	D->prev = malloc(n * sizeof *D->prev);
+	if(!D->dist || !D->next || !D->prev) {
+		d_dist_deinit(D);
+		return 0;
+	}
+	d_dist_clear(D);
+	return 1;
+}
+
+void d_dist_deinit(D_DistMap *D) {
+	free(D->dist);
+	free(D->next);
+	free(D->prev);
+	D->dist = NULL;
+	D->next = NULL;
+	D->prev = NULL;
+}
+
+/* Tiles are queued in doubly linked lists threaded through `next` and `prev`;
+`prev` is -2 for tiles that aren't queued. In a breadth-first search there's
+only one list, used as a FIFO. In Dijkstra's algorithm there is a list for each
+distance modulo 256, which is enough since no step costs more than 255 */
+
+void d_dist_clear(D_DistMap *D) {
+	int i;
+	for(i = 0; i < D->w * D->h; i++) {
+		D->dist[i] = D_FAR;
+		D->prev[i] = -2;
+	}
+	for(i = 0; i < 256; i++)
+		D->heads[i] = -1;
+	D->queued = 0;
+}
+
+static void _d_dist_push(D_DistMap *D, int i) {
+	int *head = &D->heads[D->dist[i] & 0xFF];
+	D->prev[i] = -1;
+	D->next[i] = *head;
+	if(*head >= 0)
+		D->prev[*head] = i;
+	*head = i;
+	D->queued++;
+}
+
+static void _d_dist_unlink(D_DistMap *D, int i) {
+	if(D->prev[i] >= 0)
+		D->next[D->prev[i]] = D->next[i];
+	else
+		D->heads[D->dist[i] & 0xFF] = D->next[i];
+	if(D->next[i] >= 0)
+		D->prev[D->next[i]] = D->prev[i];
+	D->prev[i] = -2;
+	D->queued--;
+}
+
+/* Makes x,y a source: Its distance is 0 */
+void d_dist_add_source(D_DistMap *D, int x, int y) {
+	int i;
+	if(x < 0 || x >= D->w || y < 0 || y >= D->h)
+		return;
+	i = y * D->w + x;
+	if(D->prev[i] != -2)
+		_d_dist_unlink(D, i);
+	D->dist[i] = 0;
+	_d_dist_push(D, i);
+}
+
+static char _d_dist_tile(D_Dungeon *M, int i) {
+	if(M->map)
+		return M->map[i];
+	return d_get_tile(M, i % M->map_w, i / M->map_w);
+}
+
+/* Breadth-first search: All the costs are 1, so the tiles are dequeued in
+order of distance if they're queued at the back */
+static void _d_dist_bfs(D_DistMap *D, D_Dungeon *M) {
+	int *queue = D->next, head = 0, tail = 0, i, k;
+
+	/* Move the queued tiles into the FIFO */
+	for(k = 0; k < 256; k++) {
+		for(i = D->heads[k]; i >= 0; i = D->next[i])
+			D->prev[i] = -3;
+		D->heads[k] = -1;
+	}
+	for(i = 0; i < D->w * D->h; i++) {
+		if(D->prev[i] == -3) {
+			D->prev[i] = -2;
+			queue[tail++] = i;
+		}
+	}
+	D->queued = 0;
+
+	while(head < tail) {
+		int n[4], d;
+		i = queue[head++];
+		d = D->dist[i] + 1;
+		n[0] = i % D->w > 0 ? i - 1 : -1;
+		n[1] = i % D->w < D->w - 1 ? i + 1 : -1;
+		n[2] = i >= D->w ? i - D->w : -1;
+		n[3] = i < (D->h - 1) * D->w ? i + D->w : -1;
+		for(k = 0; k < 4; k++) {
+			if(n[k] < 0 || d >= D->dist[n[k]] || !D->cost[(unsigned char)_d_dist_tile(M, n[k])])
+				continue;
+			D->dist[n[k]] = d;
+			queue[tail++] = n[k];
 		}
-		putc('\n', f);
 	}
 }
 
+static void _d_dist_dijkstra(D_DistMap *D, D_Dungeon *M) {
+	int i, k, d = D_FAR;
+
+	/* Start at the closest queued tile */
+	for(k = 0; k < 256; k++) {
+		for(i = D->heads[k]; i >= 0; i = D->next[i])
+			if(D->dist[i] < d)
+				d = D->dist[i];
+	}
+
+	while(D->queued > 0) {
+		int n[4], c;
+		while(D->heads[d & 0xFF] < 0)
+			d++;
+		i = D->heads[d & 0xFF];
+		_d_dist_unlink(D, i);
+
+		n[0] = i % D->w > 0 ? i - 1 : -1;
+		n[1] = i % D->w < D->w - 1 ? i + 1 : -1;
+		n[2] = i >= D->w ? i - D->w : -1;
+		n[3] = i < (D->h - 1) * D->w ? i + D->w : -1;
+		for(k = 0; k < 4; k++) {
+			if(n[k] < 0 || !(c = D->cost[(unsigned char)_d_dist_tile(M, n[k])]))
+				continue;
+			if(d + c >= D->dist[n[k]])
+				continue;
+			if(D->prev[n[k]] != -2)
+				_d_dist_unlink(D, n[k]);
+			D->dist[n[k]] = d + c;
+			_d_dist_push(D, n[k]);
+		}
+	}
+}
+
+/* Computes the distances from the sources added since the map was cleared */
+void d_dist_compute(D_DistMap *D, D_Dungeon *M) {
+	int k, bfs = 1;
+	for(k = 0; k < 256; k++) {
+		if(D->cost[k] > 1)
+			bfs = 0;
+	}
+	if(bfs)
+		_d_dist_bfs(D, M);
+	else
+		_d_dist_dijkstra(D, M);
+}
+
+/* Computes the distances from the single tile x,y */
+void d_dist_from(D_DistMap *D, D_Dungeon *M, int x, int y) {
+	d_dist_clear(D);
+	d_dist_add_source(D, x, y);
+	d_dist_compute(D, M);
+}
+
+/* Updates the distances after tile x,y became cheaper to enter,
+like when a door is opened. Only the distances that get shorter are
+touched. If a tile becomes more expensive (like when a door is closed)
+the distances have to be computed again from scratch */
+void d_dist_update(D_DistMap *D, D_Dungeon *M, int x, int y) {
+	int i, k, c, n[4], best = D_FAR;
+	if(x < 0 || x >= D->w || y < 0 || y >= D->h)
+		return;
+	i = y * D->w + x;
+	if(!(c = D->cost[(unsigned char)_d_dist_tile(M, i)]))
+		return;
+
+	n[0] = x > 0 ? i - 1 : -1;
+	n[1] = x < D->w - 1 ? i + 1 : -1;
+	n[2] = y > 0 ? i - D->w : -1;
+	n[3] = y < D->h - 1 ? i + D->w : -1;
+	for(k = 0; k < 4; k++) {
+		if(n[k] >= 0 && D->dist[n[k]] < best)
+			best = D->dist[n[k]];
+	}
+	if(best == D_FAR || best + c >= D->dist[i])
+		return;
+
+	D->dist[i] = best + c;
+	_d_dist_push(D, i);
+	d_dist_compute(D, M);
+}
+
+int d_dist_get(D_DistMap *D, int x, int y) {
+	if(x < 0 || x >= D->w || y < 0 || y >= D->h)
+		return D_FAR;
+	return D->dist[y * D->w + x];
+}
+
+/* Finds the neighbour of x,y that is closest to a source, to follow
+the flow field downhill. Returns 0 if there's no closer neighbour */
+int d_dist_step(D_DistMap *D, int x, int y, D_Point *next) {
+	static const int dx[] = {-1, 1, 0, 0}, dy[] = {0, 0, -1, 1};
+	int k, best = d_dist_get(D, x, y), found = 0;
+	for(k = 0; k < 4; k++) {
+		int d = d_dist_get(D, x + dx[k], y + dy[k]);
+		if(d < best) {
+			best = d;
+			next->x = x + dx[k];
+			next->y = y + dy[k];
+			found = 1;
+		}
+	}
+	return found;
+}
+
 #endif /* DUNGEON_IMPLEMENTATION */
 #endif /* DUNGEON_H */
-
@@ -1,7 +1,8 @@
 /*
  * Generates a SVG of a dungeon generated in `dungeon.c` in the style of
  * [dysonlogos][] using the Poisson disc-based [hatching][] technique
- * that [watabou][] used in his dungeon generator.
+ * that [watabou][] used in his dungeon generator. The same drawing can
+ * also be rendered straight to a PNG or GIF through `raster.c`.
  *
  * [watabou]: https://watabou.itch.io/one-page-dungeon
  * [hatching]: https://www.patreon.com/posts/hatching-in-1pdg-31716880
@@ -13,26 +14,557 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
 
+#include <pthread.h>
+#include <unistd.h>
+
+/* The last error is a global that the batch threads would race on */
+#define BM_LAST_ERROR 0
+#define BMPH_IMPLEMENTATION
+#include "bmph.h"
+
 #define DUNGEON_IMPLEMENTATION
 #include "dungeon.c"
 
 #define POISSON_IMPLEMENTATION
 #include "poisson.c"
 
-static float frand() {
-	return ((float)rand())/RAND_MAX;
+#define SVG_IMPLEMENTATION
+#include "svg.c"
+
+#define RASTER_IMPLEMENTATION
+#include "raster.c"
+
+/* The format of the raster images; PNGs need libpng */
+#ifdef USEPNG
+# define RASTER_EXT	"png"
+#else
+# define RASTER_EXT	"gif"
+#endif
+
+static int copy_stream(FILE *from, FILE *to) {
+	char buf[8192];
+	size_t n;
+	rewind(from);
+	while((n = fread(buf, 1, sizeof buf, from)) > 0) {
+		if(fwrite(buf, 1, n, to) != n)
+			return 0;
+	}
+	return !ferror(from);
+}
+
+/* The symbols that the level is drawn with. They go into the SVG's <defs>
+to be <use>d from there, and the raster images draw their paths directly.
+Each one is as big as its viewBox; those that are `placed` have x and y
+attributes that put their origin where they're used */
+struct shape {
+	const char *d;
+	const char *fill, *stroke;
+	float width;
+	const char *dash;
+};
+
+struct symbol {
+	const char *id;
+	float x, y, w, h;
+	int placed;
+	struct shape shapes[2];
+};
+
+static const struct symbol symbols[] = {
+	{"floor", -1, -1, 12, 12, 0, {
+		{"M -0.2 -0.2 L 10.2 -0.2 L 10.2 10.2 L -0.2 10.2 Z", "#FFF", NULL}}},
+
+	{"wall-l", -1, -1, 12, 12, 0, {
+		{"M 0 0 C 0.2 2.5, -0.2 7.5, 0 10", NULL, "black", 0.5}}},
+	{"wall-r", -1, -1, 12, 12, 0, {
+		{"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10", NULL, "black", 0.5}}},
+	{"wall-t", -1, -1, 12, 12, 0, {
+		{"M 0 0 C 2.5 0.2, 7.5 -0.2, 10 0", NULL, "black", 0.5}}},
+	{"wall-b", -1, -1, 12, 12, 0, {
+		{"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10", NULL, "black", 0.5}}},
+
+	{"floor-r1", -1, -1, 12, 12, 0, {
+		{"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10", NULL, "black", 0.125, "0.3 1.5 1 2.5 0.4 2"}}},
+	{"floor-r2", -1, -1, 12, 12, 0, {
+		{"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10", NULL, "black", 0.125, "0.7 2.5 0.7 1.5 0.5 2"}}},
+	{"floor-r3", -1, -1, 12, 12, 0, {
+		{"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10", NULL, "black", 0.125, "0.7 1.5 0.7 1 0.5 2"}}},
+	{"floor-b1", -1, -1, 12, 12, 0, {
+		{"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10", NULL, "black", 0.125, "0.3 1.5 1 2.5 0.4 2"}}},
+	{"floor-b2", -1, -1, 12, 12, 0, {
+		{"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10", NULL, "black", 0.125, "0.7 2.5 0.7 1.5 0.5 2"}}},
+	{"floor-b3", -1, -1, 12, 12, 0, {
+		{"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10", NULL, "black", 0.125, "0.7 1.5 0.7 1 0.5 2"}}},
+
+	{"blobs", -3, -3, 6, 6, 1, {
+		{"M -0.01 -2.88 C -0.86 -2.92 -1.02 -2.89 -2.22 -2.13 C -2.58 -1.96 -2.83 -1.13 -2.89 -0.08 C -3 0.63 -2.61 1.18 -2.2 2.01 C -1.66 2.77 -0.59 2.73 -0.01 2.73 C 0.69 2.8 1.79 2.73 2.17 2.47 C 2.84 2.24 2.86 0.82 2.85 -0.05 C 2.83 -0.68 2.78 -2.05 2.29 -2.1 C 1.6 -2.31 1.21 -2.92 0 -2.89",
+			"#EEE", NULL}}},
+	{"strokes", -2, -2, 4, 4, 1, {
+		{"M-1.5,-1.5 C -1.75,-0.5 -1.25,0.5 -1.5,1.5 M0,-1.75 C -0.2,-0.5 0.2,0.5 0,1.5   M1.5,-1.5 C 1.75,-0.5 1.25,0.5 1.5,1.5",
+			NULL, "black", 0.25}}},
+
+	{"stone1", -1, -1, 2, 2, 1, {
+		{"M -0.66 -0.7 Q -0.96 -0.45 -0.88 0.17 Q -0.9 0.4 -0.5 0.63 Q 0.065 0.87 0.44 0.76 C 0.9 0.56 1 -0.78 0.59 -0.8 C 0.15 -0.87 -0.54 -1.01 -0.66 -0.7 Z",
+			"white", "black", 0.25}}},
+	{"stone2", -1, -1, 2, 2, 1, {
+		{"M -0.34 -0.79 Q -0.69 -0.53 -0.73 -0.29 Q -0.73 -0.05 -0.47 0.14 Q -0.33 0.37 0.05 0.33 C 0.53 -0.05 0.62 -0.41 0.16 -0.65 C 0.15 -0.87 -0.23 -0.92 -0.34 -0.79 Z M 0.61 0.22 C 0.44 0.12 0.22 0.28 0.24 0.56 C 0.29 0.88 0.56 0.84 0.69 0.69 C 0.7333 0.5667 0.7767 0.4433 0.61 0.22",
+			"white", "black", 0.25}}},
+	{"stone3", -1, -1, 2, 2, 1, {
+		{"M -0.57 -0.41 Q -0.89 -0.15 -0.88 0.17 Q -0.77 0.57 -0.27 0.47 Q 0.28 0.58 0.46 0.37 C 0.62 0.23 0.73 -0.1 0.46 -0.41 C 0.28 -0.64 -0.15 -0.85 -0.56 -0.41",
+			"white", "black", 0.25}}},
+
+	{"door-floor", -1, -1, 12, 12, 0, {
+		{"M 0 0 L 3 0 L 3 1.3 L 7 1.3 L 7 0.01 L 10 0 L 10 10 L 7 10 L 7 8.7 L 3 8.7 L 3 10 L 0 10 Z",
+			"white", NULL}}},
+	{"doorway-floor", -1, -1, 12, 12, 0, {
+		{"M 2 0 L 2 2 L 0 2 L 0 10 L 10 10 L 10 2 L 8 2 L 8 0 Z ",
+			"white", NULL}}},
+	{"doorway", -1, -1, 12, 12, 0, {
+		{"M 0 0 C 0.46 0.07 0.77 -0.07 2 0 C 2.07 0.27 1.92 0.43 2 2 C 1.43 1.92 1.21 2.03 0 2 C 0.07 2.9 -0.14 4.05 0 10 M 10 10 C 9.83 3.45 10.1 2.91 10 2 C 8.64 1.87 8.51 2.03 8 2 C 8.12 0.62 7.93 0.33 8 0 C 9.21 -0.07 9.31 0.07 10 0 ",
+			NULL, "black", 0.5}}},
+	{"secret-door", -1, -1, 12, 12, 0, {
+		{"M 0 0 C 0.46 0.07 0.77 -0.07 2 0 C 2.07 0.27 1.92 0.43 2 2 C 1.43 1.92 1.21 2.03 0 2 C 0.07 2.9 -0.14 4.05 0 10 M 10 10 C 9.83 3.45 10.1 2.91 10 2 C 8.64 1.87 8.51 2.03 8 2 C 8.12 0.62 7.93 0.33 8 0 C 9.21 -0.07 9.31 0.07 10 0 M 2 1 C 5 -2 5 4 8 1",
+			NULL, "black", 0.5}}},
+	{"door", -1, -1, 12, 12, 0, {
+		{"M 0 0 C 2.1 0.17 2.53 0.12 2.94 0.03 C 2.99 0.51 3.02 0.87 2.99 1.36 C 4.16 1.3 6.05 1.35 7 1.39 C 7.03 0.84 7.01 0.42 6.96 0.04 C 8.22 -0.08 8.95 0.12 10 0 M 10 10 C 7.94 9.96 7.31 9.96 6.93 9.98 C 6.85 9.36 6.83 8.95 6.9 8.51 C 5.04 8.48 4.29 8.53 3.01 8.58 C 3.04 8.93 3.12 9.47 3.09 10.04 C 2.76 10.08 1.26 9.82 0 10 M 3.59 1.35 C 3.58 5.91 3.67 7.09 3.66 8.51 M 6.52 8.46 C 6.51 6.54 6.33 3.25 6.31 1.38 M 3.64 5.09 C 5.1 5.07 5.36 5.12 6.44 5.06",
+			NULL, "black", 0.5}}},
+
+	{"stairs", -6, -6, 12, 12, 0, {
+		{"M -3.86 -3.8 C -1.31 -3.77 1.61 -3.67 4.23 -3.7 M -1.67 3.19 C -0.45 3.16 0.75 3.19 1.68 3.29 M -3.16 -1.39 C -0.9433 -1.4667 1.0133 -1.4733 3.35 -1.51 M -2.43 0.97 C -0.97 0.86 1.05 0.89 2.45 0.91",
+			NULL, "black", 0.5}}},
+	{"cobwebs", -6, -6, 12, 12, 0, {
+		{"M -5 -5 M -5 -5 M -5 -5 C -4.51 -3.32 -3.86 -1.71 -3.37 -0.02 M -5 -5 C -4.01 -3.48 -2.8 -2.01 -1.95 -0.71 M -5 -5 C -3.43 -4.04 -2 -2.8 -0.77 -1.97 M -5 -5 C -3.35 -4.62 -1.78 -4.05 -0.21 -3.61 M -4.98 -0.56 C -4.74 -1.19 -4.33 -1.57 -3.75 -1.19 C -3.6 -1.75 -3.37 -1.9 -2.76 -1.85 C -2.79 -2.55 -2.42 -2.69 -1.94 -2.85 C -2 -3.4 -1.72 -3.76 -1.03 -3.86 C -1.5 -4.44 -1.38 -4.78 -0.92 -4.99 M -5.04 -2.65 C -4.85 -3.12 -4.62 -3.12 -4.29 -2.83 C -4.22 -3.16 -4.08 -3.4 -3.69 -3.14 C -3.63 -3.6 -3.49 -3.75 -3.14 -3.76 C -3.3 -4.11 -3.19 -4.34 -2.85 -4.4 C -3.07 -4.72 -3.05 -4.9 -2.67 -5.01",
+			NULL, "black", 0.25}}},
+	{"statue", -1, -1, 12, 12, 0, {
+		{"M 1.58 4.88 C 1.39 3.5 3.32 1.79 5.08 2.06 C 6.56 2.23 7.33 3.04 7.7 4.69 C 7.58 8.01 5.18 7.56 4.9 7.64 C 3.9 7.53 2.22 7.34 1.95 5",
+			NULL, "black", 0.5},
+		{"M 5.01 2 c -0.55 0.38 -0.62 1.84 -0.87 1.83 C 3.19 3.88 1.83 3.76 1.73 3.93 C 1.69 4.36 3.69 5.04 3.48 5.24 C 3.61 5.49 2.87 7.18 3.09 7.37 C 3.67 7.55 4.64 5.92 4.88 5.94 C 5.09 5.7 6.56 7.31 6.8 7.2 C 6.99 6.95 6.14 5.28 6.38 5.2 C 6.66 4.79 7.33 4.5 7.61 3.9 C 7.46 3.82 5.72 4.09 5.68 3.86 C 5.39 3.5 5.26 1.81 5.02 2",
+			"black", NULL}}},
+	{"crack-t", -1, -1, 12, 12, 0, {
+		{"M 4.19 0 C 2.91 1.02 2.79 0.98 2.2 1.49 C 3.22 1.93 3.67 2.25 4.48 2.83 C 4.1 3.17 2.56 3.98 2.6 4.1 C 3.51 6.25 4.04 7.15 4.13 7.04 C 3.84 5.84 3.42 4.98 3.19 4.17 C 4.13 3.65 4.85 3.12 5.26 2.9 C 4.84 2.37 4.35 1.85 3.71 1.36 C 3.87 1.15 5.49 0.46 6.19 0",
+			"black", NULL}}},
+	{"pillar", -3, -3, 10, 10, 1, {
+		{"M 0.08 -2.44 C -1.5 -2.35 -1.98 -1.48 -2.19 -0.03 C -2.05 1.32 -1.28 2.02 0.04 2.18 C 1.2 2.07 2.31 1 2.3 0 C 2.16 -1.22 1.65 -2.14 -0.05 -2.3",
+			"#EEE", "black", 0.5}}},
+	{NULL}
+};
+
+#define N_SYMBOLS	(sizeof symbols / sizeof symbols[0] - 1)
+
+static const struct symbol *find_symbol(const char *id) {
+	const struct symbol *s;
+	for(s = symbols; s->id; s++)
+		if(!strcmp(s->id, id))
+			return s;
+	return NULL;
+}
+
+/* Something to draw the level on, as a list of symbols placed like
+<use>s would place them. The level's random details are rolled while it
+is drawn, so to draw the same level on more than one canvas they're
+chained through `next`, and everything is drawn on all of them at once */
+struct canvas {
+	/* Translated to x,y and rotated by `rot` degrees around cx,cy */
+	void (*use)(struct canvas *C, const char *id, float x, float y, int rot, float cx, float cy);
+	/* Translated to x,y, rotated by `rot` degrees and scaled by sx,sy */
+	void (*use_scaled)(struct canvas *C, const char *id, float x, float y, int rot, float sx, float sy);
+	void (*group)(struct canvas *C, float x, float y);
+	void (*group_end)(struct canvas *C);
+	/* The hatching's strokes are drawn over all of its blobs, so they
+	are held back until `hatch_end()` */
+	void (*strokes)(struct canvas *C, float x, float y, int rot, float sx, float sy);
+	void (*hatch_end)(struct canvas *C);
+	struct canvas *next;
+};
+
+static void use_rotated(struct canvas *C, const char *id, float x, float y, int rot, float cx, float cy) {
+	for(; C; C = C->next)
+		C->use(C, id, x, y, rot, cx, cy);
+}
+
+static void use(struct canvas *C, const char *id, float x, float y) {
+	use_rotated(C, id, x, y, 0, 0, 0);
+}
+
+static void use_scaled(struct canvas *C, const char *id, float x, float y, int rot, float sx, float sy) {
+	for(; C; C = C->next)
+		C->use_scaled(C, id, x, y, rot, sx, sy);
 }
 
+static void group(struct canvas *C, float x, float y) {
+	for(; C; C = C->next)
+		C->group(C, x, y);
+}
+
+static void group_end(struct canvas *C) {
+	for(; C; C = C->next)
+		C->group_end(C);
+}
+
+/* The SVG canvas. The hatching's strokes go into a temporary file that
+is appended after the blobs. If `merge` is set, all the strokes go into
+a single <path> instead of a <use> per point. The blobs stay <use>s:
+Their shape is much longer than the <use> that places them */
+struct svg_canvas {
+	struct canvas C;
+	SvgWriter *W, *strokes;
+	FILE *tmp;
+	int merge;
+};
+
+/* The shape of the #strokes symbol, for merging: Three
+moves that are each followed by a cubic curve */
+static const float stroke_shape[] = {
+	-1.5, -1.5, -1.75, -0.5, -1.25, 0.5, -1.5, 1.5,
+	0, -1.75, -0.2, -0.5, 0.2, 0.5, 0, 1.5,
+	1.5, -1.5, 1.75, -0.5, 1.25, 0.5, 1.5, 1.5
+};
+
+/* Appends `shape` to the current path like a <use> with
+transform="translate(x y) rotate(rot) scale(sx sy)" would draw it */
+static void merge_shape(SvgWriter *W, const float *shape, int curves, float x, float y, int rot, float sx, float sy) {
+	float p[2 + 4 * 6], c = cos(rot * M_PI / 180), s = sin(rot * M_PI / 180);
+	int i, n = 2 + curves * 6;
+	assert(curves <= 4);
+	for(i = 0; i < n; i += 2) {
+		float u = shape[i] * sx, v = shape[i + 1] * sy;
+		p[i] = x + c * u - s * v;
+		p[i + 1] = y + s * u + c * v;
+	}
+	svg_path_move(W, p[0], p[1]);
+	for(i = 2; i < n; i += 6)
+		svg_path_curve(W, p[i], p[i + 1], p[i + 2], p[i + 3], p[i + 4], p[i + 5]);
+}
+
+static void svg_canvas_use(struct canvas *C, const char *id, float x, float y, int rot, float cx, float cy) {
+	svg_use_rotated(((struct svg_canvas *)C)->W, id, x, y, rot, cx, cy);
+}
+
+static void svg_canvas_use_scaled(struct canvas *C, const char *id, float x, float y, int rot, float sx, float sy) {
+	svg_use_scaled(((struct svg_canvas *)C)->W, id, x, y, rot, sx, sy);
+}
+
+static void svg_canvas_group(struct canvas *C, float x, float y) {
+	svg_group(((struct svg_canvas *)C)->W, x, y);
+}
+
+static void svg_canvas_group_end(struct canvas *C) {
+	svg_group_end(((struct svg_canvas *)C)->W);
+}
+
+static void svg_canvas_strokes(struct canvas *C, float x, float y, int rot, float sx, float sy) {
+	struct svg_canvas *S = (struct svg_canvas *)C;
+	int k;
+	if(!S->strokes)
+		return;
+	if(S->merge) {
+		for(k = 0; k < 3; k++)
+			merge_shape(S->strokes, stroke_shape + k * 8, 1, x, y, rot, sx, sy);
+	} else
+		svg_use_scaled(S->strokes, "strokes", x, y, rot, sx, sy);
+}
+
+static void svg_canvas_hatch_end(struct canvas *C) {
+	struct svg_canvas *S = (struct svg_canvas *)C;
+	if(!S->strokes)
+		return;
+	if(S->merge)
+		svg_path_end(S->strokes, "fill=\"none\" stroke=\"black\" stroke-width=\"0.25\" stroke-linecap=\"round\"");
+	if(!svg_close(S->strokes) || !svg_copy(S->W, S->tmp))
+		fprintf(stderr, "Unable to write the hatching\n");
+	fclose(S->tmp);
+	S->strokes = NULL;
+}
+
+static void svg_defs(SvgWriter *W) {
+	const struct symbol *s;
+	const struct shape *p;
+	char width[16];
+	int i;
+
+	svg_str(W, " <defs>\n");
+	for(s = symbols; s->id; s++) {
+		svg_str(W, " <symbol id=\"");
+		svg_str(W, s->id);
+		svg_str(W, "\" width=\"");
+		svg_num(W, s->w);
+		svg_str(W, "\" height=\"");
+		svg_num(W, s->h);
+		svg_str(W, "\" viewBox=\"");
+		svg_num(W, s->x);
+		svg_str(W, " ");
+		svg_num(W, s->y);
+		svg_str(W, " ");
+		svg_num(W, s->w);
+		svg_str(W, " ");
+		svg_num(W, s->h);
+		if(s->placed) {
+			svg_str(W, "\" x=\"");
+			svg_num(W, s->x);
+			svg_str(W, "\" y=\"");
+			svg_num(W, s->y);
+		}
+		svg_str(W, "\">\n");
+		for(i = 0; i < 2 && s->shapes[i].d; i++) {
+			p = &s->shapes[i];
+			svg_str(W, "  <path d=\"");
+			svg_str(W, p->d);
+			svg_str(W, "\" fill=\"");
+			svg_str(W, p->fill ? p->fill : "none");
+			svg_str(W, "\" stroke=\"");
+			if(p->stroke) {
+				svg_str(W, p->stroke);
+				/* Widths can have more than 2 decimals */
+				snprintf(width, sizeof width, "%g", p->width);
+				svg_str(W, "\" stroke-width=\"");
+				svg_str(W, width);
+				if(p->dash) {
+					svg_str(W, "\" stroke-dasharray=\"");
+					svg_str(W, p->dash);
+				}
+				svg_str(W, "\" stroke-linecap=\"round");
+			} else
+				svg_str(W, "none");
+			svg_str(W, "\"/>\n");
+		}
+		svg_str(W, " </symbol>\n");
+	}
+	svg_str(W, " </defs>\n\n");
+}
+
+static int svg_canvas_open(struct svg_canvas *S, D_Dungeon *M, FILE *f, int merge) {
+	if(!(S->W = svg_open(f))) {
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+	S->C.use = svg_canvas_use;
+	S->C.use_scaled = svg_canvas_use_scaled;
+	S->C.group = svg_canvas_group;
+	S->C.group_end = svg_canvas_group_end;
+	S->C.strokes = svg_canvas_strokes;
+	S->C.hatch_end = svg_canvas_hatch_end;
+	S->C.next = NULL;
+	S->merge = merge;
+
+	svg_str(S->W, "<svg viewBox=\"0 0 ");
+	svg_int(S->W, M->map_w * 10);
+	svg_str(S->W, " ");
+	svg_int(S->W, M->map_h * 10);
+	svg_str(S->W, "\" xmlns=\"http://www.w3.org/2000/svg\">\n");
+	svg_defs(S->W);
+
+	S->strokes = NULL;
+	if(!(S->tmp = tmpfile()) || !(S->strokes = svg_open(S->tmp))) {
+		fprintf(stderr, "Unable to create a temporary file for the hatching\n");
+		if(S->tmp)
+			fclose(S->tmp);
+	} else if(merge)
+		svg_path_begin(S->strokes);
+	return 1;
+}
+
+static int svg_canvas_close(struct svg_canvas *S) {
+	svg_canvas_hatch_end(&S->C);
+	svg_str(S->W, "</svg>\n");
+	return svg_close(S->W);
+}
+
+/* The raster canvas draws the symbols' paths into a bitmap with `scale`
+pixels per unit. The paths are parsed once, when the canvas is opened.
+The hatching's strokes are kept in a list until the hatching is done */
+struct hatch_stroke {
+	float x, y, sx, sy;
+	int rot;
+};
+
+struct raster_canvas {
+	struct canvas C;
+	Bitmap *b;
+	float scale, gx, gy;
+	RsPath *paths[N_SYMBOLS][2];
+	struct hatch_stroke *strokes;
+	int n_strokes, a_strokes;
+};
+
+/* Strokes thinner than a pixel are faded towards the white background
+by how much of the pixel they cover, and dashed ones by half again */
+static bm_color_t raster_color(const char *color, float cover) {
+	bm_color_t c = bm_atoi(color);
+	if(cover < 1)
+		c = bm_lerp(bm_rgb(255, 255, 255), c, cover);
+	/* Neither of those set the alpha */
+	return c | 0xFF000000;
+}
+
+static void raster_symbol(struct raster_canvas *R, const char *id, RsMatrix *m) {
+	const struct symbol *s = find_symbol(id);
+	const struct shape *p;
+	RsPath *path;
+	float cover;
+	int i;
+
+	assert(s);
+	if(!s->placed)
+		rs_translate(m, -s->x, -s->y);
+	for(i = 0; i < 2 && s->shapes[i].d; i++) {
+		p = &s->shapes[i];
+		path = R->paths[s - symbols][i];
+		if(p->fill) {
+			bm_set_color(R->b, raster_color(p->fill, 1));
+			rs_fill(R->b, path, m);
+		}
+		if(p->stroke) {
+			cover = rs_size(m, p->width);
+			if(p->dash)
+				cover /= 2;
+			bm_set_color(R->b, raster_color(p->stroke, cover));
+			rs_stroke(R->b, path, m, p->width);
+		}
+	}
+}
+
+static void raster_canvas_use(struct canvas *C, const char *id, float x, float y, int rot, float cx, float cy) {
+	struct raster_canvas *R = (struct raster_canvas *)C;
+	RsMatrix m;
+	rs_identity(&m);
+	rs_scale(&m, R->scale, R->scale);
+	rs_translate(&m, R->gx + x + cx, R->gy + y + cy);
+	rs_rotate(&m, rot);
+	rs_translate(&m, -cx, -cy);
+	raster_symbol(R, id, &m);
+}
+
+static void raster_canvas_use_scaled(struct canvas *C, const char *id, float x, float y, int rot, float sx, float sy) {
+	struct raster_canvas *R = (struct raster_canvas *)C;
+	RsMatrix m;
+	rs_identity(&m);
+	rs_scale(&m, R->scale, R->scale);
+	rs_translate(&m, R->gx + x, R->gy + y);
+	rs_rotate(&m, rot);
+	rs_scale(&m, sx, sy);
+	raster_symbol(R, id, &m);
+}
+
+static void raster_canvas_group(struct canvas *C, float x, float y) {
+	struct raster_canvas *R = (struct raster_canvas *)C;
+	R->gx = x;
+	R->gy = y;
+}
+
+static void raster_canvas_group_end(struct canvas *C) {
+	struct raster_canvas *R = (struct raster_canvas *)C;
+	R->gx = R->gy = 0;
+}
+
+static void raster_canvas_strokes(struct canvas *C, float x, float y, int rot, float sx, float sy) {
+	struct raster_canvas *R = (struct raster_canvas *)C;
+	struct hatch_stroke *s;
+	if(R->n_strokes == R->a_strokes) {
+		int a = R->a_strokes ? R->a_strokes * 2 : 1024;
+		if(!(s = realloc(R->strokes, a * sizeof *s))) {
+			fprintf(stderr, "no memory\n");
+			return;
+		}
+		R->strokes = s;
+		R->a_strokes = a;
+	}
+	s = &R->strokes[R->n_strokes++];
+	s->x = x;
+	s->y = y;
+	s->sx = sx;
+	s->sy = sy;
+	s->rot = rot;
+}
+
+static void raster_canvas_hatch_end(struct canvas *C) {
+	struct raster_canvas *R = (struct raster_canvas *)C;
+	struct hatch_stroke *s;
+	int i;
+	for(i = 0; i < R->n_strokes; i++) {
+		s = &R->strokes[i];
+		raster_canvas_use_scaled(C, "strokes", s->x, s->y, s->rot, s->sx, s->sy);
+	}
+	free(R->strokes);
+	R->strokes = NULL;
+	R->n_strokes = R->a_strokes = 0;
+}
+
+static int raster_canvas_close(struct raster_canvas *R, const char *path);
+
+/* Every bitmap holds a reference to bmph's built-in font, and the count
+isn't atomic, so bitmaps are created and freed under this lock */
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* `px` is the number of pixels per tile */
+static int raster_canvas_open(struct raster_canvas *R, D_Dungeon *M, float px) {
+	int i, k;
+
+	pthread_mutex_lock(&bitmap_lock);
+	R->b = bm_create((int)ceilf(M->map_w * px), (int)ceilf(M->map_h * px));
+	pthread_mutex_unlock(&bitmap_lock);
+	if(!R->b) {
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+	R->C.use = raster_canvas_use;
+	R->C.use_scaled = raster_canvas_use_scaled;
+	R->C.group = raster_canvas_group;
+	R->C.group_end = raster_canvas_group_end;
+	R->C.strokes = raster_canvas_strokes;
+	R->C.hatch_end = raster_canvas_hatch_end;
+	R->C.next = NULL;
+	R->scale = px / 10;
+	R->gx = R->gy = 0;
+	R->strokes = NULL;
+	R->n_strokes = R->a_strokes = 0;
+
+	memset(R->paths, 0, sizeof R->paths);
+	for(i = 0; symbols[i].id; i++)
+		for(k = 0; k < 2 && symbols[i].shapes[k].d; k++)
+			if(!(R->paths[i][k] = rs_path(symbols[i].shapes[k].d))) {
+				fprintf(stderr, "Unable to parse the path of #%s\n", symbols[i].id);
+				raster_canvas_close(R, NULL);
+				return 0;
+			}
+
+	bm_set_color(R->b, bm_rgb(255, 255, 255));
+	bm_clear(R->b);
+	return 1;
+}
+
+/* Saves the image to `path` if it isn't NULL */
+static int raster_canvas_close(struct raster_canvas *R, const char *path) {
+	int i, ok = 1;
+	for(i = 0; i < (int)N_SYMBOLS; i++) {
+		rs_path_free(R->paths[i][0]);
+		rs_path_free(R->paths[i][1]);
+	}
+	free(R->strokes);
+	if(path)
+		ok = bm_save(R->b, path);
+	pthread_mutex_lock(&bitmap_lock);
+	bm_free(R->b);
+	pthread_mutex_unlock(&bitmap_lock);
+	return ok;
+}
+
+/* The hatching is streamed onto the canvases a tile of Poisson
+points at a time, as the sampler finishes them */
+struct hatch {
+	D_Dungeon *M;
+	struct canvas *C;
+	int i;
+};
+
 static int wall_constraint(struct poisson *P, float x, float y) {
-	D_Dungeon *M = P->data;
+	D_Dungeon *M = ((struct hatch *)P->data)->M;
 	float fx, fy;
 	int mx, my;
 
-	(void)P;
-
 	x /= 10.0;
 	y /= 10.0;
 
@@ -52,153 +584,100 @@ static int wall_constraint(struct poisson *P, float x, float y) {
 	return 0;
 }
 
-static void drawSvg(D_Dungeon *M, FILE *f) {
-	int i, j;
+static void emit_hatching(struct poisson *P, const struct point *points, int n) {
+	struct hatch *H = P->data;
+	D_Dungeon *M = H->M;
+	struct canvas *C;
+	int i;
+	for(i = 0; i < n; i++, H->i++) {
+		float x = points[i].x, y = points[i].y;
+		float sx = d_frand(M)*0.1 + 0.9;
+		float sy = d_frand(M)*0.1 + 0.9;
+		int rot = ((H->i*60) + D_RAND(M, 30) - 15)%360;
+		use_scaled(H->C, "blobs", x, y, rot, sx, sy);
+
+		sx = d_frand(M)*0.1 + 0.9;
+		sy = d_frand(M)*0.1 + 0.9;
+		rot = ((H->i*60) + D_RAND(M, 30) - 15)%360;
+		for(C = H->C; C; C = C->next)
+			C->strokes(C, x, y, rot, sx, sy);
+	}
+}
+
+static void stone(struct canvas *C, D_Dungeon *M, const char *id) {
+	float sx = d_frand(M)*0.1 + 0.9;
+	float sy = d_frand(M)*0.1 + 0.9;
+	float x = d_frand(M)*7.0 + 2.0;
+	float y = d_frand(M)*7.0 + 2.0;
+	use_scaled(C, id, x, y, D_RAND(M, 360) - 180, sx, sy);
+}
+
+static const char *floor_r[] = {"floor-r1", "floor-r2", "floor-r3"};
+static const char *floor_b[] = {"floor-b1", "floor-b2", "floor-b3"};
+
+/* Minimum distance between the hatching's points */
+#define HATCH_R		2.75
+
+/* Size of the tileable hatching pattern cached by `-t` */
+#define HATCH_TILE	320
+
+/* Loads the tileable hatching pattern from `path`, or samples
+it and saves it there if the file is missing or doesn't match */
+static int load_hatch_tile(struct poisson *T, const char *path) {
+	poisson_init(T);
+	if(poisson_load(T, path) && T->r == (float)HATCH_R && T->w == HATCH_TILE && T->h == HATCH_TILE)
+		return 1;
+
+	poisson_seed(T, 0);
+	T->r = HATCH_R;
+	T->w = HATCH_TILE;
+	T->h = HATCH_TILE;
+	T->x0.x = HATCH_TILE / 2;
+	T->x0.y = HATCH_TILE / 2;
+	if(!poisson_plot_toroidal(T))
+		return 0;
+	/* Loading it back quantises the points like they would be in later runs */
+	if(!poisson_save(T, path) || !poisson_load(T, path))
+		fprintf(stderr, "Unable to save %s\n", path);
+	return 1;
+}
+
+static int pillar_room(D_Room *r) {
+	return !(r->flags & (D_FLAG_START_ROOM | D_FLAG_END_ROOM | D_FLAG_GONE_ROOM)) && r->w * r->h >= 8;
+}
+
+/* Draws the level on the canvas `C` and the ones chained to it.
+`threads` is the number of threads to sample the hatching on.
+If `tile` isn't NULL, the hatching is stamped from it instead */
+static void draw_level(D_Dungeon *M, struct canvas *C, int threads, const struct poisson *tile) {
+	int i, j, tries;
 	struct poisson P;
+	struct hatch H;
+	struct canvas *c;
 	D_Room *r;
 
 	poisson_init(&P);
-	P.r = 2.75;
+	poisson_seed(&P, d_rand(M, 0x7FFFFFFF));
+	P.r = HATCH_R;
 	P.w = (M->map_w+1) * 10;
 	P.h = (M->map_h+1) * 10;
-	P.x0.y = (M->rooms[0].y + M->rooms[0].h/2) * 10;
-	P.x0.x = (M->rooms[0].x + M->rooms[0].w/2) * 10;
 	P.constraint = wall_constraint;
-	P.data = M;
+	P.data = &H;
+
+	H.M = M;
+	H.C = C;
+	H.i = 0;
 
-	if(!poisson_plot(&P)) {
+	if(tile) {
+		float ox = d_frand(M) * tile->w, oy = d_frand(M) * tile->h;
+		if(!poisson_stamp(&P, tile, ox, oy, emit_hatching))
+			fprintf(stderr, "Couldn't stamp the hatching :(\n");
+	} else if(!poisson_plot_tiled(&P, emit_hatching, threads)) {
 		fprintf(stderr, "Couldn't do Poisson Disk thing :(\n");
 		/* return; */
 	}
-
-	fprintf(f, "<svg viewBox=\"0 0 %d %d\" xmlns=\"http://www.w3.org/2000/svg\">\n", M->map_w * 10, M->map_h * 10);
-
-	fprintf(f, " <defs>\n");
-	fprintf(f, " <symbol id=\"floor\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <rect x=\"-0.2\" y=\"-0.2\" width=\"10.4\" height=\"10.4\" fill=\"#FFF\"/>\n");
-	fprintf(f, " </symbol>\n");
-
-	fprintf(f, " <symbol id=\"wall-l\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 0 C 0.2 2.5, -0.2 7.5, 0 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"wall-r\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"wall-t\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 0 C 2.5 0.2, 7.5 -0.2, 10 0\" stroke=\"black\" fill=\"none\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"wall-b\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-
-	fprintf(f, " <symbol id=\"floor-r1\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.125\"  stroke-dasharray=\"0.3 1.5 1 2.5 0.4 2\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"floor-r2\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.125\"  stroke-dasharray=\"0.7 2.5 0.7 1.5 0.5 2\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"floor-r3\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 10 0 C 10.2 2.5, 9.8 7.5, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.125\"  stroke-dasharray=\"0.7 1.5 0.7 1 0.5 2\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"floor-b1\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.125\"  stroke-dasharray=\"0.3 1.5 1 2.5 0.4 2\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"floor-b2\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.125\"  stroke-dasharray=\"0.7 2.5 0.7 1.5 0.5 2\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"floor-b3\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 10 C 2.5 10.2, 7.5 9.8, 10 10\" stroke=\"black\" fill=\"none\" stroke-width=\"0.125\"  stroke-dasharray=\"0.7 1.5 0.7 1 0.5 2\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-
-	fprintf(f, " <symbol id=\"blobs\" width=\"6\" height=\"6\" viewBox=\"-3 -3 6 6\" x=\"-3\" y=\"-3\">\n");
-	fprintf(f, "  <path d=\"M -0.01 -2.88 C -0.86 -2.92 -1.02 -2.89 -2.22 -2.13 C -2.58 -1.96 -2.83 -1.13 -2.89 -0.08 C -3 0.63 -2.61 1.18 -2.2 2.01 C -1.66 2.77 -0.59 2.73 -0.01 2.73 C 0.69 2.8 1.79 2.73 2.17 2.47 C 2.84 2.24 2.86 0.82 2.85 -0.05 C 2.83 -0.68 2.78 -2.05 2.29 -2.1 C 1.6 -2.31 1.21 -2.92 0 -2.89\"\n");
-	fprintf(f, "  fill=\"#EEE\" stroke=\"none\"/>\n");
-	fprintf(f, " </symbol>\n\n");
-	fprintf(f, "\n");
-
-	fprintf(f, " <symbol id=\"strokes\" width=\"4\" height=\"4\" viewBox=\"-2 -2 4 4\" x=\"-2\" y=\"-2\">\n");
-	fprintf(f, "  <path d=\"M-1.5,-1.5 C -1.75,-0.5 -1.25,0.5 -1.5,1.5 M0,-1.75 C -0.2,-0.5 0.2,0.5 0,1.5   M1.5,-1.5 C 1.75,-0.5 1.25,0.5 1.5,1.5\"\n");
-	fprintf(f, "  fill=\"none\" stroke=\"black\" stroke-width=\"0.25\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"stone1\" width=\"2\" height=\"2\" viewBox=\"-1 -1 2 2\" x=\"-1\" y=\"-1\">\n");
-	fprintf(f, "  <path d=\"M -0.66 -0.7 Q -0.96 -0.45 -0.88 0.17 Q -0.9 0.4 -0.5 0.63 Q 0.065 0.87 0.44 0.76 C 0.9 0.56 1 -0.78 0.59 -0.8 C 0.15 -0.87 -0.54 -1.01 -0.66 -0.7 Z\" \n");
-	fprintf(f, "   fill=\"white\" stroke=\"black\" stroke-width=\"0.25\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol> \n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"stone2\" width=\"2\" height=\"2\" viewBox=\"-1 -1 2 2\" x=\"-1\" y=\"-1\">\n");
-	fprintf(f, "  <path d=\"M -0.34 -0.79 Q -0.69 -0.53 -0.73 -0.29 Q -0.73 -0.05 -0.47 0.14 Q -0.33 0.37 0.05 0.33 C 0.53 -0.05 0.62 -0.41 0.16 -0.65 C 0.15 -0.87 -0.23 -0.92 -0.34 -0.79 Z M 0.61 0.22 C 0.44 0.12 0.22 0.28 0.24 0.56 C 0.29 0.88 0.56 0.84 0.69 0.69 C 0.7333 0.5667 0.7767 0.4433 0.61 0.22\" \n");
-	fprintf(f, "   fill=\"white\" stroke=\"black\" stroke-width=\"0.25\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"stone3\" width=\"2\" height=\"2\" viewBox=\"-1 -1 2 2\" x=\"-1\" y=\"-1\">\n");
-	fprintf(f, "  <path d=\"M -0.57 -0.41 Q -0.89 -0.15 -0.88 0.17 Q -0.77 0.57 -0.27 0.47 Q 0.28 0.58 0.46 0.37 C 0.62 0.23 0.73 -0.1 0.46 -0.41 C 0.28 -0.64 -0.15 -0.85 -0.56 -0.41\" \n");
-	fprintf(f, "   fill=\"white\" stroke=\"black\" stroke-width=\"0.25\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"door-floor\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 0 L 3 0 L 3 1.3 L 7 1.3 L 7 0.01 L 10 0 L 10 10 L 7 10 L 7 8.7 L 3 8.7 L 3 10 L 0 10 Z\" \n");
-	fprintf(f, "   fill=\"white\" stroke=\"none\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"doorway-floor\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 2 0 L 2 2 L 0 2 L 0 10 L 10 10 L 10 2 L 8 2 L 8 0 Z \" \n");
-	fprintf(f, "   fill=\"white\" stroke=\"none\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"doorway\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 0 C 0.46 0.07 0.77 -0.07 2 0 C 2.07 0.27 1.92 0.43 2 2 C 1.43 1.92 1.21 2.03 0 2 C 0.07 2.9 -0.14 4.05 0 10 M 10 10 C 9.83 3.45 10.1 2.91 10 2 C 8.64 1.87 8.51 2.03 8 2 C 8.12 0.62 7.93 0.33 8 0 C 9.21 -0.07 9.31 0.07 10 0 \" \n");
-	fprintf(f, "   fill=\"none\" stroke=\"black\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " <symbol id=\"secret-door\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 0 C 0.46 0.07 0.77 -0.07 2 0 C 2.07 0.27 1.92 0.43 2 2 C 1.43 1.92 1.21 2.03 0 2 C 0.07 2.9 -0.14 4.05 0 10 M 10 10 C 9.83 3.45 10.1 2.91 10 2 C 8.64 1.87 8.51 2.03 8 2 C 8.12 0.62 7.93 0.33 8 0 C 9.21 -0.07 9.31 0.07 10 0 M 2 1 C 5 -2 5 4 8 1\" \n");
-	fprintf(f, "   fill=\"none\" stroke=\"black\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"door\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 0 0 C 2.1 0.17 2.53 0.12 2.94 0.03 C 2.99 0.51 3.02 0.87 2.99 1.36 C 4.16 1.3 6.05 1.35 7 1.39 C 7.03 0.84 7.01 0.42 6.96 0.04 C 8.22 -0.08 8.95 0.12 10 0 M 10 10 C 7.94 9.96 7.31 9.96 6.93 9.98 C 6.85 9.36 6.83 8.95 6.9 8.51 C 5.04 8.48 4.29 8.53 3.01 8.58 C 3.04 8.93 3.12 9.47 3.09 10.04 C 2.76 10.08 1.26 9.82 0 10 M 3.59 1.35 C 3.58 5.91 3.67 7.09 3.66 8.51 M 6.52 8.46 C 6.51 6.54 6.33 3.25 6.31 1.38 M 3.64 5.09 C 5.1 5.07 5.36 5.12 6.44 5.06\" \n");
-	fprintf(f, "   fill=\"none\" stroke=\"black\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol> \n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"stairs\" width=\"12\" height=\"12\" viewBox=\"-6 -6 12 12\">\n");
-	fprintf(f, "  <path d=\"M -3.86 -3.8 C -1.31 -3.77 1.61 -3.67 4.23 -3.7 M -1.67 3.19 C -0.45 3.16 0.75 3.19 1.68 3.29 M -3.16 -1.39 C -0.9433 -1.4667 1.0133 -1.4733 3.35 -1.51 M -2.43 0.97 C -0.97 0.86 1.05 0.89 2.45 0.91\" \n");
-	fprintf(f, "   fill=\"none\" stroke=\"black\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"cobwebs\" width=\"12\" height=\"12\" viewBox=\"-6 -6 12 12\">\n");
-	fprintf(f, "  <path d=\"M -5 -5 M -5 -5 M -5 -5 C -4.51 -3.32 -3.86 -1.71 -3.37 -0.02 M -5 -5 C -4.01 -3.48 -2.8 -2.01 -1.95 -0.71 M -5 -5 C -3.43 -4.04 -2 -2.8 -0.77 -1.97 M -5 -5 C -3.35 -4.62 -1.78 -4.05 -0.21 -3.61 M -4.98 -0.56 C -4.74 -1.19 -4.33 -1.57 -3.75 -1.19 C -3.6 -1.75 -3.37 -1.9 -2.76 -1.85 C -2.79 -2.55 -2.42 -2.69 -1.94 -2.85 C -2 -3.4 -1.72 -3.76 -1.03 -3.86 C -1.5 -4.44 -1.38 -4.78 -0.92 -4.99 M -5.04 -2.65 C -4.85 -3.12 -4.62 -3.12 -4.29 -2.83 C -4.22 -3.16 -4.08 -3.4 -3.69 -3.14 C -3.63 -3.6 -3.49 -3.75 -3.14 -3.76 C -3.3 -4.11 -3.19 -4.34 -2.85 -4.4 C -3.07 -4.72 -3.05 -4.9 -2.67 -5.01\" \n");
-	fprintf(f, "   fill=\"none\" stroke=\"black\" stroke-width=\"0.25\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"statue\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 1.58 4.88 C 1.39 3.5 3.32 1.79 5.08 2.06 C 6.56 2.23 7.33 3.04 7.7 4.69 C 7.58 8.01 5.18 7.56 4.9 7.64 C 3.9 7.53 2.22 7.34 1.95 5\" \n");
-	fprintf(f, "   fill=\"none\" stroke=\"black\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, "  <path d=\"M 5.01 2 c -0.55 0.38 -0.62 1.84 -0.87 1.83 C 3.19 3.88 1.83 3.76 1.73 3.93 C 1.69 4.36 3.69 5.04 3.48 5.24 C 3.61 5.49 2.87 7.18 3.09 7.37 C 3.67 7.55 4.64 5.92 4.88 5.94 C 5.09 5.7 6.56 7.31 6.8 7.2 C 6.99 6.95 6.14 5.28 6.38 5.2 C 6.66 4.79 7.33 4.5 7.61 3.9 C 7.46 3.82 5.72 4.09 5.68 3.86 C 5.39 3.5 5.26 1.81 5.02 2\" \n");
-	fprintf(f, "   stroke=\"none\" fill=\"black\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-
-
-	fprintf(f, " <symbol id=\"crack-t\" width=\"12\" height=\"12\" viewBox=\"-1 -1 12 12\">\n");
-	fprintf(f, "  <path d=\"M 4.19 0 C 2.91 1.02 2.79 0.98 2.2 1.49 C 3.22 1.93 3.67 2.25 4.48 2.83 C 4.1 3.17 2.56 3.98 2.6 4.1 C 3.51 6.25 4.04 7.15 4.13 7.04 C 3.84 5.84 3.42 4.98 3.19 4.17 C 4.13 3.65 4.85 3.12 5.26 2.9 C 4.84 2.37 4.35 1.85 3.71 1.36 C 3.87 1.15 5.49 0.46 6.19 0\" \n");
-	fprintf(f, "  fill=\"black\" stroke=\"none\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, "\n");
-	fprintf(f, " <symbol id=\"pillar\" width=\"10\" height=\"10\" viewBox=\"-3 -3 10 10\" x=\"-3\" y=\"-3\">\n");
-	fprintf(f, "  <path d=\"M 0.08 -2.44 C -1.5 -2.35 -1.98 -1.48 -2.19 -0.03 C -2.05 1.32 -1.28 2.02 0.04 2.18 C 1.2 2.07 2.31 1 2.3 0 C 2.16 -1.22 1.65 -2.14 -0.05 -2.3\" \n");
-	fprintf(f, "  fill=\"#EEE\" stroke=\"black\" stroke-width=\"0.5\" stroke-linecap=\"round\"/>\n");
-	fprintf(f, " </symbol>\n");
-	fprintf(f, " </defs>\n\n");
-
-	for(i = 0; i < P.n_points; i++) {
-		float sx = frand()*0.1 + 0.9;
-		float sy = frand()*0.1 + 0.9;
-		fprintf(f, " <use href=\"#blobs\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", P.points[i].x, P.points[i].y, ((i*60) + D_RAND(30) - 15)%360, sx, sy);
-	}
-	for(i = 0; i < P.n_points; i++) {
-		float sx = frand()*0.1 + 0.9;
-		float sy = frand()*0.1 + 0.9;
-		fprintf(f, " <use href=\"#strokes\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", P.points[i].x, P.points[i].y, ((i*60) + D_RAND(30) - 15)%360, sx, sy);
-	}
+	for(c = C; c; c = c->next)
+		c->hatch_end(c);
 	poisson_done(&P);
 
 	for(j = 0; j < M->map_h; j++) {
@@ -208,9 +687,9 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 				D_Edge *edge = d_corridor_at(M, i, j);
 				assert(edge);
 				if(edge->direction == D_ORIENT_EW) {
-					fprintf(f, " <use href=\"#door-floor\" transform=\"translate(%d %d)\"/>\n", i * 10, j * 10);
+					use(C, "door-floor", i * 10, j * 10);
 				} else {
-					fprintf(f, " <use href=\"#door-floor\" transform=\"translate(%d %d) rotate(90 6 6)\"/>\n", i * 10, j * 10);
+					use_rotated(C, "door-floor", i * 10, j * 10, 90, 6, 6);
 				}
 			} else if(tile == D_TILE_SECRET){
 				int rot = 0, t;
@@ -241,7 +720,7 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 					else if((t = d_get_tile(M, i, j + 1)) == D_TILE_FLOOR || t == D_TILE_CROSSING)
 						rot = 180;
 				}
-				fprintf(f, " <use href=\"#doorway-floor\" transform=\"translate(%d %d) rotate(%d 6 6)\"/>\n", i * 10, j * 10, rot);
+				use_rotated(C, "doorway-floor", i * 10, j * 10, rot, 6, 6);
 			} else if(tile == 't') {
 				int rot = 0;
 				if(d_get_tile(M, i, j + 1) == D_TILE_FLOOR)
@@ -250,9 +729,9 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 					rot = 90;
 				if(d_get_tile(M, i-1, j) == D_TILE_FLOOR)
 					rot = -90;
-				fprintf(f, " <use href=\"#doorway-floor\" transform=\"translate(%d %d) rotate(%d 6 6)\"/>\n", i * 10, j * 10, rot);
+				use_rotated(C, "doorway-floor", i * 10, j * 10, rot, 6, 6);
 			} else if(!d_is_wall(M, i,j)) {
-				fprintf(f, " <use href=\"#floor\" transform=\"translate(%d %d)\"/>\n", i * 10, j * 10);
+				use(C, "floor", i * 10, j * 10);
 			}
 		}
 	}
@@ -263,54 +742,66 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 			if(d_is_wall(M, i,j))
 				continue;
 
-			fprintf(f, " <g transform=\"translate(%d %d)\">\n", i * 10, j * 10);
+			group(C, i * 10, j * 10);
 			if(tile == '@') {
 				int rot = 0, t;
 				if((t = d_get_tile(M, i, j + 1)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
 
 					if((t = d_get_tile(M, i+1, j)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
 						/* The entrance is a hole in the ceiling */
-						fprintf(f, "  <use href=\"#wall-l\"/><use href=\"#wall-r\"/><use href=\"#wall-t\"/>\n");
+						use(C, "wall-l", 0, 0);
+						use(C, "wall-r", 0, 0);
+						use(C, "wall-t", 0, 0);
 						rot = 0;
 					} else {
-						fprintf(f, "  <use href=\"#wall-l\"/><use href=\"#wall-r\"/>\n");
+						use(C, "wall-l", 0, 0);
+						use(C, "wall-r", 0, 0);
 						rot = 0;
 					}
 				} else if((t = d_get_tile(M, i, j - 1)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
-					fprintf(f, "  <use href=\"#wall-l\"/><use href=\"#wall-r\"/>\n");
+					use(C, "wall-l", 0, 0);
+					use(C, "wall-r", 0, 0);
 					rot = 180;
 				} else if((t = d_get_tile(M, i + 1, j)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
-					fprintf(f, "  <use href=\"#wall-t\"/><use href=\"#wall-b\"/>\n");
+					use(C, "wall-t", 0, 0);
+					use(C, "wall-b", 0, 0);
 					rot = -90;
 				} else if((t = d_get_tile(M, i - 1, j)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
-					fprintf(f, "  <use href=\"#wall-t\"/><use href=\"#wall-b\"/>\n");
+					use(C, "wall-t", 0, 0);
+					use(C, "wall-b", 0, 0);
 					rot = 90;
 				}
-				fprintf(f, "  <use href=\"#stairs\" transform=\"rotate(%d 6 6)\"/>\n", rot);
+				use_rotated(C, "stairs", 0, 0, rot, 6, 6);
 			} else if(tile == '$') {
 				int rot = 0, t;
 				if((t = d_get_tile(M, i, j + 1)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
 					if((t = d_get_tile(M, i+1, j)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
 						/* The exit is just a hole in the floor */
-						fprintf(f, "  <use href=\"#wall-l\"/><use href=\"#wall-r\"/><use href=\"#wall-b\"/>\n");
+						use(C, "wall-l", 0, 0);
+						use(C, "wall-r", 0, 0);
+						use(C, "wall-b", 0, 0);
 						rot = 0;
 					} else {
-						fprintf(f, "  <use href=\"#wall-l\"/><use href=\"#wall-r\"/>\n");
+						use(C, "wall-l", 0, 0);
+						use(C, "wall-r", 0, 0);
 						rot = 180;
 					}
 				} else if((t = d_get_tile(M, i, j - 1)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
-					fprintf(f, "  <use href=\"#wall-l\"/><use href=\"#wall-r\"/>\n");
+					use(C, "wall-l", 0, 0);
+					use(C, "wall-r", 0, 0);
 					rot = 0;
 				} else if((t = d_get_tile(M, i + 1, j)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
-					fprintf(f, "  <use href=\"#wall-t\"/><use href=\"#wall-b\"/>\n");
+					use(C, "wall-t", 0, 0);
+					use(C, "wall-b", 0, 0);
 					rot = 90;
 				} else if((t = d_get_tile(M, i - 1, j)) == D_TILE_FLOOR || t == D_TILE_FLOOR_EDGE) {
-					fprintf(f, "  <use href=\"#wall-t\"/><use href=\"#wall-b\"/>\n");
+					use(C, "wall-t", 0, 0);
+					use(C, "wall-b", 0, 0);
 					rot = -90;
 				}
-				fprintf(f, "  <use href=\"#stairs\" transform=\"rotate(%d 6 6)\"/>\n", rot);
+				use_rotated(C, "stairs", 0, 0, rot, 6, 6);
 			} else if(tile == 'S') {
-				fprintf(f, "  <use href=\"#statue\" transform=\"rotate(%d 6 6)\"/>\n", D_RAND(360));
+				use_rotated(C, "statue", 0, 0, D_RAND(M, 360), 6, 6);
 			} else if(tile == D_TILE_SECRET) {
 				int rot = 0, t;
 				D_Edge *edge = d_corridor_at(M, i, j);
@@ -340,7 +831,7 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 					else if((t = d_get_tile(M, i, j + 1)) == D_TILE_FLOOR || t == D_TILE_CROSSING)
 						rot = 180;
 				}
-				fprintf(f, " <use href=\"#secret-door\" transform=\"rotate(%d 6 6)\"/>\n", rot);
+				use_rotated(C, "secret-door", 0, 0, rot, 6, 6);
 			} else if(tile == 't') {
 				int rot = 0;
 				if(d_get_tile(M, i, j + 1) == D_TILE_FLOOR)
@@ -349,77 +840,72 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 					rot = 90;
 				if(d_get_tile(M, i - 1, j) == D_TILE_FLOOR)
 					rot = -90;
-				fprintf(f, " <use href=\"#doorway\" transform=\"rotate(%d 6 6)\"/>\n", rot);
+				use_rotated(C, "doorway", 0, 0, rot, 6, 6);
 			} else if(tile == 'D') {
 				D_Edge *edge = d_corridor_at(M, i, j);
 				assert(edge);
 				if(edge->direction == D_ORIENT_EW) {
-					fprintf(f, "  <use href=\"#door\"/>\n");
+					use(C, "door", 0, 0);
 				} else {
-					fprintf(f, "  <use href=\"#door\" transform=\"rotate(90 6 6)\"/>\n");
+					use_rotated(C, "door", 0, 0, 90, 6, 6);
 				}
 			} else {
-				int r = D_RAND(100);
+				int r = D_RAND(M, 100);
 				if(d_is_wall(M, i - 1, j))
-					fprintf(f, "  <use href=\"#wall-l\"/>\n");
+					use(C, "wall-l", 0, 0);
 				if(d_is_wall(M, i + 1, j))
-					fprintf(f, "  <use href=\"#wall-r\"/>\n");
+					use(C, "wall-r", 0, 0);
 				if(d_is_wall(M, i, j - 1))
-					fprintf(f, "  <use href=\"#wall-t\"/>\n");
+					use(C, "wall-t", 0, 0);
 				if(d_is_wall(M, i, j + 1))
-					fprintf(f, "  <use href=\"#wall-b\"/>\n");
+					use(C, "wall-b", 0, 0);
 
 				if(r < 4) {
-					float sx = frand()*0.1 + 0.9;
-					float sy = frand()*0.1 + 0.9;
-					fprintf(f, " <use href=\"#stone1\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", frand()*7.0+2.0, frand()*7.0+2.0, D_RAND(360) - 180, sx, sy);
+					stone(C, M, "stone1");
 				} else if(r < 8) {
-					float sx = frand()*0.1 + 0.9;
-					float sy = frand()*0.1 + 0.9;
-					fprintf(f, " <use href=\"#stone2\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", frand()*7.0+2.0, frand()*7.0+2.0, D_RAND(360) - 180, sx, sy);
+					stone(C, M, "stone2");
 				} else if(r < 12) {
-					float sx = frand()*0.1 + 0.9;
-					float sy = frand()*0.1 + 0.9;
-					fprintf(f, " <use href=\"#stone3\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", frand()*7.0+2.0, frand()*7.0+2.0, D_RAND(360) - 180, sx, sy);
+					stone(C, M, "stone3");
 				}
 
 			}
 			if(!d_is_wall(M, i + 1, j))
-				fprintf(f, "  <use href=\"#floor-r%c\"/>\n",(i+j)%3 + '1');
+				use(C, floor_r[(i+j)%3], 0, 0);
 			if(!d_is_wall(M, i, j + 1))
-				fprintf(f, "  <use href=\"#floor-b%c\"/>\n",(i+j)%3 + '1');
-			fprintf(f, " </g>\n");
+				use(C, floor_b[(i+j)%3], 0, 0);
+			group_end(C);
 		}
 	}
 
-	/* Random cobwebs */
-	for(i = 0; i < 3; i++) {
+	/* Random cobwebs. The tries are limited for tiny levels
+	that may not have enough free corners */
+	for(i = 0, tries = 0; i < 3 && tries < 1000; i++, tries++) {
 		r = d_random_room(M);
-		switch(D_RAND(4)) {
+		switch(D_RAND(M, 4)) {
 			case 0:
 				if(d_get_tile(M, r->x, r->y) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#cobwebs\" transform=\"translate(%d %d)\"/>\n", r->x * 10, r->y * 10);
+					use(C, "cobwebs", r->x * 10, r->y * 10);
 					d_set_tile(M, r->x, r->y, 'X');
 				} else
 					i--;
 				break;
 			case 1:
 				if(d_get_tile(M, r->x + r->w - 1, r->y) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#cobwebs\" transform=\"translate(%d %d) rotate(90 6 6)\"/>\n", (r->x + r->w - 1) * 10, r->y * 10);
+					use_rotated(C, "cobwebs", (r->x + r->w - 1) * 10, r->y * 10, 90, 6, 6);
 					d_set_tile(M, r->x + r->w - 1, r->y, 'X');
 				} else
 					i--;
 				break;
 			case 2:
 				if(d_get_tile(M, r->x + r->w - 1, r->y + r->h - 1) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#cobwebs\" transform=\"translate(%d %d) rotate(180 6 6)\"/>\n", (r->x + r->w - 1) * 10, (r->y + r->h - 1) * 10);
+					use_rotated(C, "cobwebs", (r->x + r->w - 1) * 10, (r->y + r->h - 1) * 10, 180, 6, 6);
 					d_set_tile(M, r->x + r->w - 1, r->y + r->h - 1, 'X');
 				} else
 					i--;
 				break;
 			case 3:
 				if(d_get_tile(M, r->x, r->y + r->h - 1) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#cobwebs\" transform=\"translate(%d %d) rotate(-90 6 6)\"/>\n", r->x * 10, (r->y + r->h - 1) * 10);
+					use_rotated(C, "cobwebs", r->x * 10, (r->y + r->h - 1) * 10, -90, 6, 6);
 					d_set_tile(M, r->x, r->y + r->h - 1, 'X');
 				}
 				else
@@ -429,37 +915,37 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 	}
 
 	/* Random cracks */
-	for(i = 0; i < 3; i++) {
+	for(i = 0, tries = 0; i < 3 && tries < 1000; i++, tries++) {
 		r = d_random_room(M);
-		switch(D_RAND(4)) {
+		switch(D_RAND(M, 4)) {
 			case 0:
-				j = r->x + D_RAND(r->w);
+				j = r->x + D_RAND(M, r->w);
 				if(d_get_tile(M, j, r->y) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#crack-t\" transform=\"translate(%d %d)\"/>\n", j * 10, r->y * 10);
+					use(C, "crack-t", j * 10, r->y * 10);
 					d_set_tile(M, j, r->y, 'X');
 				} else
 					i--;
 				break;
 			case 1:
-				j = r->y + D_RAND(r->h);
+				j = r->y + D_RAND(M, r->h);
 				if(d_get_tile(M, r->x + r->w - 1, j) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#crack-t\" transform=\"translate(%d %d) rotate(90 6 6)\"/>\n", (r->x + r->w - 1) * 10, j * 10);
+					use_rotated(C, "crack-t", (r->x + r->w - 1) * 10, j * 10, 90, 6, 6);
 					d_set_tile(M, r->x + r->w - 1, j, 'X');
 				} else
 					i--;
 				break;
 			case 2:
-				j = r->x + D_RAND(r->w);
+				j = r->x + D_RAND(M, r->w);
 				if(d_get_tile(M, j, r->y + r->h - 1) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#crack-t\" transform=\"translate(%d %d) rotate(180 6 6)\"/>\n", j * 10, (r->y + r->h - 1) * 10);
+					use_rotated(C, "crack-t", j * 10, (r->y + r->h - 1) * 10, 180, 6, 6);
 					d_set_tile(M, j, r->y + r->h - 1, 'X');
 				} else
 					i--;
 				break;
 			case 3:
-				j = r->y + D_RAND(r->h);
+				j = r->y + D_RAND(M, r->h);
 				if(d_get_tile(M, r->x, j) == D_TILE_FLOOR_EDGE) {
-					fprintf(f, " <use href=\"#crack-t\" transform=\"translate(%d %d) rotate(-90 6 6)\"/>\n", r->x * 10, j * 10);
+					use_rotated(C, "crack-t", r->x * 10, j * 10, -90, 6, 6);
 					d_set_tile(M, r->x, j, 'X');
 				}
 				else
@@ -468,52 +954,426 @@ static void drawSvg(D_Dungeon *M, FILE *f) {
 		}
 	}
 
-	/* Room with pillars */
-	do {
-		r = d_random_room(M);
-	} while(r->flags & (D_FLAG_START_ROOM | D_FLAG_END_ROOM | D_FLAG_GONE_ROOM) || (r->w * r->h < 8));
-	for(i = 1; i < r->w; i++)
-		for(j = 1; j < r->h; j++) {
-			fprintf(f, " <use href=\"#pillar\" transform=\"translate(%d %d) rotate(%d)\"/>\n", (r->x + i) * 10 + 1, (r->y + j) * 10 + 1, D_RAND(360));
+	/* Room with pillars, if there is one that can have them */
+	for(i = 0; i < M->n_rooms && !pillar_room(&M->rooms[i]); i++);
+	if(i < M->n_rooms) {
+		do {
+			r = d_random_room(M);
+		} while(!pillar_room(r));
+		for(i = 1; i < r->w; i++)
+			for(j = 1; j < r->h; j++) {
+				use_rotated(C, "pillar", (r->x + i) * 10 + 1, (r->y + j) * 10 + 1, D_RAND(M, 360), 0, 0);
+			}
+	}
+
+}
+
+/* Draws the level into the SVG file `svg` and the raster image `raster` with
+`px` pixels per tile; either of them can be NULL. `merge` merges the SVG's
+hatching into paths */
+static int draw_map(D_Dungeon *M, FILE *svg, const char *raster, float px, int threads, const struct poisson *tile, int merge) {
+	struct svg_canvas S;
+	struct raster_canvas R;
+	struct canvas *C = NULL;
+	int ok = 1;
+
+	if(raster) {
+		if(!raster_canvas_open(&R, M, px))
+			return 0;
+		C = &R.C;
+	}
+	if(svg) {
+		if(!svg_canvas_open(&S, M, svg, merge)) {
+			if(raster)
+				raster_canvas_close(&R, NULL);
+			return 0;
+		}
+		S.C.next = C;
+		C = &S.C;
+	}
+	if(!C)
+		return 1;
+
+	draw_level(M, C, threads, tile);
+
+	if(svg && !svg_canvas_close(&S)) {
+		fprintf(stderr, "Unable to write the SVG\n");
+		ok = 0;
+	}
+	if(raster && !raster_canvas_close(&R, raster)) {
+		fprintf(stderr, "Unable to save %s\n", raster);
+		ok = 0;
+	}
+	return ok;
+}
+
+/* Batch mode: Generates `count` dungeons with consecutive seeds
+ * starting at `first` on a pool of worker threads.
+ *
+ * Each level is either written to its own `map-SEED.txt` and `map-SEED.svg`
+ * (and `map-SEED.png` with `-r`) in a directory, or all of them are written to a single packed file in seed
+ * order. Each record in the packed file starts with a header line
+ * `level SEED MAP_W MAP_H SVG_BYTES`, followed by the `MAP_H` lines of the
+ * ASCII map and `SVG_BYTES` bytes of SVG (none if the SVGs are disabled).
+ */
+struct batch {
+	int first, count;
+	const char *dir;
+	FILE *pack;
+	int grid_w, grid_h, stream;
+	int svg, quiet;
+	float raster;
+	const struct poisson *tile;
+	int merge;
+
+	pthread_mutex_t lock;
+	pthread_cond_t written_cond;
+	int next, written, errors;
+	double gen_total, gen_max, render_total, render_max;
+};
+
+static double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* In packed mode, levels are written in order: This waits until
+all the levels before `index` have been written */
+static void batch_lock_turn(struct batch *B, int index) {
+	pthread_mutex_lock(&B->lock);
+	while(B->written != index)
+		pthread_cond_wait(&B->written_cond, &B->lock);
+}
+
+static void batch_unlock_turn(struct batch *B) {
+	B->written++;
+	pthread_cond_broadcast(&B->written_cond);
+	pthread_mutex_unlock(&B->lock);
+}
+
+/* Renders a level into the file(s) it belongs in. `done` is set to the
+time the rendering finished, which excludes waiting for our turn to write */
+static int batch_render(struct batch *B, int index, D_Dungeon *M, double *done) {
+	char path[512];
+	int seed = B->first + index, ok = 1;
+	FILE *f;
+
+	if(B->pack) {
+		long svg_bytes = 0;
+		FILE *map;
+
+		/* The ASCII map is buffered before the level is drawn, since
+		drawing it marks the tiles with cobwebs and cracks */
+		f = NULL;
+		if((map = tmpfile())) {
+			d_draw(M, map);
+			if(B->svg) {
+				if((f = tmpfile())) {
+					ok = draw_map(M, f, NULL, 0, 1, B->tile, B->merge);
+					svg_bytes = ftell(f);
+				} else
+					ok = 0;
+			}
+		} else
+			ok = 0;
+		*done = now_ms();
+
+		/* The turn is taken even if this level failed, so that the
+		ones after it don't wait for it forever */
+		batch_lock_turn(B, index);
+		if(ok) {
+			fprintf(B->pack, "level %d %d %d %ld\n", seed, M->map_w, M->map_h, svg_bytes);
+			if(!copy_stream(map, B->pack) || (f && !copy_stream(f, B->pack)))
+				ok = 0;
 		}
+		batch_unlock_turn(B);
 
-	fprintf(f, "</svg>\n");
+		if(map)
+			fclose(map);
+		if(f)
+			fclose(f);
+		return ok;
+	}
+
+	snprintf(path, sizeof path, "%s/map-%d.txt", B->dir, seed);
+	if(!(f = fopen(path, "w"))) {
+		fprintf(stderr, "Unable to write %s\n", path);
+		return 0;
+	}
+	d_draw(M, f);
+	fclose(f);
+
+	f = NULL;
+	if(B->svg) {
+		snprintf(path, sizeof path, "%s/map-%d.svg", B->dir, seed);
+		if(!(f = fopen(path, "w"))) {
+			fprintf(stderr, "Unable to write %s\n", path);
+			return 0;
+		}
+	}
+	if(B->raster > 0)
+		snprintf(path, sizeof path, "%s/map-%d." RASTER_EXT, B->dir, seed);
+	ok = draw_map(M, f, B->raster > 0 ? path : NULL, B->raster, 1, B->tile, B->merge);
+	if(f)
+		fclose(f);
+	*done = now_ms();
+	return ok;
+}
+
+static void *batch_worker(void *arg) {
+	struct batch *B = arg;
+	for(;;) {
+		D_Dungeon M;
+		double t0, t1, t2;
+		int index, ok;
+
+		pthread_mutex_lock(&B->lock);
+		index = B->next++;
+		pthread_mutex_unlock(&B->lock);
+		if(index >= B->count)
+			break;
+
+		t0 = now_ms();
+		d_init(&M);
+		d_seed(&M, B->first + index);
+		M.grid_w = B->grid_w;
+		M.grid_h = B->grid_h;
+		M.stream = B->stream;
+		ok = d_generate(&M);
+		t1 = t2 = now_ms();
+		if(ok)
+			ok = batch_render(B, index, &M, &t2);
+		else if(B->pack) {
+			/* Skip it in the packed file */
+			batch_lock_turn(B, index);
+			batch_unlock_turn(B);
+		}
+		d_deinit(&M);
+
+		pthread_mutex_lock(&B->lock);
+		if(!ok) {
+			fprintf(stderr, "Level %d failed\n", B->first + index);
+			B->errors++;
+		}
+		B->gen_total += t1 - t0;
+		B->render_total += t2 - t1;
+		if(t1 - t0 > B->gen_max) B->gen_max = t1 - t0;
+		if(t2 - t1 > B->render_max) B->render_max = t2 - t1;
+		if(!B->quiet)
+			fprintf(stderr, "%d: generate %.3f ms, render %.3f ms\n", B->first + index, t1 - t0, t2 - t1);
+		pthread_mutex_unlock(&B->lock);
+	}
+	return NULL;
+}
+
+static int default_threads() {
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > 0)
+		return n;
+#endif
+	return 4;
+}
+
+static int run_batch(struct batch *B, int threads) {
+	pthread_t *tids;
+	double start, elapsed;
+	int i, started = 0;
+
+	if(threads > B->count)
+		threads = B->count;
+	if(threads < 1)
+		threads = 1;
+
+	tids = malloc(threads * sizeof *tids);
+	if(!tids) {
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+
+	pthread_mutex_init(&B->lock, NULL);
+	pthread_cond_init(&B->written_cond, NULL);
+	B->next = 0;
+	B->written = 0;
+	B->errors = 0;
+	B->gen_total = B->gen_max = 0;
+	B->render_total = B->render_max = 0;
+
+	start = now_ms();
+	for(i = 0; i < threads; i++) {
+		if(pthread_create(&tids[i], NULL, batch_worker, B)) {
+			fprintf(stderr, "Unable to start thread %d\n", i);
+			break;
+		}
+		started++;
+	}
+	if(!started)
+		batch_worker(B);
+	for(i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+	elapsed = now_ms() - start;
+
+	pthread_cond_destroy(&B->written_cond);
+	pthread_mutex_destroy(&B->lock);
+	free(tids);
+
+	fprintf(stderr, "%d levels in %.1f ms on %d threads (%.1f levels/s)\n",
+		B->count, elapsed, started ? started : 1, elapsed > 0 ? B->count * 1000.0 / elapsed : 0.0);
+	fprintf(stderr, "generate: %.3f ms avg, %.3f ms max\n", B->gen_total / B->count, B->gen_max);
+	fprintf(stderr, "render:   %.3f ms avg, %.3f ms max\n", B->render_total / B->count, B->render_max);
+	if(B->errors)
+		fprintf(stderr, "%d levels failed\n", B->errors);
+
+	return B->errors == 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [options] [seed]\n", name);
+	fprintf(stderr, "Without -n, generates one dungeon, prints it and writes it to map.svg\n");
+	fprintf(stderr, "  -g WxH      size of the grid of rooms, at least 3 of them (default: 4x4)\n");
+	fprintf(stderr, "  -s          stream the map out without keeping it in memory; implies -S\n");
+	fprintf(stderr, "  -n COUNT    generate COUNT dungeons with seeds seed, seed+1, ...\n");
+	fprintf(stderr, "  -j THREADS  number of worker threads (default: number of CPUs)\n");
+	fprintf(stderr, "  -o DIR      write DIR/map-SEED.txt and DIR/map-SEED.svg (default: .)\n");
+	fprintf(stderr, "  -p FILE     write all the levels to one packed FILE instead\n");
+	fprintf(stderr, "  -S          don't render SVGs\n");
+	fprintf(stderr, "  -r PX       also render map." RASTER_EXT " or DIR/map-SEED." RASTER_EXT " at PX pixels per tile (not with -p)\n");
+	fprintf(stderr, "  -t FILE     stamp the hatching from a tileable pattern cached in FILE\n");
+	fprintf(stderr, "  -m          merge the hatching's strokes into a single path\n");
+	fprintf(stderr, "  -q          don't report the time of each level\n");
 }
 
 int main(int argc, char *argv[]) {
 	FILE *f;
-	int seed;
+	int i, seed, count = 0, threads = default_threads(), rc;
+	int have_seed = 0;
+	const char *pack = NULL, *tile_path = NULL;
+	struct batch B;
+	struct poisson T;
 	D_Dungeon M;
 
-	if(argc > 1)
-		seed = atoi(argv[1]);
-	else {
+	B.dir = ".";
+	B.pack = NULL;
+	B.grid_w = 4;
+	B.grid_h = 4;
+	B.stream = 0;
+	B.svg = 1;
+	B.raster = 0;
+	B.quiet = 0;
+	B.tile = NULL;
+	B.merge = 0;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-n") && i + 1 < argc)
+			count = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-j") && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-o") && i + 1 < argc)
+			B.dir = argv[++i];
+		else if(!strcmp(argv[i], "-p") && i + 1 < argc)
+			pack = argv[++i];
+		else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+			tile_path = argv[++i];
+		else if(!strcmp(argv[i], "-r") && i + 1 < argc)
+			B.raster = atof(argv[++i]);
+		else if(!strcmp(argv[i], "-g") && i + 1 < argc) {
+			/* There has to be room for a walk of 3 rooms with the locked door in it */
+			if(sscanf(argv[++i], "%dx%d", &B.grid_w, &B.grid_h) != 2 || B.grid_w < 1 || B.grid_h < 1
+					|| B.grid_w * B.grid_h < 3) {
+				fprintf(stderr, "The grid needs at least 3 rooms\n");
+				usage(argv[0]);
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "-s"))
+			B.stream = 1;
+		else if(!strcmp(argv[i], "-S"))
+			B.svg = 0;
+		else if(!strcmp(argv[i], "-q"))
+			B.quiet = 1;
+		else if(!strcmp(argv[i], "-m"))
+			B.merge = 1;
+		else if(argv[i][0] != '-' || (argv[i][1] >= '0' && argv[i][1] <= '9')) {
+			seed = atoi(argv[i]);
+			have_seed = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(!have_seed)
 		seed = time(NULL);
+	if(B.stream) {
+		B.svg = 0;
+		B.raster = 0;
+	}
+
+	if(tile_path && (B.svg || B.raster > 0)) {
+		if(!load_hatch_tile(&T, tile_path)) {
+			fprintf(stderr, "Unable to make the hatching pattern\n");
+			return 1;
+		}
+		B.tile = &T;
+	}
+
+	if(count > 0) {
+		B.first = seed;
+		B.count = count;
+		if(pack) {
+			if(!(B.pack = fopen(pack, "wb"))) {
+				fprintf(stderr, "Unable to write %s\n", pack);
+				return 1;
+			}
+		}
+		rc = run_batch(&B, threads);
+		if(B.pack)
+			fclose(B.pack);
+		if(B.tile)
+			poisson_done(&T);
+		return !rc;
 	}
-	srand(seed);
 
 	printf("Seed: %d\n", seed);
 
 	d_init(&M);
+	d_seed(&M, seed);
 
-	M.grid_w = 4;
-	M.grid_h = 4;
+	M.grid_w = B.grid_w;
+	M.grid_h = B.grid_h;
+	M.stream = B.stream;
 
-	d_generate(&M);
+	if(!d_generate(&M)) {
+		fprintf(stderr, "Unable to generate the dungeon\n");
+		d_deinit(&M);
+		return 1;
+	}
 
 	d_draw(&M, stdout);
 
-	f = fopen("map.svg","w");
-	if(f) {
-		drawSvg(&M, f);
-		fclose(f);
-	} else {
-		fprintf(stderr, "Unable to save SVG");
+	if(!B.stream) {
+		/* The key to the locked door is always somewhere in the level */
+		D_DistMap D;
+		if(d_dist_init(&D, &M)) {
+			D.cost[D_TILE_LOCKED_DOOR] = 1;
+			d_dist_from(&D, &M, M.entrance.x, M.entrance.y);
+			printf("Steps from the entrance to the exit: %d\n", d_dist_get(&D, M.exit.x, M.exit.y));
+			d_dist_deinit(&D);
+		}
 	}
 
+	f = NULL;
+	if(B.svg && !(f = fopen("map.svg","w")))
+		fprintf(stderr, "Unable to save SVG");
+	if(f || B.raster > 0)
+		draw_map(&M, f, B.raster > 0 ? "map." RASTER_EXT : NULL, B.raster, threads, B.tile, B.merge);
+	if(f)
+		fclose(f);
+
 	printf("Seed: %d", seed);
 
 	d_deinit(&M);
+	if(B.tile)
+		poisson_done(&T);
 
 	return 0;
 }
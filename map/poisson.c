@@ -5,9 +5,19 @@
  *
  * [pdsp]: https://sighack.com/post/poisson-disk-sampling-bridsons-algorithm
  *
+ * No two points in the result are closer than `r` to each other: The
+ * background grid has cells of r/sqrt(2), and candidates are checked against
+ * every cell that could hold a point within `r`.
+ *
  * You might want to look at this link for alternative ideas:
  * <https://bost.ocks.org/mike/algorithms/>
  *
+ * Each `struct poisson` has its own random number generator (a [PCG32][pcg])
+ * that is seeded with `poisson_seed()`, so the same seed always gives the same
+ * points, and several samplers can run in different threads.
+ *
+ * [pcg]: https://www.pcg-random.org/
+ *
  * Author: Werner Stoop
  * CC0 This work has been marked as dedicated to the public domain.
  * https://creativecommons.org/publicdomain/zero/1.0/
@@ -15,6 +25,8 @@
 #ifndef POISSON_H
 #define POISSON_H
 
+#include <stdint.h>
+
 struct point {
 	float x, y;
 };
@@ -23,21 +35,36 @@ struct poisson;
 
 typedef int (*poisson_constraint)(struct poisson *P, float x, float y);
 
+typedef void (*poisson_emit)(struct poisson *P, const struct point *points, int n);
+
 struct poisson {
 	int	k;
 	float r;
 	int w, h;
 	struct point x0;
-	short n_points;
+	int n_points;
 	struct point *points;
 	void *data;
 	poisson_constraint constraint;
+	uint64_t rng;
 };
 
 void poisson_init(struct poisson *P);
 
+void poisson_seed(struct poisson *P, uint64_t seed);
+
 int poisson_plot(struct poisson *P);
 
+int poisson_plot_tiled(struct poisson *P, poisson_emit emit, int threads);
+
+int poisson_plot_toroidal(struct poisson *P);
+
+int poisson_save(struct poisson *P, const char *path);
+
+int poisson_load(struct poisson *P, const char *path);
+
+int poisson_stamp(struct poisson *P, const struct poisson *tile, float ox, float oy, poisson_emit emit);
+
 void poisson_done(struct poisson *P);
 
 #if defined(POISSON_TEST) && !defined(POISSON_IMPLEMENTATION)
@@ -46,11 +73,17 @@ void poisson_done(struct poisson *P);
 
 #ifdef POISSON_IMPLEMENTATION
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <assert.h>
 
+#ifndef P_NO_THREADS
+# include <pthread.h>
+#endif
+
 #ifndef P_W0
 # define P_W0	100
 #endif
@@ -69,6 +102,33 @@ void poisson_done(struct poisson *P);
 
 #define N	2
 
+/* PCG32: https://www.pcg-random.org/ */
+static uint32_t _p_rand32(struct poisson *P) {
+	uint64_t old = P->rng;
+	uint32_t xorshifted, rot;
+	P->rng = old * 6364136223846793005ULL + 1442695040888963407ULL;
+	xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+	rot = (uint32_t)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/* Random number in [0,n) */
+static int _p_rand(struct poisson *P, int n) {
+	return (int)(((uint64_t)_p_rand32(P) * (uint32_t)n) >> 32);
+}
+
+/* Random number in [0,1) */
+static float _p_frand(struct poisson *P) {
+	return (_p_rand32(P) >> 8) * (1.0f / 16777216.0f);
+}
+
+void poisson_seed(struct poisson *P, uint64_t seed) {
+	P->rng = 0;
+	_p_rand32(P);
+	P->rng += seed;
+	_p_rand32(P);
+}
+
 void poisson_init(struct poisson *P) {
 	/* These are set to sensible defaults,
 	but you're allowed to change them: */
@@ -79,8 +139,10 @@ void poisson_init(struct poisson *P) {
 	P->w = P_W0;
 	P->h = P_H0;
 
-	P->x0.x = rand() % P->w;
-	P->x0.y = rand() % P->h;
+	poisson_seed(P, 0);
+
+	P->x0.x = _p_rand(P, P->w);
+	P->x0.y = _p_rand(P, P->h);
 
 	P->constraint = NULL;
 	P->data = 0;
@@ -98,21 +160,33 @@ void poisson_done(struct poisson *P) {
 }
 
 /* Used internally */
+
+/* Number of directions in the table of unit vectors the candidates
+are picked from; it must be a power of 2 */
+#ifndef P_ANGLES
+# define P_ANGLES	4096
+#endif
+
 struct generator {
 	struct poisson *P;
 
-	short *grid;
-	short grid_size, grid_w, grid_h;
-	short *active_list;
-	short n_active;
-	float cell_size;
+	int *grid;
+	int grid_size, grid_w, grid_h;
+	int *active_list;
+	int n_active;
+	float cell_size, r2;
+
+	/* Cells are only rectangular in toroidal sampling */
+	float cell_h;
+
+	float cos_table[P_ANGLES], sin_table[P_ANGLES];
 };
 
-static short _p_insert_point(struct generator *G, float x, float y) {
-	short index, gx, gy;
+static int _p_insert_point(struct generator *G, float x, float y) {
+	int index, gx, gy;
 
-	gx = floor(x/G->cell_size);
-	gy = floor(y/G->cell_size);
+	gx = (int)(x / G->cell_size);
+	gy = (int)(y / G->cell_size);
 
 	index = gy * G->grid_w + gx;
 	assert(index < G->grid_size);
@@ -126,138 +200,708 @@ static short _p_insert_point(struct generator *G, float x, float y) {
 	return index;
 }
 
-static float _p_frand() {
-	return ((float)rand())/RAND_MAX;
-}
-
-#define MAX(a,b) ((a) > (b)? (a) : (b))
-#define MIN(a,b) ((a) < (b)? (a) : (b))
-
-static float dist(float x0, float y0, float x1, float y1) {
-	float dx = x1 - x0, dy = y1 - y0;
-	return sqrt(dx * dx + dy * dy);
-}
+#ifndef MAX
+# define MAX(a,b) ((a) > (b)? (a) : (b))
+#endif
+#ifndef MIN
+# define MIN(a,b) ((a) < (b)? (a) : (b))
+#endif
 
 static int _p_is_valid_point(struct generator *G, float px, float py) {
-	short gx, gy, i0, i1, j0, j1, i, j;
+	int gx, gy, i0, i1, j0, j1, i, j;
 	struct poisson *P = G->P;
 
 	if(px < 0 || px >= P->w || py < 0 || py >= P->h) return 0;
 
+	gx = (int)(px / G->cell_size);
+	gy = (int)(py / G->cell_size);
+
+	/* A cell is r/sqrt(2) wide, so it can hold at most one point, and a
+	point closer than r can be up to two cells away. The corners of the
+	5x5 block are skipped because they are at least r away */
+	if(G->grid[gy * G->grid_w + gx] >= 0)
+		return 0;
+
+	i0 = MAX(gx - 2, 0);
+	i1 = MIN(gx + 2, G->grid_w - 1);
+	j0 = MAX(gy - 2, 0);
+	j1 = MIN(gy + 2, G->grid_h - 1);
+
+	for(j = j0; j <= j1; j++) {
+		const int *row = &G->grid[j * G->grid_w];
+		int corner_row = (j == gy - 2 || j == gy + 2);
+		for(i = i0; i <= i1; i++) {
+			int t = row[i];
+			struct point *q;
+			float dx, dy;
+			if(t < 0 || (corner_row && (i == gx - 2 || i == gx + 2)))
+				continue;
+			q = &P->points[t];
+			dx = px - q->x;
+			dy = py - q->y;
+			if(dx * dx + dy * dy < G->r2)
+				return 0;
+		}
+	}
+
+	/* The constraint is checked last because it's likely to
+	be more expensive than the grid */
 	if(P->constraint)
 		if(!P->constraint(P, px, py))
 			return 0;
 
-	gx = floor(px / G->cell_size);
-	gy = floor(py / G->cell_size);
-
-	/* Note to self: I did see some cases where the constraint that no two
-	 * points should be closer than R is being violated, and I suspect that
-	 * what's happening is that they are just placed so that there ends up
-	 * being a empty grid cell between them. This implies some misunderstanding
-	 * on my part, but I've decided I can live with it. If you can't live with
-	 * it, changing the +/-1s below to +/-2 works around the issue.
-	 */
-	i0 = MAX(gx - 1, 0);
-	i1 = MIN(gx + 1, G->grid_w - 1);
-	j0 = MAX(gy - 1, 0);
-	j1 = MIN(gy + 1, G->grid_h - 1);
-
-	for(i = i0; i <= i1; i++)
-		for(j = j0; j <= j1; j++) {
-			short t = G->grid[j * G->grid_w + i];
-			if(t >= 0) {
-				struct point *q = &G->P->points[t];
-				if(dist(px, py, q->x, q->y) < P->r)
-					return 0;
-			}
+	return 1;
+}
+
+static void _p_make_table(float *cos_table, float *sin_table) {
+	int i;
+	for(i = 0; i < P_ANGLES; i++) {
+		double th = i * 2 * M_PI / P_ANGLES;
+		cos_table[i] = cos(th);
+		sin_table[i] = sin(th);
+	}
+}
+
+static void _p_free_generator(struct generator *G) {
+	free(G->grid);
+	free(G->active_list);
+	free(G);
+}
+
+int poisson_plot(struct poisson *P) {
+	int i, k;
+	struct generator *G;
+
+	poisson_done(P);
+
+	/* The generator is allocated because of the size of the tables */
+	G = malloc(sizeof *G);
+	if(!G) {
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+	G->P = P;
+	G->cell_size = P->r / sqrt(N);
+	G->r2 = P->r * P->r;
+
+	G->grid_w = (int)ceil(P->w / G->cell_size) + 1;
+	G->grid_h = (int)ceil(P->h / G->cell_size) + 1;
+	G->grid_size = G->grid_w * G->grid_h;
+
+	G->grid = malloc(G->grid_size * sizeof *G->grid);
+	G->active_list = malloc(G->grid_size * sizeof *G->active_list);
+	P->points = malloc(G->grid_size * sizeof *P->points);
+	if(!G->grid || !G->active_list || !P->points) {
+		_p_free_generator(G);
+		poisson_done(P);
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+	for(i = 0; i < G->grid_size; i++)
+		G->grid[i] = -1;
+	G->n_active = 0;
+
+	_p_make_table(G->cos_table, G->sin_table);
+
+	if(P->x0.x < 0 || P->x0.x >= P->w || P->x0.y < 0 || P->x0.y >= P->h) {
+		_p_free_generator(G);
+		return 1;
+	}
+	i = _p_insert_point(G, P->x0.x, P->x0.y);
+	G->active_list[G->n_active++] = i;
+
+	while(G->n_active > 0) {
+		int ax = _p_rand(P, G->n_active);
+		int a = G->active_list[ax];
+		float px = P->points[a].x, py = P->points[a].y;
+
+		for(k = 0; k < P->k; k++) {
+			/* Candidates are spread uniformly over the area of the
+			annulus between r and 2r around the active point */
+			int th = _p_rand32(P) & (P_ANGLES - 1);
+			float rad = P->r * sqrtf(1.0f + 3.0f * _p_frand(P));
+
+			float nx = px + rad * G->cos_table[th];
+			float ny = py + rad * G->sin_table[th];
+
+			if(!_p_is_valid_point(G, nx, ny))
+				continue;
+
+			i = _p_insert_point(G, nx, ny);
+			assert(G->n_active < G->grid_size);
+			G->active_list[G->n_active++] = i;
+			break;
 		}
+		if(k == P->k) {
+			/* No point found - remove the point from the
+			active list by replacing it with the last one in the
+			list, and decrementing the counter */
+			G->active_list[ax] = G->active_list[--G->n_active];
+		}
+	}
+	_p_free_generator(G);
 
 	return 1;
 }
 
-int poisson_plot(struct poisson *P) {
-	short i, k;
-	struct generator G;
+/* Tiled sampling
+
+The domain is cut into tiles of P_TILE x P_TILE grid cells that are sampled
+one row of tiles at a time: First the even tiles in the row and then the odd
+ones. Tiles in the same phase are a whole tile apart, so they can be sampled
+in parallel, and each tile checks its candidates against the tiles above it
+and to its sides that were sampled before it, so the borders between tiles
+never violate the distance `r`.
+
+Only the cells of the current and previous rows of tiles are kept, in a ring,
+and a row's points are passed to `emit` from the calling thread, a tile at a
+time in order, as soon as the row is finished.
+
+Each tile has its own random number generator seeded from `P`'s, so the
+points are the same regardless of the number of threads. `P->x0` isn't used;
+every tile is seeded with random points until P->k of them in a row fail.
+The constraint may be called from several threads at once.
+*/
+#ifndef P_TILE
+# define P_TILE	32
+#endif
 
-	G.P = P;
+struct _p_tile {
+	struct point *points;
+	int *active_list;
+	int n_points;
+};
 
-	/* Note to self: I found that if you use `floor()` as in the [pdsp][]
-	article, then some of the points end up violating the contstraints */
-	G.cell_size = ceil((float)P->r / sqrt(N));
+struct tiler {
+	struct poisson *P;
+	float cell_size, r2;
+	int grid_w, grid_h;
+	int tiles_w, tiles_h;
 
-	G.grid_w = ceil((float)P->w / G.cell_size) + 1;
-	G.grid_h = ceil((float)P->h / G.cell_size) + 1;
-	G.grid_size = G.grid_w * G.grid_h;
+	/* The cells of two rows of tiles; x is negative in empty cells */
+	struct point *ring;
 
-	P->n_points = 0;
+	/* The current row of tiles */
+	struct _p_tile *tiles;
+	int ty, next;
+	uint64_t seed;
+
+#ifndef P_NO_THREADS
+	pthread_mutex_t lock;
+#endif
+
+	float cos_table[P_ANGLES], sin_table[P_ANGLES];
+};
+
+static struct point *_p_ring_cell(struct tiler *T, int gx, int gy) {
+	return &T->ring[(gy % (2 * P_TILE)) * T->grid_w + gx];
+}
+
+static int _p_tile_valid(struct tiler *T, struct poisson *Q, int tx, float px, float py) {
+	int gx, gy, i0, i1, j0, j1, i, j;
+	int cx0 = tx * P_TILE, cy0 = T->ty * P_TILE;
+
+	if(px < 0 || px >= Q->w || py < 0 || py >= Q->h) return 0;
+
+	gx = (int)(px / T->cell_size);
+	gy = (int)(py / T->cell_size);
+	if(gx < cx0 || gx >= cx0 + P_TILE || gx >= T->grid_w || gy < cy0 || gy >= cy0 + P_TILE || gy >= T->grid_h)
+		return 0;
+
+	if(_p_ring_cell(T, gx, gy)->x >= 0)
+		return 0;
+
+	/* Nothing below the current row of tiles has been sampled yet,
+	and those cells alias the previous row's in the ring */
+	i0 = MAX(gx - 2, 0);
+	i1 = MIN(gx + 2, T->grid_w - 1);
+	j0 = MAX(gy - 2, 0);
+	j1 = MIN(gy + 2, MIN(cy0 + P_TILE, T->grid_h) - 1);
+
+	for(j = j0; j <= j1; j++) {
+		const struct point *row = _p_ring_cell(T, 0, j);
+		int corner_row = (j == gy - 2 || j == gy + 2);
+		for(i = i0; i <= i1; i++) {
+			float dx, dy;
+			if(row[i].x < 0 || (corner_row && (i == gx - 2 || i == gx + 2)))
+				continue;
+			dx = px - row[i].x;
+			dy = py - row[i].y;
+			if(dx * dx + dy * dy < T->r2)
+				return 0;
+		}
+	}
+
+	if(Q->constraint)
+		if(!Q->constraint(Q, px, py))
+			return 0;
+
+	return 1;
+}
+
+static int _p_tile_insert(struct tiler *T, struct _p_tile *tile, float x, float y) {
+	struct point *cell = _p_ring_cell(T, (int)(x / T->cell_size), (int)(y / T->cell_size));
+	cell->x = x;
+	cell->y = y;
+	assert(tile->n_points < P_TILE * P_TILE);
+	tile->points[tile->n_points].x = x;
+	tile->points[tile->n_points].y = y;
+	return tile->n_points++;
+}
+
+static void _p_sample_tile(struct tiler *T, int tx) {
+	struct _p_tile *tile = &T->tiles[tx];
+	struct poisson Q = *T->P;
+	float x0 = tx * P_TILE * T->cell_size, y0 = T->ty * P_TILE * T->cell_size;
+	float size = P_TILE * T->cell_size;
+	float sw = MIN(size, Q.w - x0), sh = MIN(size, Q.h - y0);
+	int n_active = 0, fails = 0, i, k;
+
+	poisson_seed(&Q, T->seed + (uint64_t)T->ty * T->tiles_w + tx);
+	tile->n_points = 0;
+
+	while(fails < Q.k) {
+		float sx = x0 + _p_frand(&Q) * sw, sy = y0 + _p_frand(&Q) * sh;
+		if(!_p_tile_valid(T, &Q, tx, sx, sy)) {
+			fails++;
+			continue;
+		}
+		fails = 0;
+		tile->active_list[n_active++] = _p_tile_insert(T, tile, sx, sy);
+
+		while(n_active > 0) {
+			int ax = _p_rand(&Q, n_active);
+			int a = tile->active_list[ax];
+			float px = tile->points[a].x, py = tile->points[a].y;
+
+			for(k = 0; k < Q.k; k++) {
+				int th = _p_rand32(&Q) & (P_ANGLES - 1);
+				float rad = Q.r * sqrtf(1.0f + 3.0f * _p_frand(&Q));
+
+				float nx = px + rad * T->cos_table[th];
+				float ny = py + rad * T->sin_table[th];
+
+				if(!_p_tile_valid(T, &Q, tx, nx, ny))
+					continue;
+
+				i = _p_tile_insert(T, tile, nx, ny);
+				tile->active_list[n_active++] = i;
+				break;
+			}
+			if(k == Q.k)
+				tile->active_list[ax] = tile->active_list[--n_active];
+		}
+	}
+}
+
+static void *_p_tile_worker(void *arg) {
+	struct tiler *T = arg;
+	for(;;) {
+		int tx;
+#ifndef P_NO_THREADS
+		pthread_mutex_lock(&T->lock);
+#endif
+		tx = T->next;
+		T->next += 2;
+#ifndef P_NO_THREADS
+		pthread_mutex_unlock(&T->lock);
+#endif
+		if(tx >= T->tiles_w)
+			break;
+		_p_sample_tile(T, tx);
+	}
+	return NULL;
+}
+
+static void _p_run_phase(struct tiler *T, int phase, int threads) {
+	T->next = phase;
+#ifndef P_NO_THREADS
+	{
+		pthread_t tids[64];
+		int i, started = 0;
+		if(threads > 64)
+			threads = 64;
+		for(i = 1; i < threads; i++) {
+			if(pthread_create(&tids[started], NULL, _p_tile_worker, T))
+				break;
+			started++;
+		}
+		_p_tile_worker(T);
+		for(i = 0; i < started; i++)
+			pthread_join(tids[i], NULL);
+	}
+#else
+	(void)threads;
+	_p_tile_worker(T);
+#endif
+}
+
+static void _p_free_tiler(struct tiler *T) {
+	int i;
+	if(T->tiles) {
+		for(i = 0; i < T->tiles_w; i++) {
+			free(T->tiles[i].points);
+			free(T->tiles[i].active_list);
+		}
+		free(T->tiles);
+	}
+	free(T->ring);
+#ifndef P_NO_THREADS
+	pthread_mutex_destroy(&T->lock);
+#endif
+	free(T);
+}
+
+/* Samples the whole domain a tile at a time on `threads` threads, passing
+the points to `emit` instead of keeping them in `P->points`.
+`P->n_points` is set to the total number of points */
+int poisson_plot_tiled(struct poisson *P, poisson_emit emit, int threads) {
+	struct tiler *T;
+	int i, tx, ring_size;
 
-	G.grid = malloc(G.grid_size * sizeof *G.grid);
-	if(!G.grid) {
+	poisson_done(P);
+
+	T = calloc(1, sizeof *T);
+	if(!T) {
 		fprintf(stderr, "no memory\n");
 		return 0;
 	}
-	for(i = 0; i < G.grid_size; i++)
-		G.grid[i] = -1;
+	T->P = P;
+	T->cell_size = P->r / sqrt(N);
+	T->r2 = P->r * P->r;
+	T->grid_w = (int)(P->w / T->cell_size) + 1;
+	T->grid_h = (int)(P->h / T->cell_size) + 1;
+	T->tiles_w = (T->grid_w + P_TILE - 1) / P_TILE;
+	T->tiles_h = (T->grid_h + P_TILE - 1) / P_TILE;
+	T->seed = ((uint64_t)_p_rand32(P) << 32) | _p_rand32(P);
+#ifndef P_NO_THREADS
+	pthread_mutex_init(&T->lock, NULL);
+#endif
+	_p_make_table(T->cos_table, T->sin_table);
 
-	G.active_list = malloc(G.grid_size * sizeof *G.active_list);
-	if(!G.active_list) {
-		free(G.grid);
+	ring_size = 2 * P_TILE * T->grid_w;
+	T->ring = malloc(ring_size * sizeof *T->ring);
+	T->tiles = calloc(T->tiles_w, sizeof *T->tiles);
+	if(!T->ring || !T->tiles) {
+		_p_free_tiler(T);
 		fprintf(stderr, "no memory\n");
 		return 0;
 	}
-	G.n_active = 0;
+	for(tx = 0; tx < T->tiles_w; tx++) {
+		T->tiles[tx].points = malloc(P_TILE * P_TILE * sizeof *T->tiles[tx].points);
+		T->tiles[tx].active_list = malloc(P_TILE * P_TILE * sizeof *T->tiles[tx].active_list);
+		if(!T->tiles[tx].points || !T->tiles[tx].active_list) {
+			_p_free_tiler(T);
+			fprintf(stderr, "no memory\n");
+			return 0;
+		}
+	}
+
+	for(T->ty = 0; T->ty < T->tiles_h; T->ty++) {
+		struct point *rows = _p_ring_cell(T, 0, T->ty * P_TILE);
+		for(i = 0; i < P_TILE * T->grid_w; i++)
+			rows[i].x = -1;
+
+		_p_run_phase(T, 0, threads);
+		_p_run_phase(T, 1, threads);
+
+		for(tx = 0; tx < T->tiles_w; tx++) {
+			if(T->tiles[tx].n_points > 0)
+				emit(P, T->tiles[tx].points, T->tiles[tx].n_points);
+			P->n_points += T->tiles[tx].n_points;
+		}
+	}
+
+	_p_free_tiler(T);
+	return 1;
+}
+
+/* Toroidal sampling
+
+poisson_plot_toroidal() samples a point set that tiles seamlessly, for
+textures like hatching: Distances wrap around the edges of the domain, so
+copies of it placed side by side still keep their points `r` apart.
+The constraint isn't used; it is applied when the set is stamped out with
+poisson_stamp().
+
+The grid has a whole number of cells across the domain, so they're a bit
+smaller than r/sqrt(2) and need not be square, which means that the corners
+of the 5x5 block of cells around a candidate can't be skipped.
+*/
+
+static void _p_torus_cell(struct generator *G, float x, float y, int *gx, int *gy) {
+	*gx = MIN((int)(x / G->cell_size), G->grid_w - 1);
+	*gy = MIN((int)(y / G->cell_h), G->grid_h - 1);
+}
+
+static float _p_wrap(float d, float size) {
+	if(d > size / 2)
+		return d - size;
+	if(d < -size / 2)
+		return d + size;
+	return d;
+}
+
+static int _p_torus_valid(struct generator *G, float px, float py) {
+	int gx, gy, i, j;
+	struct poisson *P = G->P;
+
+	_p_torus_cell(G, px, py, &gx, &gy);
+	if(G->grid[gy * G->grid_w + gx] >= 0)
+		return 0;
+
+	for(j = gy - 2; j <= gy + 2; j++) {
+		const int *row = &G->grid[((j + G->grid_h) % G->grid_h) * G->grid_w];
+		for(i = gx - 2; i <= gx + 2; i++) {
+			int t = row[(i + G->grid_w) % G->grid_w];
+			float dx, dy;
+			if(t < 0)
+				continue;
+			dx = _p_wrap(px - P->points[t].x, P->w);
+			dy = _p_wrap(py - P->points[t].y, P->h);
+			if(dx * dx + dy * dy < G->r2)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+static int _p_torus_insert(struct generator *G, float x, float y) {
+	int gx, gy, index;
+	_p_torus_cell(G, x, y, &gx, &gy);
+	G->grid[gy * G->grid_w + gx] = G->P->n_points;
+	index = G->P->n_points++;
+	G->P->points[index].x = x;
+	G->P->points[index].y = y;
+	return index;
+}
+
+static float _p_torus_coord(float x, float size) {
+	if(x < 0)
+		x += size;
+	if(x >= size)
+		x -= size;
+	return x < 0 ? 0 : x;
+}
+
+int poisson_plot_toroidal(struct poisson *P) {
+	int i, k;
+	struct generator *G;
 
-	P->points = malloc(G.grid_size * sizeof *P->points);
-	if(!P->points) {
-		free(G.grid);
-		free(G.active_list);
+	poisson_done(P);
+
+	G = calloc(1, sizeof *G);
+	if(!G) {
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+	G->P = P;
+	G->r2 = P->r * P->r;
+	G->grid_w = (int)ceil(P->w * sqrt(N) / P->r);
+	G->grid_h = (int)ceil(P->h * sqrt(N) / P->r);
+	if(G->grid_w < 5 || G->grid_h < 5) {
+		fprintf(stderr, "poisson: the domain is too small to wrap around\n");
+		free(G);
+		return 0;
+	}
+	G->cell_size = (float)P->w / G->grid_w;
+	G->cell_h = (float)P->h / G->grid_h;
+	G->grid_size = G->grid_w * G->grid_h;
+
+	G->grid = malloc(G->grid_size * sizeof *G->grid);
+	G->active_list = malloc(G->grid_size * sizeof *G->active_list);
+	P->points = malloc(G->grid_size * sizeof *P->points);
+	if(!G->grid || !G->active_list || !P->points) {
+		_p_free_generator(G);
+		poisson_done(P);
 		fprintf(stderr, "no memory\n");
 		return 0;
 	}
+	for(i = 0; i < G->grid_size; i++)
+		G->grid[i] = -1;
+	_p_make_table(G->cos_table, G->sin_table);
 
-	i = _p_insert_point(&G, P->x0.x, P->x0.y);
-	G.active_list[G.n_active++] = i;
+	i = _p_torus_insert(G, _p_torus_coord(P->x0.x, P->w), _p_torus_coord(P->x0.y, P->h));
+	G->active_list[G->n_active++] = i;
 
-	while(G.n_active > 0) {
-		short ax = rand() % G.n_active;
-		short a = G.active_list[ax];
-		struct point *p = &P->points[a];
+	while(G->n_active > 0) {
+		int ax = _p_rand(P, G->n_active);
+		int a = G->active_list[ax];
+		float px = P->points[a].x, py = P->points[a].y;
 
 		for(k = 0; k < P->k; k++) {
-			float th = ((float)(rand() % 360)) * M_PI / 180;
-			float rad = (_p_frand() * 2.0 + 1.0) * P->r;
+			int th = _p_rand32(P) & (P_ANGLES - 1);
+			float rad = P->r * sqrtf(1.0f + 3.0f * _p_frand(P));
 
-			float nx = p->x + rad * cos(th);
-			float ny = p->y + rad * sin(th);
+			float nx = _p_torus_coord(px + rad * G->cos_table[th], P->w);
+			float ny = _p_torus_coord(py + rad * G->sin_table[th], P->h);
 
-			if(!_p_is_valid_point(&G, nx, ny))
+			if(!_p_torus_valid(G, nx, ny))
 				continue;
 
-			i = _p_insert_point(&G, nx, ny);
-			assert(G.n_active < G.grid_size);
-			G.active_list[G.n_active++] = i;
+			i = _p_torus_insert(G, nx, ny);
+			G->active_list[G->n_active++] = i;
 			break;
 		}
-		if(k == P->k) {
-			/* No point found - remove the point from the
-			active list by replacing it with the last one in the
-			list, and decrementing the counter */
-			G.active_list[ax] = G.active_list[--G.n_active];
-		}
+		if(k == P->k)
+			G->active_list[ax] = G->active_list[--G->n_active];
 	}
-	free(G.grid);
-	free(G.active_list);
+	_p_free_generator(G);
 
 	return 1;
 }
 
+/* Point sets are saved in a compact binary format, all little endian:
+
+    "PDS1"               magic
+    uint32 w, h          the size of the domain
+    uint32 r             the minimum distance, as the bits of a float
+    uint32 n             the number of points
+    n x uint16 x, y      the points, as fractions of w and h
+
+The points are quantised to 1/65536th of the domain, so a set loaded from a
+file may violate `r` by that much.
+*/
+static void _p_put32(unsigned char *b, uint32_t v) {
+	b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+static uint32_t _p_get32(const unsigned char *b) {
+	return b[0] | (b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static int _p_quantise(float x, int size) {
+	int q = (int)(x * 65536.0f / size);
+	return q < 0 ? 0 : q > 65535 ? 65535 : q;
+}
+
+int poisson_save(struct poisson *P, const char *path) {
+	unsigned char head[20], pt[4];
+	uint32_t r;
+	int i, ok;
+	FILE *f = fopen(path, "wb");
+	if(!f)
+		return 0;
+
+	memcpy(&r, &P->r, sizeof r);
+	memcpy(head, "PDS1", 4);
+	_p_put32(head + 4, P->w);
+	_p_put32(head + 8, P->h);
+	_p_put32(head + 12, r);
+	_p_put32(head + 16, P->n_points);
+	ok = fwrite(head, sizeof head, 1, f) == 1;
+
+	for(i = 0; ok && i < P->n_points; i++) {
+		int x = _p_quantise(P->points[i].x, P->w), y = _p_quantise(P->points[i].y, P->h);
+		pt[0] = x; pt[1] = x >> 8;
+		pt[2] = y; pt[3] = y >> 8;
+		ok = fwrite(pt, sizeof pt, 1, f) == 1;
+	}
+	if(fclose(f))
+		ok = 0;
+	return ok;
+}
+
+/* Replaces P's points, size and distance with those in the file */
+int poisson_load(struct poisson *P, const char *path) {
+	unsigned char head[20], *data;
+	uint32_t r, n, i;
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return 0;
+
+	if(fread(head, sizeof head, 1, f) != 1 || memcmp(head, "PDS1", 4)) {
+		fclose(f);
+		return 0;
+	}
+	n = _p_get32(head + 16);
+	if(n > 0x1000000 || !(data = malloc(n * 4 + 1))) {
+		fclose(f);
+		return 0;
+	}
+	if(fread(data, 4, n, f) != n) {
+		free(data);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	poisson_done(P);
+	if(!(P->points = malloc((n + 1) * sizeof *P->points))) {
+		free(data);
+		return 0;
+	}
+	P->w = _p_get32(head + 4);
+	P->h = _p_get32(head + 8);
+	r = _p_get32(head + 12);
+	memcpy(&P->r, &r, sizeof r);
+	for(i = 0; i < n; i++) {
+		P->points[i].x = ((data[i * 4] | (data[i * 4 + 1] << 8)) + 0.5f) * P->w / 65536.0f;
+		P->points[i].y = ((data[i * 4 + 2] | (data[i * 4 + 3] << 8)) + 0.5f) * P->h / 65536.0f;
+	}
+	P->n_points = n;
+	free(data);
+	return 1;
+}
+
+/* Stamps copies of the tileable point set `tile` across P's domain, with
+one of them at ox,oy. The points that satisfy P's constraint are passed to
+`emit` a copy at a time, and P->n_points is set to their number */
+int poisson_stamp(struct poisson *P, const struct poisson *tile, float ox, float oy, poisson_emit emit) {
+	struct point *buf;
+	float tx, ty;
+	int i;
+
+	poisson_done(P);
+	if(tile->n_points == 0 || tile->w <= 0 || tile->h <= 0)
+		return 1;
+
+	buf = malloc(tile->n_points * sizeof *buf);
+	if(!buf) {
+		fprintf(stderr, "no memory\n");
+		return 0;
+	}
+
+	ox = fmodf(ox, tile->w);
+	if(ox > 0)
+		ox -= tile->w;
+	oy = fmodf(oy, tile->h);
+	if(oy > 0)
+		oy -= tile->h;
+
+	for(ty = oy; ty < P->h; ty += tile->h) {
+		for(tx = ox; tx < P->w; tx += tile->w) {
+			int n = 0;
+			for(i = 0; i < tile->n_points; i++) {
+				float x = tx + tile->points[i].x, y = ty + tile->points[i].y;
+				if(x < 0 || x >= P->w || y < 0 || y >= P->h)
+					continue;
+				if(P->constraint && !P->constraint(P, x, y))
+					continue;
+				buf[n].x = x;
+				buf[n].y = y;
+				n++;
+			}
+			if(n > 0)
+				emit(P, buf, n);
+			P->n_points += n;
+		}
+	}
+	free(buf);
+	return 1;
+}
+
 #endif /* POISSON_IMPLEMENTATION */
 
 #ifdef POISSON_TEST
 
 #include <stdio.h>
 
+static float dist(float x0, float y0, float x1, float y1) {
+	float dx = x1 - x0, dy = y1 - y0;
+	return sqrt(dx * dx + dy * dy);
+}
+
 static int circle_constraint(struct poisson *P, float x, float y) {
 	return dist(P->x0.x, P->x0.y, x, y) < 20;
 }
@@ -270,9 +914,8 @@ int main(int argc, char* argv[]) {
 
 	(void)argc; (void)argv;
 
-	srand(time(NULL));
-
 	poisson_init(&P);
+	poisson_seed(&P, time(NULL));
 	P.r = 3.0;
 	P.x0.x = 50;
 	P.x0.y = 60;
@@ -297,9 +940,9 @@ int main(int argc, char* argv[]) {
 
 
 	for(i = 0; i < P.n_points; i++) {
-		float sx = _p_frand()*0.1 + 0.9;
-		float sy = _p_frand()*0.1 + 0.9;
-		fprintf(f, " <use href=\"#strokes\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", P.points[i].x, P.points[i].y, rand()%360 - 180, sx, sy);
+		float sx = _p_frand(&P)*0.1 + 0.9;
+		float sy = _p_frand(&P)*0.1 + 0.9;
+		fprintf(f, " <use href=\"#strokes\" transform=\"translate(%.2f %.2f) rotate(%d) scale(%.2f %.2f)\"/>\n", P.points[i].x, P.points[i].y, _p_rand(&P, 360) - 180, sx, sy);
 	}
 
 	fprintf(f, "</svg>\n");
@@ -0,0 +1,370 @@
+/*
+ * Draws SVG path data straight into a `Bitmap` from `bmph.h`, so that the
+ * same symbols that go into the SVG can be rendered without a SVG renderer.
+ *
+ * Paths are parsed by `rs_path()` from the `d` attribute of a `<path>`: The
+ * `M`, `L`, `H`, `V`, `C`, `Q` and `Z` commands are understood, also in
+ * lowercase. Parse them once and draw them many times: Parsing the numbers
+ * costs more than drawing a small shape. The points are transformed by a
+ * `RsMatrix` that works like the `transform` attribute in SVG:
+ * Each of `rs_translate()`, `rs_rotate()` and `rs_scale()` applies to the
+ * coordinates before the ones already in the matrix.
+ *
+ * Fills are done with `bm_fillpoly()` on the flattened curves, one subpath at
+ * a time. Strokes of up to a pixel and a half wide use `bm_line()` and
+ * `bm_bezier4()`; wider ones are drawn as a polygon for every segment with
+ * round joins. Everything is drawn in the bitmap's current color.
+ *
+ * `bmph.h` has to be included before this file.
+ *
+ * Author: Werner Stoop
+ * CC0 This work has been marked as dedicated to the public domain.
+ * https://creativecommons.org/publicdomain/zero/1.0/
+ */
+#ifndef RASTER_H
+#define RASTER_H
+
+typedef struct {
+	float a, b, c, d, e, f;
+} RsMatrix;
+
+typedef struct {
+	int n;
+	struct _rs_segment *segs;
+} RsPath;
+
+void rs_identity(RsMatrix *m);
+
+void rs_translate(RsMatrix *m, float x, float y);
+
+void rs_rotate(RsMatrix *m, float deg);
+
+void rs_scale(RsMatrix *m, float sx, float sy);
+
+float rs_size(const RsMatrix *m, float len);
+
+RsPath *rs_path(const char *d);
+
+void rs_path_free(RsPath *path);
+
+void rs_fill(Bitmap *b, const RsPath *path, const RsMatrix *m);
+
+void rs_stroke(Bitmap *b, const RsPath *path, const RsMatrix *m, float width);
+
+#ifdef RASTER_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+/* The most points in a flattened subpath; longer ones are cut short */
+#ifndef RS_MAX_POINTS
+# define RS_MAX_POINTS	1024
+#endif
+
+/* Curves are flattened into segments about this many pixels long */
+#define RS_FLATNESS		3.0f
+
+void rs_identity(RsMatrix *m) {
+	m->a = 1; m->b = 0;
+	m->c = 0; m->d = 1;
+	m->e = 0; m->f = 0;
+}
+
+void rs_translate(RsMatrix *m, float x, float y) {
+	m->e += m->a * x + m->c * y;
+	m->f += m->b * x + m->d * y;
+}
+
+void rs_rotate(RsMatrix *m, float deg) {
+	float c = cos(deg * M_PI / 180), s = sin(deg * M_PI / 180);
+	float a = m->a, b = m->b;
+	m->a = a * c + m->c * s;
+	m->b = b * c + m->d * s;
+	m->c = m->c * c - a * s;
+	m->d = m->d * c - b * s;
+}
+
+void rs_scale(RsMatrix *m, float sx, float sy) {
+	m->a *= sx; m->b *= sx;
+	m->c *= sy; m->d *= sy;
+}
+
+/* The length `len` in pixels, on average over all directions */
+float rs_size(const RsMatrix *m, float len) {
+	return len * sqrtf(fabsf(m->a * m->d - m->b * m->c));
+}
+
+enum {_RS_ERROR, _RS_END, _RS_MOVE, _RS_LINE, _RS_CURVE};
+
+struct _rs_segment {
+	int type;
+	float p[8];
+};
+
+typedef struct {
+	const char *s;
+	char cmd;
+	/* The current point and the start of the subpath */
+	float x, y, x0, y0;
+} _RsPath;
+
+static void _rs_skip(_RsPath *P) {
+	while(isspace(*P->s) || *P->s == ',')
+		P->s++;
+}
+
+static int _rs_number(_RsPath *P, float *v) {
+	char *end;
+	_rs_skip(P);
+	*v = strtof(P->s, &end);
+	if(end == P->s)
+		return 0;
+	P->s = end;
+	return 1;
+}
+
+/* Reads the next segment of the path into `p` as a start and an end point
+for a line or a move, or a start point, two control points and an end point
+for a curve. Quadratic curves are turned into cubic ones */
+static int _rs_next(_RsPath *P, float p[8]) {
+	float v[6];
+	int i, n;
+	char c;
+
+	_rs_skip(P);
+	if(!*P->s)
+		return _RS_END;
+	if(isalpha(*P->s))
+		c = *P->s++;
+	else if(P->cmd && toupper(P->cmd) != 'Z')
+		c = P->cmd;
+	else
+		return _RS_ERROR;
+
+	switch(toupper(c)) {
+		case 'Z': n = 0; break;
+		case 'H':
+		case 'V': n = 1; break;
+		case 'M':
+		case 'L': n = 2; break;
+		case 'Q': n = 4; break;
+		case 'C': n = 6; break;
+		default: return _RS_ERROR;
+	}
+	for(i = 0; i < n; i++)
+		if(!_rs_number(P, &v[i]))
+			return _RS_ERROR;
+
+	if(toupper(c) == 'H') {
+		v[1] = P->y;
+		if(islower(c))
+			v[0] += P->x;
+		n = 0;
+	} else if(toupper(c) == 'V') {
+		v[1] = islower(c) ? v[0] + P->y : v[0];
+		v[0] = P->x;
+		n = 0;
+	}
+	if(islower(c))
+		for(i = 0; i < n; i += 2) {
+			v[i] += P->x;
+			v[i + 1] += P->y;
+		}
+
+	/* Coordinates after a M are for implicit L's */
+	P->cmd = (c == 'M') ? 'L' : (c == 'm') ? 'l' : c;
+
+	for(i = 0; i < 8; i += 2) {
+		p[i] = P->x;
+		p[i + 1] = P->y;
+	}
+	switch(toupper(c)) {
+		case 'M':
+			p[2] = P->x = P->x0 = v[0];
+			p[3] = P->y = P->y0 = v[1];
+			return _RS_MOVE;
+		case 'Z':
+			v[0] = P->x0;
+			v[1] = P->y0;
+			/* fallthrough */
+		case 'H':
+		case 'V':
+		case 'L':
+			p[2] = P->x = v[0];
+			p[3] = P->y = v[1];
+			return _RS_LINE;
+		case 'Q':
+			p[2] = p[0] + (v[0] - p[0]) * 2 / 3;
+			p[3] = p[1] + (v[1] - p[1]) * 2 / 3;
+			p[4] = v[2] + (v[0] - v[2]) * 2 / 3;
+			p[5] = v[3] + (v[1] - v[3]) * 2 / 3;
+			p[6] = P->x = v[2];
+			p[7] = P->y = v[3];
+			return _RS_CURVE;
+		default:
+			for(i = 0; i < 6; i++)
+				p[i + 2] = v[i];
+			P->x = v[4];
+			P->y = v[5];
+			return _RS_CURVE;
+	}
+}
+
+/* Returns NULL if `d` isn't valid */
+RsPath *rs_path(const char *d) {
+	_RsPath P = {d, 0, 0, 0, 0, 0};
+	struct _rs_segment *segs = NULL, *g;
+	RsPath *path;
+	int n = 0, a = 0, t;
+	float p[8];
+
+	while((t = _rs_next(&P, p)) != _RS_END) {
+		if(t == _RS_ERROR) {
+			free(segs);
+			return NULL;
+		}
+		if(n == a) {
+			a = a ? a * 2 : 16;
+			if(!(g = realloc(segs, a * sizeof *g))) {
+				free(segs);
+				return NULL;
+			}
+			segs = g;
+		}
+		segs[n].type = t;
+		memcpy(segs[n].p, p, sizeof p);
+		n++;
+	}
+	if(!(path = malloc(sizeof *path))) {
+		free(segs);
+		return NULL;
+	}
+	path->n = n;
+	path->segs = segs;
+	return path;
+}
+
+void rs_path_free(RsPath *path) {
+	if(!path)
+		return;
+	free(path->segs);
+	free(path);
+}
+
+static int _rs_transform(const struct _rs_segment *g, const RsMatrix *m, float p[8]) {
+	int i;
+	for(i = 0; i < 8; i += 2) {
+		float x = g->p[i], y = g->p[i + 1];
+		p[i] = m->a * x + m->c * y + m->e;
+		p[i + 1] = m->b * x + m->d * y + m->f;
+	}
+	return g->type;
+}
+
+/* Number of segments to flatten a curve into, from the length of its hull */
+static int _rs_steps(const float p[8]) {
+	float len = 0;
+	int i, n;
+	for(i = 0; i < 6; i += 2)
+		len += hypotf(p[i + 2] - p[i], p[i + 3] - p[i + 1]);
+	n = (int)(len / RS_FLATNESS) + 1;
+	return n > 32 ? 32 : n;
+}
+
+static void _rs_bezier(const float p[8], float t, float *x, float *y) {
+	float u = 1 - t;
+	float a = u * u * u, b = 3 * u * u * t, c = 3 * u * t * t, d = t * t * t;
+	*x = a * p[0] + b * p[2] + c * p[4] + d * p[6];
+	*y = a * p[1] + b * p[3] + c * p[5] + d * p[7];
+}
+
+static void _rs_point(BmPoint *pts, int *n, float x, float y) {
+	if(*n < RS_MAX_POINTS) {
+		pts[*n].x = (int)floorf(x + 0.5f);
+		pts[*n].y = (int)floorf(y + 0.5f);
+		(*n)++;
+	}
+}
+
+void rs_fill(Bitmap *b, const RsPath *path, const RsMatrix *m) {
+	BmPoint pts[RS_MAX_POINTS];
+	float p[8], x, y;
+	int i, j, k, n = 0, t;
+
+	for(j = 0; j <= path->n; j++) {
+		t = (j < path->n) ? _rs_transform(&path->segs[j], m, p) : _RS_END;
+		if(t == _RS_MOVE || t == _RS_END) {
+			if(n > 2)
+				bm_fillpoly(b, pts, n);
+			n = 0;
+		} else if(n == 0)
+			_rs_point(pts, &n, p[0], p[1]);
+
+		if(t == _RS_LINE)
+			_rs_point(pts, &n, p[2], p[3]);
+		else if(t == _RS_CURVE) {
+			k = _rs_steps(p);
+			for(i = 1; i <= k; i++) {
+				_rs_bezier(p, (float)i / k, &x, &y);
+				_rs_point(pts, &n, x, y);
+			}
+		}
+	}
+}
+
+/* A segment of a wide stroke, with a round join at its end */
+static void _rs_thick_line(Bitmap *b, float x0, float y0, float x1, float y1, float hw) {
+	BmPoint q[4];
+	float len = hypotf(x1 - x0, y1 - y0), nx, ny;
+	if(len > 0) {
+		nx = (y0 - y1) / len * hw;
+		ny = (x1 - x0) / len * hw;
+		q[0].x = (int)floorf(x0 + nx + 0.5f); q[0].y = (int)floorf(y0 + ny + 0.5f);
+		q[1].x = (int)floorf(x1 + nx + 0.5f); q[1].y = (int)floorf(y1 + ny + 0.5f);
+		q[2].x = (int)floorf(x1 - nx + 0.5f); q[2].y = (int)floorf(y1 - ny + 0.5f);
+		q[3].x = (int)floorf(x0 - nx + 0.5f); q[3].y = (int)floorf(y0 - ny + 0.5f);
+		bm_fillpoly(b, q, 4);
+	}
+	bm_fillcircle(b, (int)floorf(x1 + 0.5f), (int)floorf(y1 + 0.5f), (int)floorf(hw + 0.5f));
+}
+
+void rs_stroke(Bitmap *b, const RsPath *path, const RsMatrix *m, float width) {
+	float p[8], hw = rs_size(m, width) / 2, x, y, lx, ly;
+	int i, j, k, t, thin = (hw <= 0.75f);
+	int ip[8];
+
+	for(j = 0; j < path->n; j++) {
+		t = _rs_transform(&path->segs[j], m, p);
+		if(t == _RS_MOVE) {
+			/* The round cap at the start of the subpath */
+			if(!thin)
+				bm_fillcircle(b, (int)floorf(p[2] + 0.5f), (int)floorf(p[3] + 0.5f), (int)floorf(hw + 0.5f));
+			continue;
+		}
+		if(thin) {
+			for(i = 0; i < 8; i++)
+				ip[i] = (int)floorf(p[i] + 0.5f);
+			if(t == _RS_LINE)
+				bm_line(b, ip[0], ip[1], ip[2], ip[3]);
+			else
+				bm_bezier4(b, ip[0], ip[1], ip[2], ip[3], ip[4], ip[5], ip[6], ip[7]);
+		} else if(t == _RS_LINE)
+			_rs_thick_line(b, p[0], p[1], p[2], p[3], hw);
+		else {
+			lx = p[0];
+			ly = p[1];
+			k = _rs_steps(p);
+			for(i = 1; i <= k; i++) {
+				_rs_bezier(p, (float)i / k, &x, &y);
+				_rs_thick_line(b, lx, ly, x, y, hw);
+				lx = x;
+				ly = y;
+			}
+		}
+	}
+}
+
+#endif /* RASTER_IMPLEMENTATION */
+#endif /* RASTER_H */
@@ -0,0 +1,322 @@
+/*
+ * Buffered SVG writer.
+ *
+ * Output is collected in a large buffer and written with `fwrite()`, and
+ * numbers are formatted by hand instead of through `fprintf()`. Coordinates
+ * are written with up to 2 decimals, without trailing zeros.
+ *
+ * Paths are written with relative commands, so that lots of small shapes can
+ * be merged into a single `<path>` element instead of thousands of `<use>`s.
+ * The current point is tracked in hundredths, so the rounding errors of the
+ * relative moves don't accumulate along the path.
+ *
+ * Author: Werner Stoop
+ * CC0 This work has been marked as dedicated to the public domain.
+ * https://creativecommons.org/publicdomain/zero/1.0/
+ */
+#ifndef SVG_H
+#define SVG_H
+
+#include <stdio.h>
+
+typedef struct {
+	FILE *f;
+	char *buf;
+	int len, error;
+
+	/* Path state: The current point in hundredths, the last command,
+	and whether the next number needs a separator */
+	int px, py;
+	char cmd;
+	int sep;
+} SvgWriter;
+
+SvgWriter *svg_open(FILE *f);
+
+int svg_close(SvgWriter *W);
+
+int svg_flush(SvgWriter *W);
+
+void svg_write(SvgWriter *W, const char *s, int n);
+
+void svg_str(SvgWriter *W, const char *s);
+
+int svg_copy(SvgWriter *W, FILE *from);
+
+void svg_int(SvgWriter *W, int v);
+
+void svg_num(SvgWriter *W, float v);
+
+void svg_use(SvgWriter *W, const char *id, float x, float y);
+
+void svg_use_rotated(SvgWriter *W, const char *id, float x, float y, int rot, float cx, float cy);
+
+void svg_use_scaled(SvgWriter *W, const char *id, float x, float y, int rot, float sx, float sy);
+
+void svg_group(SvgWriter *W, float x, float y);
+
+void svg_group_end(SvgWriter *W);
+
+void svg_path_begin(SvgWriter *W);
+
+void svg_path_move(SvgWriter *W, float x, float y);
+
+void svg_path_curve(SvgWriter *W, float x1, float y1, float x2, float y2, float x, float y);
+
+void svg_path_end(SvgWriter *W, const char *attrs);
+
+#ifdef SVG_IMPLEMENTATION
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef SVG_BUFSIZE
+# define SVG_BUFSIZE	(256 * 1024)
+#endif
+
+SvgWriter *svg_open(FILE *f) {
+	SvgWriter *W = malloc(sizeof *W);
+	if(!W)
+		return NULL;
+	if(!(W->buf = malloc(SVG_BUFSIZE))) {
+		free(W);
+		return NULL;
+	}
+	W->f = f;
+	W->len = 0;
+	W->error = 0;
+	W->px = W->py = 0;
+	W->cmd = 0;
+	W->sep = 0;
+	return W;
+}
+
+/* Flushes and frees the writer, but doesn't close its file.
+Returns 0 if anything couldn't be written */
+int svg_close(SvgWriter *W) {
+	int ok = svg_flush(W);
+	free(W->buf);
+	free(W);
+	return ok;
+}
+
+int svg_flush(SvgWriter *W) {
+	if(W->len > 0 && fwrite(W->buf, 1, W->len, W->f) != (size_t)W->len)
+		W->error = 1;
+	W->len = 0;
+	return !W->error;
+}
+
+void svg_write(SvgWriter *W, const char *s, int n) {
+	while(n > 0) {
+		int k = SVG_BUFSIZE - W->len;
+		if(k == 0) {
+			svg_flush(W);
+			k = SVG_BUFSIZE;
+		}
+		if(k > n)
+			k = n;
+		memcpy(W->buf + W->len, s, k);
+		W->len += k;
+		s += k;
+		n -= k;
+	}
+}
+
+void svg_str(SvgWriter *W, const char *s) {
+	svg_write(W, s, strlen(s));
+}
+
+/* Appends the whole contents of the file `from` */
+int svg_copy(SvgWriter *W, FILE *from) {
+	char buf[8192];
+	size_t n;
+	rewind(from);
+	while((n = fread(buf, 1, sizeof buf, from)) > 0)
+		svg_write(W, buf, n);
+	return !ferror(from) && !W->error;
+}
+
+/* Numbers are at most 12 characters, so this is the space reserved for them */
+static char *_svg_reserve(SvgWriter *W) {
+	if(W->len > SVG_BUFSIZE - 16)
+		svg_flush(W);
+	return W->buf + W->len;
+}
+
+static int _svg_digits(char *p, unsigned int v) {
+	char tmp[10];
+	int n = 0, i;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while(v);
+	for(i = 0; i < n; i++)
+		p[i] = tmp[n - 1 - i];
+	return n;
+}
+
+void svg_int(SvgWriter *W, int v) {
+	char *p = _svg_reserve(W);
+	int n = 0;
+	if(v < 0) {
+		p[n++] = '-';
+		n += _svg_digits(p + n, -(unsigned int)v);
+	} else
+		n = _svg_digits(p, v);
+	W->len += n;
+}
+
+static int _svg_hundredths(float v) {
+	return (int)floorf(v * 100.0f + 0.5f);
+}
+
+/* Writes a number given in hundredths */
+static void _svg_fixed(SvgWriter *W, int v) {
+	char *p = _svg_reserve(W);
+	unsigned int u;
+	int n = 0, frac;
+	if(v < 0) {
+		p[n++] = '-';
+		u = -(unsigned int)v;
+	} else
+		u = v;
+	n += _svg_digits(p + n, u / 100);
+	if((frac = u % 100) != 0) {
+		p[n++] = '.';
+		p[n++] = '0' + frac / 10;
+		if(frac % 10)
+			p[n++] = '0' + frac % 10;
+	}
+	W->len += n;
+}
+
+void svg_num(SvgWriter *W, float v) {
+	_svg_fixed(W, _svg_hundredths(v));
+}
+
+static void _svg_xy(SvgWriter *W, float x, float y) {
+	svg_num(W, x);
+	svg_write(W, " ", 1);
+	svg_num(W, y);
+}
+
+/* <use>s that are only translated are placed with x and y, which is
+shorter than a transform, and the same when there's no rotation */
+void svg_use(SvgWriter *W, const char *id, float x, float y) {
+	svg_str(W, " <use href=\"#");
+	svg_str(W, id);
+	if(_svg_hundredths(x)) {
+		svg_str(W, "\" x=\"");
+		svg_num(W, x);
+	}
+	if(_svg_hundredths(y)) {
+		svg_str(W, "\" y=\"");
+		svg_num(W, y);
+	}
+	svg_str(W, "\"/>\n");
+}
+
+static void _svg_use_transform(SvgWriter *W, const char *id, float x, float y) {
+	svg_str(W, " <use href=\"#");
+	svg_str(W, id);
+	svg_str(W, "\" transform=\"");
+	if(_svg_hundredths(x) || _svg_hundredths(y)) {
+		svg_str(W, "translate(");
+		_svg_xy(W, x, y);
+		svg_str(W, ") ");
+	}
+}
+
+/* Translated to x,y and rotated by `rot` degrees around cx,cy */
+void svg_use_rotated(SvgWriter *W, const char *id, float x, float y, int rot, float cx, float cy) {
+	if(rot % 360 == 0) {
+		svg_use(W, id, x, y);
+		return;
+	}
+	_svg_use_transform(W, id, x, y);
+	svg_str(W, "rotate(");
+	svg_int(W, rot);
+	if(_svg_hundredths(cx) || _svg_hundredths(cy)) {
+		svg_write(W, " ", 1);
+		_svg_xy(W, cx, cy);
+	}
+	svg_str(W, ")\"/>\n");
+}
+
+/* Translated to x,y, rotated by `rot` degrees and scaled by sx,sy */
+void svg_use_scaled(SvgWriter *W, const char *id, float x, float y, int rot, float sx, float sy) {
+	_svg_use_transform(W, id, x, y);
+	svg_str(W, "rotate(");
+	svg_int(W, rot);
+	svg_str(W, ") scale(");
+	_svg_xy(W, sx, sy);
+	svg_str(W, ")\"/>\n");
+}
+
+void svg_group(SvgWriter *W, float x, float y) {
+	svg_str(W, " <g transform=\"translate(");
+	_svg_xy(W, x, y);
+	svg_str(W, ")\">\n");
+}
+
+void svg_group_end(SvgWriter *W) {
+	svg_str(W, " </g>\n");
+}
+
+void svg_path_begin(SvgWriter *W) {
+	svg_str(W, " <path d=\"");
+	W->px = W->py = 0;
+	W->cmd = 0;
+	W->sep = 0;
+}
+
+/* Writes the command, unless it repeats the last one */
+static void _svg_cmd(SvgWriter *W, char cmd) {
+	if(W->cmd != cmd) {
+		svg_write(W, &cmd, 1);
+		W->cmd = cmd;
+		W->sep = 0;
+	}
+}
+
+/* Writes a coordinate relative to `*cur`, in hundredths */
+static void _svg_rel(SvgWriter *W, int v, int *cur) {
+	int d = v - *cur;
+	if(W->sep && d >= 0)
+		svg_write(W, " ", 1);
+	_svg_fixed(W, d);
+	W->sep = 1;
+	*cur = v;
+}
+
+void svg_path_move(SvgWriter *W, float x, float y) {
+	/* After an `m` more pairs would be taken as `l`ines */
+	W->cmd = 0;
+	_svg_cmd(W, 'm');
+	_svg_rel(W, _svg_hundredths(x), &W->px);
+	_svg_rel(W, _svg_hundredths(y), &W->py);
+}
+
+/* A cubic Bezier curve from the current point; the control points
+are all relative to the current point, so they're written that way */
+void svg_path_curve(SvgWriter *W, float x1, float y1, float x2, float y2, float x, float y) {
+	int px = W->px, py = W->py, t;
+	_svg_cmd(W, 'c');
+	t = px; _svg_rel(W, _svg_hundredths(x1), &t);
+	t = py; _svg_rel(W, _svg_hundredths(y1), &t);
+	t = px; _svg_rel(W, _svg_hundredths(x2), &t);
+	t = py; _svg_rel(W, _svg_hundredths(y2), &t);
+	_svg_rel(W, _svg_hundredths(x), &W->px);
+	_svg_rel(W, _svg_hundredths(y), &W->py);
+}
+
+void svg_path_end(SvgWriter *W, const char *attrs) {
+	svg_str(W, "\" ");
+	svg_str(W, attrs);
+	svg_str(W, "/>\n");
+}
+
+#endif /* SVG_IMPLEMENTATION */
+#endif /* SVG_H */
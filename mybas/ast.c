@@ -9,33 +9,71 @@
 #include "ast.h"
 #include "bas.h"
 
-Node *node_string(char *s) {
-    Node *node = malloc(sizeof * node);
-    if(!node) return NULL;
-    node->type = nt_str;
-    node->u.str = strdup(s);
+/* All nodes, strings and child arrays are allocated from an arena
+so that the whole tree can be freed at once with free_ast() */
+#define BLOCK_SIZE 65536
+
+typedef struct Block {
+    struct Block *next;
+    size_t used, size;
+    double data[1]; /* aligned for anything a Node contains */
+} Block;
+
+static Block *Arena = NULL;
+
+static void *ast_alloc(size_t n) {
+    void *p;
+    n = (n + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    if(!Arena || Arena->used + n > Arena->size) {
+        size_t size = n > BLOCK_SIZE ? n : BLOCK_SIZE;
+        Block *b = malloc(sizeof *b + size);
+        if(!b) error("out of memory");
+        b->next = Arena;
+        b->used = 0;
+        b->size = size;
+        Arena = b;
+    }
+    p = (char *)Arena->data + Arena->used;
+    Arena->used += n;
+    return p;
+}
+
+static char *ast_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    return memcpy(ast_alloc(len), s, len);
+}
+
+void free_ast() {
+    while(Arena) {
+        Block *b = Arena;
+        Arena = b->next;
+        free(b);
+    }
+}
+
+static Node *new_node(enum NodeType type) {
+    Node *node = ast_alloc(sizeof * node);
+    node->type = type;
     node->line = Line;
     node->basic_line = BasicLine;
     return node;
 }
 
+Node *node_string(char *s) {
+    Node *node = new_node(nt_str);
+    node->u.str = ast_strdup(s);
+    return node;
+}
+
 Node *node_id(char *i) {
-    Node *node = malloc(sizeof * node);
-    if(!node) return NULL;
-    node->type = nt_id;
-    node->u.str = strdup(i);
-    node->line = Line;
-    node->basic_line = BasicLine;
+    Node *node = new_node(nt_id);
+    node->u.str = ast_strdup(i);
     return node;
 }
 
 Node *node_number(double num) {
-    Node *node = malloc(sizeof * node);
-    if(!node) return NULL;
-    node->type = nt_num;
+    Node *node = new_node(nt_num);
     node->u.num = num;
-    node->line = Line;
-    node->basic_line = BasicLine;
     return node;
 }
 
@@ -43,41 +81,31 @@ Node *node_operator(int op, int nargs, ...) {
     int i;
     va_list ap;
 
-    Node *node = malloc(sizeof * node);
-    if(!node) return NULL;
-    node->type = nt_opr;
+    Node *node = new_node(nt_opr);
     node->u.opr.op = op;
     node->u.opr.nc = nargs;
-    node->u.opr.ac = nargs;
-    if(node->u.opr.ac == 0)
-        node->u.opr.ac = 1;
-    node->u.opr.children = calloc(node->u.opr.ac, sizeof *node->u.opr.children);
-    if(!node->u.opr.children) {
-        free(node);
-        return NULL;
-    }
+    node->u.opr.ac = nargs < 4 ? 4 : nargs;
+    node->u.opr.children = ast_alloc(node->u.opr.ac * sizeof *node->u.opr.children);
     va_start(ap, nargs);
     for(i = 0; i < nargs; i++) {
         node->u.opr.children[i] = va_arg(ap, Node *);
     }
     va_end(ap);
-    node->line = Line;
-    node->basic_line = BasicLine;
     return node;
 }
 
 Node *node_add_child(Node *parent, Node *child) {
     int n;
-    Node **re;
     assert(parent->type == nt_opr);
 
     n = parent->u.opr.nc;
     if(n == parent->u.opr.ac) {
-        parent->u.opr.ac <<= 1;
-        re = realloc(parent->u.opr.children, parent->u.opr.ac * sizeof *parent->u.opr.children);
-        if(!re)
-            return NULL;
+        /* The old array stays in the arena; growing
+        geometrically keeps the waste bounded */
+        Node **re = ast_alloc(2 * n * sizeof *re);
+        memcpy(re, parent->u.opr.children, n * sizeof *re);
         parent->u.opr.children = re;
+        parent->u.opr.ac = 2 * n;
     }
     assert(n < parent->u.opr.ac);
     parent->u.opr.children[n] = child;
@@ -86,20 +114,113 @@ Node *node_add_child(Node *parent, Node *child) {
     return parent;
 }
 
-void free_node(Node *node) {
-    if(!node) return;
+/* Saving and loading:
+The tree is written in pre-order; each node is its type, lines and
+value, and operators are followed by their children. */
+#define AST_MAGIC "BAST1"
+
+static void write_int(FILE *f, int i) {
+    fwrite(&i, sizeof i, 1, f);
+}
+
+static void write_str(FILE *f, const char *s) {
+    int len = strlen(s);
+    write_int(f, len);
+    fwrite(s, 1, len, f);
+}
+
+static void save_node(Node *node, FILE *f) {
+    int i;
+    if(!node) {
+        write_int(f, -1);
+        return;
+    }
+    write_int(f, node->type);
+    write_int(f, node->line);
+    write_int(f, node->basic_line);
     switch(node->type) {
-        case nt_id :
-        case nt_str : free(node->u.str); break;
-        case nt_opr : {
-            int i;
+        case nt_num: fwrite(&node->u.num, sizeof node->u.num, 1, f); break;
+        case nt_id:
+        case nt_str: write_str(f, node->u.str); break;
+        case nt_opr:
+            write_int(f, node->u.opr.op);
+            write_int(f, node->u.opr.nc);
             for(i = 0; i < node->u.opr.nc; i++)
-                free_node(node->u.opr.children[i]);
-            free(node->u.opr.children);
-        } break;
-        default : break;
+                save_node(node->u.opr.children[i], f);
+            break;
+    }
+}
+
+int save_ast(Node *root, const char *filename, FILE *f) {
+    fwrite(AST_MAGIC, 1, sizeof AST_MAGIC, f);
+    write_str(f, filename);
+    save_node(root, f);
+    return ferror(f) ? -1 : 0;
+}
+
+static int read_int(FILE *f) {
+    int i;
+    if(fread(&i, sizeof i, 1, f) != 1)
+        error("truncated AST file");
+    return i;
+}
+
+static char *read_str(FILE *f) {
+    int len = read_int(f);
+    char *s;
+    if(len < 0)
+        error("corrupt AST file");
+    s = ast_alloc(len + 1);
+    if(fread(s, 1, len, f) != (size_t)len)
+        error("truncated AST file");
+    s[len] = '\0';
+    return s;
+}
+
+static Node *load_node(FILE *f) {
+    int i, nc, type = read_int(f);
+    Node *node;
+    if(type < 0)
+        return NULL;
+    node = new_node(type);
+    node->line = read_int(f);
+    node->basic_line = read_int(f);
+    switch(type) {
+        case nt_num:
+            if(fread(&node->u.num, sizeof node->u.num, 1, f) != 1)
+                error("truncated AST file");
+            break;
+        case nt_id:
+        case nt_str: node->u.str = read_str(f); break;
+        case nt_opr:
+            node->u.opr.op = read_int(f);
+            nc = read_int(f);
+            if(nc < 0)
+                error("corrupt AST file");
+            node->u.opr.nc = nc;
+            node->u.opr.ac = nc ? nc : 1;
+            node->u.opr.children = ast_alloc(node->u.opr.ac * sizeof *node->u.opr.children);
+            for(i = 0; i < nc; i++)
+                node->u.opr.children[i] = load_node(f);
+            break;
+        default: error("corrupt AST file");
     }
-    free(node);
+    return node;
+}
+
+int is_ast_file(FILE *f) {
+    char magic[sizeof AST_MAGIC];
+    int is_ast = fread(magic, 1, sizeof magic, f) == sizeof magic && !memcmp(magic, AST_MAGIC, sizeof magic);
+    rewind(f);
+    return is_ast;
+}
+
+Node *load_ast(FILE *f, const char **filename) {
+    char magic[sizeof AST_MAGIC];
+    if(fread(magic, 1, sizeof magic, f) != sizeof magic || memcmp(magic, AST_MAGIC, sizeof magic))
+        error("not an AST file");
+    *filename = read_str(f);
+    return load_node(f);
 }
 
 static void print_node(Node *node, int level) {
@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 enum NodeType {nt_opr, nt_num, nt_str, nt_id};
 
 typedef struct Node {
@@ -24,6 +26,12 @@ Node *node_operator(int op, int nargs, ...);
 
 Node *node_add_child(Node *parent, Node *child);
 
-void free_node(Node *node);
+void free_ast();
+
+int save_ast(Node *root, const char *filename, FILE *f);
+
+int is_ast_file(FILE *f);
+
+Node *load_ast(FILE *f, const char **filename);
 
 void print_tree(Node *node);
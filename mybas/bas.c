@@ -9,6 +9,15 @@ https://en.wikipedia.org/wiki/Recursive_descent_parser
 #include <stdarg.h>
 #include <assert.h>
 
+#ifdef _WIN32
+#  include <process.h>
+#else
+#  include <sys/stat.h>
+#  include <sys/wait.h>
+#  include <spawn.h>
+extern char **environ;
+#endif
+
 #include "bas.h"
 #include "ast.h"
 #include "hash.h"
@@ -480,32 +489,179 @@ const char *nodename(int type) {
     return buffer;
 }
 
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [options] file.bas\n", name);
+    fprintf(stderr, "Writes the C code for file.bas to stdout, unless one of these is given:\n");
+    fprintf(stderr, "  --run            compile and run the program (without arguments)\n");
+    fprintf(stderr, "  --emit-exe FILE  compile the program to the executable FILE\n");
+    fprintf(stderr, "  --emit-lib FILE  compile the program to a shared library FILE\n");
+    fprintf(stderr, "                   that exports `void bas_run(void)`\n");
+    fprintf(stderr, "  -c DIR           directory to cache compiled programs in\n");
+    fprintf(stderr, "  -O0              don't optimize the program\n");
+    fprintf(stderr, "  --save-ast FILE  save the parsed program to FILE, which can be\n");
+    fprintf(stderr, "                   given instead of file.bas to skip parsing it\n");
+}
+
+/* The compiled programs are cached per user, since a shared directory
+like /tmp would let others plant a binary for `--run` to execute */
+static const char *default_cachedir() {
+    static char parent[500], dir[sizeof parent + 8];
+    const char *base = getenv("XDG_CACHE_HOME");
+#ifdef _WIN32
+    if(!base) base = getenv("LOCALAPPDATA");
+    if(!base) base = getenv("TEMP");
+    if(!base) base = ".";
+#else
+    if(!base || !*base) {
+        const char *home = getenv("HOME");
+        if(!home) home = ".";
+        snprintf(parent, sizeof parent, "%s/.cache", home);
+        mkdir(parent, 0700);
+        base = parent;
+    }
+#endif
+    snprintf(dir, sizeof dir, "%s/bas", base);
+    return dir;
+}
+
+/* Runs the program at `path` without arguments and returns its exit status */
+static int run(const char *path) {
+    int status;
+#ifdef _WIN32
+    status = (int)_spawnl(_P_WAIT, path, path, NULL);
+    return status == -1 ? 1 : status;
+#else
+    char *argv[2];
+    pid_t pid;
+    argv[0] = (char *)path;
+    argv[1] = NULL;
+    if(posix_spawn(&pid, path, NULL, NULL, argv, environ)) {
+        fprintf(stderr, "error running %s\n", path);
+        return 1;
+    }
+    if(waitpid(pid, &status, 0) < 0)
+        return 1;
+    /* Like a shell, report a signal as 128 + its number */
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+#endif
+}
+
+static int copy_file(const char *from, const char *to) {
+    char buffer[4096];
+    size_t n;
+    FILE *in, *out;
+    if(!(in = fopen(from, "rb")))
+        return 1;
+    if(!(out = fopen(to, "wb"))) {
+        fclose(in);
+        return 1;
+    }
+    while((n = fread(buffer, 1, sizeof buffer, in)) > 0) {
+        if(fwrite(buffer, 1, n, out) != n)
+            break;
+    }
+    fclose(in);
+    if(fclose(out) || n > 0)
+        return 1;
+#ifndef _WIN32
+    chmod(to, 0755);
+#endif
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if(argc < 2) {
+    enum {EMIT_C, RUN, EMIT_EXE, EMIT_LIB} mode = EMIT_C;
+    const char *infile = NULL, *outfile = NULL, *astfile = NULL, *cachedir = NULL;
+    char path[512];
+    int i, rc = 0, opt = 1;
+
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--run"))
+            mode = RUN;
+        else if(!strcmp(argv[i], "--emit-exe") && i + 1 < argc) {
+            mode = EMIT_EXE;
+            outfile = argv[++i];
+        } else if(!strcmp(argv[i], "--emit-lib") && i + 1 < argc) {
+            mode = EMIT_LIB;
+            outfile = argv[++i];
+        } else if(!strcmp(argv[i], "--save-ast") && i + 1 < argc)
+            astfile = argv[++i];
+        else if(!strcmp(argv[i], "-O0"))
+            opt = 0;
+        else if(!strcmp(argv[i], "-c") && i + 1 < argc)
+            cachedir = argv[++i];
+        else if(argv[i][0] == '-' || infile) {
+            usage(argv[0]);
+            return 1;
+        } else
+            infile = argv[i];
+    }
+    if(!infile) {
         fprintf(stderr, "no input file\n");
         return 1;
     }
 
-    char *text = readfile(argv[1]);
-    if(!text) {
-        fprintf(stderr, "error reading %s\n", argv[1]);
-        return 1;
+    Node *prog;
+    char *text = NULL;
+    FILE *f = fopen(infile, "rb");
+    if(f && is_ast_file(f)) {
+        prog = load_ast(f, &Filename);
+        fclose(f);
+    } else {
+        if(f) fclose(f);
+        text = readfile(infile);
+        if(!text) {
+            fprintf(stderr, "error reading %s\n", infile);
+            return 1;
+        }
+
+        init(text);
+
+        prog = program();
     }
 
-    init(text);
+    if(astfile) {
+        if(!(f = fopen(astfile, "wb")) || save_ast(prog, Filename, f) || fclose(f)) {
+            fprintf(stderr, "error writing %s\n", astfile);
+            return 1;
+        }
+    }
 
-    Node * prog = program();
+    if(opt)
+        optimize(prog);
 
-    fputs("/*==========\n", stdout);
+    if(mode == EMIT_C) {
+        fputs("/*==========\n", stdout);
 
-    print_tree(prog);
+        print_tree(prog);
 
-    fputs("==========*/\n\n", stdout);
+        fputs("==========*/\n\n", stdout);
 
-    compile(prog);
+        compile(prog, stdout, 0);
+    } else {
+        FILE *csrc = tmpfile();
+        if(!csrc) {
+            fprintf(stderr, "unable to create a temporary file\n");
+            return 1;
+        }
+        compile(prog, csrc, mode == EMIT_LIB);
+        if(!cachedir)
+            cachedir = default_cachedir();
+        rc = build(csrc, mode == EMIT_LIB, cachedir, path, sizeof path);
+        fclose(csrc);
+        if(!rc) {
+            if(mode == RUN) {
+                fflush(stdout);
+                rc = run(path);
+            } else if(copy_file(path, outfile)) {
+                fprintf(stderr, "error writing %s\n", outfile);
+                rc = 1;
+            }
+        }
+    }
 
-    free_node(prog);
+    free_ast();
 
     free(text);
-    return 0;
-}
\ No newline at end of file
+    return rc;
+}
@@ -1,3 +1,5 @@
+#include <stdio.h>
+
 enum Symbol {
     FEND = 0, NL, ID, NUM, STR, ARR,
     LET,READ,DATA,PRINT,GOTO,IF,FOR,NEXT,END,
@@ -16,4 +18,8 @@ extern int Line, BasicLine;
 
 struct Node;
 
-extern void compile(struct Node *node);
+extern void optimize(struct Node *prog);
+
+extern void compile(struct Node *node, FILE *f, int library);
+
+extern int build(FILE *csrc, int library, const char *cachedir, char *path, size_t size);
@@ -0,0 +1,187 @@
+/*
+Compiles the generated C with the system's C compiler.
+
+The binaries are cached by a hash of the generated C code and the
+compiler settings, so compiling the same program again is free.
+
+The compiler can be set through the `CC` environment variable and
+its flags through `BAS_CFLAGS`.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bas.h"
+
+#ifdef _WIN32
+#  include <io.h>
+#  include <direct.h>
+#  define EXE_EXT ".exe"
+#  define LIB_EXT ".dll"
+static char *mkdtemp(char *tmpl) {
+    return _mktemp(tmpl) && !_mkdir(tmpl) ? tmpl : NULL;
+}
+#  define rmdir _rmdir
+#  define mkdir(dir, mode) _mkdir(dir)
+#else
+#  include <unistd.h>
+#  include <sys/stat.h>
+#  define EXE_EXT ""
+#  define LIB_EXT ".so"
+#endif
+
+static unsigned long long fnv1a(unsigned long long h, const char *s, size_t len) {
+    size_t i;
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static char *read_all(FILE *f, size_t *len) {
+    size_t cap = 4096, n;
+    char *buf = malloc(cap);
+    *len = 0;
+    rewind(f);
+    while(buf && (n = fread(buf + *len, 1, cap - *len, f)) > 0) {
+        *len += n;
+        if(*len == cap) {
+            char *re = realloc(buf, cap *= 2);
+            if(!re) {
+                free(buf);
+                return NULL;
+            }
+            buf = re;
+        }
+    }
+    return buf;
+}
+
+/* Quotes `s` for the shell in a string that the caller frees */
+static char *quote(const char *s) {
+    char *q = malloc(4 * strlen(s) + 3), *p = q;
+    if(!q)
+        return NULL;
+#ifdef _WIN32
+    *p++ = '"';
+    for(; *s; s++)
+        *p++ = *s;
+    *p++ = '"';
+#else
+    /* Nothing is special inside single quotes, except for the quote */
+    *p++ = '\'';
+    for(; *s; s++) {
+        if(*s == '\'') {
+            memcpy(p, "'\\''", 4);
+            p += 4;
+        } else
+            *p++ = *s;
+    }
+    *p++ = '\'';
+#endif
+    *p = '\0';
+    return q;
+}
+
+/* Is the cached binary `path` safe to use? Someone else's, or one
+that others can write to, could run anything */
+static int trusted(const char *path) {
+#ifdef _WIN32
+    (void)path;
+    return 1;
+#else
+    struct stat st;
+    if(stat(path, &st))
+        return 0;
+    return S_ISREG(st.st_mode) && st.st_uid == getuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+#endif
+}
+
+/* Builds the C code in `csrc` into an executable (or a shared library)
+in `cachedir`, unless it is already there, and writes its name to `path`.
+Returns 0 on success */
+int build(FILE *csrc, int library, const char *cachedir, char *path, size_t size) {
+    const char *cc = getenv("CC"), *cflags = getenv("BAS_CFLAGS");
+    char dir[512], cfile[sizeof dir + 16], tmp[sizeof dir + 16], *cmd, *text;
+    char *qcfile, *qtmp;
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    size_t len;
+    FILE *f;
+    int rc;
+
+    if(!cc) cc = "gcc";
+    if(!cflags) cflags = "-O2";
+
+    if(!(text = read_all(csrc, &len))) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    h = fnv1a(h, text, len);
+    h = fnv1a(h, cc, strlen(cc) + 1);
+    h = fnv1a(h, cflags, strlen(cflags) + 1);
+    h = fnv1a(h, library ? "lib" : "exe", 4);
+
+    mkdir(cachedir, 0700);
+    snprintf(path, size, "%s/bas-%016llx%s", cachedir, h, library ? LIB_EXT : EXE_EXT);
+    if((f = fopen(path, "rb"))) {
+        fclose(f);
+        free(text);
+        if(!trusted(path)) {
+            fprintf(stderr, "error: %s is not owned by you or can be written by others\n", path);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* The program is built in a fresh directory of its own so that
+    concurrent builds don't clobber each other's files and nothing can
+    be planted under a predictable name, and then renamed into the cache
+    so that an interrupted compile doesn't leave a broken binary there */
+    snprintf(dir, sizeof dir, "%s/bas-%016llx-XXXXXX", cachedir, h);
+    if(!mkdtemp(dir)) {
+        fprintf(stderr, "error creating a directory in %s\n", cachedir);
+        free(text);
+        return 1;
+    }
+    snprintf(cfile, sizeof cfile, "%s/prog.c", dir);
+    snprintf(tmp, sizeof tmp, "%s/prog%s", dir, library ? LIB_EXT : EXE_EXT);
+    if(!(f = fopen(cfile, "wb")) || fwrite(text, 1, len, f) != len) {
+        fprintf(stderr, "error writing %s\n", cfile);
+        if(f) fclose(f);
+        remove(cfile);
+        rmdir(dir);
+        free(text);
+        return 1;
+    }
+    fclose(f);
+    free(text);
+
+    /* `CC` and `BAS_CFLAGS` may hold several words, but the paths
+    are quoted so that nothing in the cache directory's name expands */
+    qcfile = quote(cfile);
+    qtmp = quote(tmp);
+    len = strlen(cc) + strlen(cflags) + 64;
+    if(qcfile && qtmp && (cmd = malloc(len += strlen(qcfile) + strlen(qtmp)))) {
+        snprintf(cmd, len, "%s %s%s -o %s %s -lm", cc, cflags, library ? " -shared -fPIC" : "", qtmp, qcfile);
+        rc = system(cmd);
+        free(cmd);
+    } else
+        rc = -1;
+    free(qcfile);
+    free(qtmp);
+    remove(cfile);
+    if(rc != 0) {
+        fprintf(stderr, "error: %s failed\n", cc);
+        remove(tmp);
+        rmdir(dir);
+        return 1;
+    }
+    rc = rename(tmp, path);
+    if(rc) {
+        fprintf(stderr, "error renaming %s to %s\n", tmp, path);
+        remove(tmp);
+    }
+    rmdir(dir);
+    return rc != 0;
+}
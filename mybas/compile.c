@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -11,6 +12,14 @@ static FILE *o;
 static hash_table LoopVariables;
 static hash_table DimmedVariables;
 
+/* Variables (and arrays) that may hold non-integral values.
+Everything else is proven integral and declared as `int_type` */
+static hash_table DoubleVariables;
+
+/* The parameter of the DEF FN being compiled, which shadows the
+global variable with the same name */
+static const char *FnParam = NULL;
+
 /* Tracks destinations of GOTOs and GOSUBs to
 shut GCC up about labels being defined but not used: */
 static hash_table Destinations;
@@ -45,18 +54,457 @@ static void visit(Node *node, int operator, visit_fun visitor) {
     }
 }
 
+static int var_is_int(const char *name) {
+    if(FnParam && !strcmp(name, FnParam))
+        return 0;
+    return !ht_get(DoubleVariables, name);
+}
+
+static const char *var_type(const char *name) {
+    return var_is_int(name) ? "int_type" : "num_type";
+}
+
+static int num_is_int(double num) {
+    return num > -2147483648.0 && num < 2147483648.0 && num == (long)num;
+}
+
+static int is_bounded_expr(Node *node);
+
+/* Can the expression only produce integral values? `+`, `-` and `*`
+are computed as `num_type` unless they can't overflow an `int_type` */
+static int is_int_expr(Node *node) {
+    int i;
+    switch(node->type) {
+        case nt_num: return num_is_int(node->u.num);
+        case nt_str: return 0;
+        case nt_id: return var_is_int(node->u.str);
+        case nt_opr: {
+            switch(node->u.opr.op) {
+                case VARIABLE:
+                case ARR:
+                    return var_is_int(node->u.opr.children[0]->u.str);
+                case FUN: {
+                    const char *name = node->u.opr.children[0]->u.str;
+                    return !strcmp(name, "INT") || !strcmp(name, "RND");
+                }
+                case '+':case '-':case '*':
+                    return is_bounded_expr(node);
+                case '%':
+                    for(i = 0; i < node->u.opr.nc; i++)
+                        if(!is_int_expr(node->u.opr.children[i]))
+                            return 0;
+                    return 1;
+                case '>':case '<':
+                case GTE:case LTE: case NEQ: case EQ:
+                    return 1;
+                default: return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int is_int_num(Node *node) {
+    return node->type == nt_num && num_is_int(node->u.num);
+}
+
+/* Can the expression only produce integral values that won't overflow
+an `int_type`? Values that are multiplied or added to themselves, like
+in X=X*3 or X=X+X, can grow without bound, so only constants, integral
+variables plus or minus a constant, INT(), RND() and comparisons count.
+Products are never bounded, even of constants, since folding them is
+left to the optimiser */
+static int is_bounded_expr(Node *node) {
+    switch(node->type) {
+        case nt_num: return num_is_int(node->u.num);
+        case nt_str: return 0;
+        case nt_id: return var_is_int(node->u.str);
+        case nt_opr: {
+            Node **c = node->u.opr.children;
+            switch(node->u.opr.op) {
+                case VARIABLE:
+                case ARR:
+                    return var_is_int(c[0]->u.str);
+                case FUN: {
+                    const char *name = c[0]->u.str;
+                    return !strcmp(name, "INT") || !strcmp(name, "RND");
+                }
+                case '+':case '-':
+                    if(node->u.opr.nc == 1)
+                        return is_bounded_expr(c[0]);
+                    return (is_bounded_expr(c[0]) && is_int_num(c[1]))
+                        || (is_int_num(c[0]) && is_bounded_expr(c[1]));
+                case '%':
+                    /* The result is smaller than the divisor */
+                    return is_int_expr(c[0]) && is_bounded_expr(c[1]);
+                case '>':case '<':
+                case GTE:case LTE: case NEQ: case EQ:
+                    return 1;
+                default: return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Type inference: Variables start out as integers, and are demoted
+to doubles when they are assigned a value that isn't integral or may
+grow without bound. Repeat until no more variables are demoted */
+static int Demoted;
+
+static void demote(Node *var, Node *value) {
+    const char *name = var->u.opr.children[0]->u.str;
+    if(var_is_int(name) && !is_bounded_expr(value)) {
+        ht_put(DoubleVariables, name, var);
+        Demoted = 1;
+    }
+}
+
+static void infer_let(Node *node) {
+    assert(node->u.opr.nc == 2);
+    demote(node->u.opr.children[0], node->u.opr.children[1]);
+}
+
+static void infer_for(Node *node) {
+    int i;
+    for(i = 1; i < node->u.opr.nc; i++)
+        demote(node->u.opr.children[0], node->u.opr.children[i]);
+}
+
+static void infer_types(Node *node) {
+    do {
+        Demoted = 0;
+        visit(node, LET, infer_let);
+        visit(node, FOR, infer_for);
+    } while(Demoted);
+}
+
+/* Control flow analysis:
+The statements of the program's lines are flattened into the `Stmts`
+array so that ranges of statements can be treated as blocks.
+
+FOR/NEXT pairs that are properly nested and can't be entered other
+than through the FOR are emitted as C `for` loops.
+
+GOSUB targets that can only be entered through a GOSUB and that
+end in a RETURN without jumping out of it are emitted as C functions.
+
+Everything else goes through the `jump:switch(addr)` dispatcher. */
+typedef struct {
+    int src, dst; /* Indexes in Stmts[] */
+    Node *node;
+} Jump;
+
+static Node **Stmts;
+static int NStmts;
+static char *StmtFirst; /* Is the statement the first in its line? */
+static int *Match; /* Index of the NEXT of a structured FOR and vice versa, else -1 */
+static int *SubEnd; /* Index of the RETURN of a function starting here, else -1 */
+static int *InSub; /* Index of the function's first statement, else -1 */
+
+static Jump *Jumps;
+static int NJumps;
+
+/* Maps "lbl_%d" to the line's first statement in Stmts[] */
+static hash_table LineStart;
+
+static int CurStmt = -1; /* Top-level statement being visited/emitted */
+static int InFunction = 0;
+static int Library = 0;
+
+static int line_start(Node *dest) {
+    char name[20];
+    Node **stmt;
+    if(dest->type != nt_num)
+        return -1;
+    snprintf(name, sizeof name, "lbl_%d", (int)dest->u.num);
+    stmt = ht_get(LineStart, name);
+    return stmt ? stmt - Stmts : -1;
+}
+
+static int is_op(Node *node, int op) {
+    return node->type == nt_opr && node->u.opr.op == op;
+}
+
+static const char *loop_var(Node *node) {
+    return node->u.opr.children[0]->u.opr.children[0]->u.str;
+}
+
+static void count_stmts(Node *node) {
+    NStmts += node->u.opr.nc;
+}
+
+static void add_stmts(Node *node) {
+    int i;
+    for(i = 0; i < node->u.opr.nc; i++) {
+        if(!node->u.opr.children[i]) continue;
+        StmtFirst[NStmts] = (i == 0);
+        Stmts[NStmts++] = node->u.opr.children[i];
+    }
+}
+
+static void add_jump(Node *node) {
+    Jump *j = &Jumps[NJumps++];
+    j->src = CurStmt;
+    j->dst = line_start(node->u.opr.children[0]);
+    j->node = node;
+}
+
+static void count_jump(Node *node) {
+    NJumps++;
+}
+
+static void flatten(Node *prog) {
+    int i;
+    ht_init(LineStart);
+    NStmts = 0;
+    for(i = 0; i < prog->u.opr.nc; i++)
+        count_stmts(prog->u.opr.children[i]->u.opr.children[1]);
+    Stmts = malloc((NStmts + 1) * sizeof *Stmts);
+    StmtFirst = malloc(NStmts + 1);
+    Match = malloc((NStmts + 1) * sizeof *Match);
+    SubEnd = malloc((NStmts + 1) * sizeof *SubEnd);
+    InSub = malloc((NStmts + 1) * sizeof *InSub);
+    NStmts = 0;
+    for(i = 0; i < prog->u.opr.nc; i++) {
+        Node *line = prog->u.opr.children[i];
+        char name[20];
+        assert(line->u.opr.nc == 2 && line->u.opr.children[0]->type == nt_num);
+        snprintf(name, sizeof name, "lbl_%d", (int)line->u.opr.children[0]->u.num);
+        ht_put(LineStart, name, &Stmts[NStmts]);
+        add_stmts(line->u.opr.children[1]);
+    }
+    for(i = 0; i < NStmts; i++)
+        Match[i] = SubEnd[i] = InSub[i] = -1;
+
+    NJumps = 0;
+    for(i = 0; i < NStmts; i++) {
+        visit(Stmts[i], GOTO, count_jump);
+        visit(Stmts[i], GOSUB, count_jump);
+    }
+    Jumps = malloc((NJumps + 1) * sizeof *Jumps);
+    NJumps = 0;
+    for(CurStmt = 0; CurStmt < NStmts; CurStmt++) {
+        visit(Stmts[CurStmt], GOTO, add_jump);
+        visit(Stmts[CurStmt], GOSUB, add_jump);
+    }
+    CurStmt = -1;
+}
+
+/* FOR and NEXT statements nested in IF statements can't be structured */
+static hash_table NestedLoops;
+
+static void mark_nested_loop(Node *node) {
+    ht_put(NestedLoops, loop_var(node), node);
+}
+
+static void match_loops() {
+    int *stack = malloc((NStmts + 1) * sizeof *stack), sp = 0, i, j;
+
+    ht_init(NestedLoops);
+    for(i = 0; i < NStmts; i++) {
+        if(!is_op(Stmts[i], FOR) && !is_op(Stmts[i], NEXT)) {
+            visit(Stmts[i], FOR, mark_nested_loop);
+            visit(Stmts[i], NEXT, mark_nested_loop);
+        }
+    }
+
+    for(i = 0; i < NStmts; i++) {
+        if(is_op(Stmts[i], FOR)) {
+            stack[sp++] = i;
+        } else if(is_op(Stmts[i], NEXT)) {
+            if(!sp || strcmp(loop_var(Stmts[stack[sp-1]]), loop_var(Stmts[i]))) {
+                /* Badly nested loops; leave them all to the dispatcher */
+                for(j = 0; j < NStmts; j++)
+                    Match[j] = -1;
+                break;
+            }
+            sp--;
+            if(ht_get(NestedLoops, loop_var(Stmts[i])))
+                continue;
+            Match[stack[sp]] = i;
+            Match[i] = stack[sp];
+        }
+    }
+
+    /* A loop can't be structured if there are jumps into it */
+    for(i = 0; i < NStmts; i++) {
+        if(!is_op(Stmts[i], FOR) || Match[i] < 0)
+            continue;
+        for(j = 0; j < NJumps; j++) {
+            Jump *jp = &Jumps[j];
+            if(jp->dst > i && jp->dst <= Match[i] && (jp->src <= i || jp->src > Match[i])) {
+                Match[Match[i]] = -1;
+                Match[i] = -1;
+                break;
+            }
+        }
+    }
+
+    ht_destroy(NestedLoops, NULL);
+    free(stack);
+}
+
+/* Can the subroutine in the range [start, end] be a C function? */
+static int is_function(int start, int end) {
+    int i;
+    Node *prev;
+
+    /* It mustn't be possible to fall through into the subroutine */
+    if(start == 0)
+        return 0;
+    prev = Stmts[start - 1];
+    if(!is_op(prev, GOTO) && !is_op(prev, RETURN) && !is_op(prev, END) && !is_op(prev, STOP))
+        return 0;
+
+    for(i = 0; i < NJumps; i++) {
+        Jump *jp = &Jumps[i];
+        int inside = jp->src >= start && jp->src <= end;
+        if(is_op(jp->node, GOSUB)) {
+            if(jp->dst > start && jp->dst <= end)
+                return 0;
+            if(inside && (jp->dst < 0 || SubEnd[jp->dst] < 0))
+                return 0;
+        } else {
+            int into = jp->dst >= start && jp->dst <= end;
+            if(into != inside)
+                return 0;
+        }
+    }
+
+    /* All loops must be structured and contained in the function */
+    for(i = start; i <= end; i++) {
+        Node *stmt = Stmts[i];
+        if(is_op(stmt, FOR) || is_op(stmt, NEXT)) {
+            if(Match[i] < start || Match[i] > end)
+                return 0;
+        } else if(search_for(stmt, FOR) || search_for(stmt, NEXT))
+            return 0;
+    }
+    return 1;
+}
+
+static void find_functions() {
+    int i, changed;
+
+    /* Start by assuming every GOSUB target that ends in a
+    RETURN is a function, then reject them until nothing changes */
+    for(i = 0; i < NJumps; i++) {
+        int start = Jumps[i].dst, end;
+        if(!is_op(Jumps[i].node, GOSUB) || start < 0)
+            continue;
+        for(end = start; end < NStmts && !is_op(Stmts[end], RETURN); end++);
+        if(end < NStmts)
+            SubEnd[start] = end;
+    }
+    do {
+        changed = 0;
+        for(i = 0; i < NStmts; i++) {
+            if(SubEnd[i] >= 0 && !is_function(i, SubEnd[i])) {
+                SubEnd[i] = -1;
+                changed = 1;
+            }
+        }
+    } while(changed);
+
+    for(i = 0; i < NStmts; i++) {
+        int j;
+        if(SubEnd[i] < 0)
+            continue;
+        for(j = i; j <= SubEnd[i]; j++)
+            InSub[j] = i;
+    }
+}
+
+/* Does the code outside of functions need the `jump:switch(addr)`? */
+static int needs_dispatcher() {
+    int i;
+    for(i = 0; i < NStmts; i++) {
+        Node *stmt = Stmts[i];
+        if(InSub[i] >= 0)
+            continue;
+        if(is_op(stmt, FOR) || is_op(stmt, NEXT)) {
+            if(Match[i] < 0)
+                return 1;
+        } else if(search_for(stmt, FOR) || search_for(stmt, NEXT) || search_for(stmt, RETURN))
+            return 1;
+    }
+    for(i = 0; i < NJumps; i++) {
+        Jump *jp = &Jumps[i];
+        if(is_op(jp->node, GOSUB) && InSub[jp->src] < 0 && (jp->dst < 0 || SubEnd[jp->dst] < 0))
+            return 1;
+    }
+    return 0;
+}
+
+static void free_flow() {
+    ht_destroy(LineStart, NULL);
+    free(Stmts);
+    free(StmtFirst);
+    free(Match);
+    free(SubEnd);
+    free(InSub);
+    free(Jumps);
+}
+
+static int is_constant(Node *node) {
+    if(is_op(node, '-') || is_op(node, '+'))
+        return node->u.opr.nc == 1 && is_constant(node->u.opr.children[0]);
+    return node->type == nt_num;
+}
+
+static int is_structured(Node *node) {
+    return CurStmt >= 0 && Stmts[CurStmt] == node && Match[CurStmt] >= 0;
+}
+
+static int is_function_call(Node *node) {
+    int dst = line_start(node->u.opr.children[0]);
+    return dst >= 0 && SubEnd[dst] >= 0;
+}
+
 void outline(Node *node) {
 	if(node->line != NodeLine) {
 		fprintf(o, "#line %d \"%s\"\n  ", node->line, Filename);
 		NodeLine = node->line;
 	}
 }
+static void walk(Node *node);
+
+/* Emits the top-level statements from `from` to `to` */
+static void emit_stmts(int from, int to) {
+    int i;
+    for(i = from; i <= to; i++) {
+        Node *stmt = Stmts[i];
+        if(InSub[i] >= 0 && !InFunction) {
+            i = SubEnd[InSub[i]];
+            continue;
+        }
+        if(StmtFirst[i]) {
+            char name[20];
+            snprintf(name, sizeof name, "lbl_%d", stmt->basic_line);
+            if(ht_get(Destinations, name))
+                fprintf(o, "%s:\n", name);
+        }
+        outline(stmt);
+        CurStmt = i;
+        walk(stmt);
+        CurStmt = -1;
+        if(i == to || StmtFirst[i + 1])
+            fputs("\n", o);
+    }
+}
+
 static void walk(Node *node) {
     int i;
     Line = node->line;
     BasicLine = node->basic_line;
     switch(node->type) {
-        case nt_num: fprintf(o, "%g", node->u.num); break;
+        case nt_num:
+            if(num_is_int(node->u.num))
+                fprintf(o, "%ld", (long)node->u.num);
+            else
+                fprintf(o, "%.17g", node->u.num);
+            break;
         case nt_str: fprintf(o, "\"%s\"", node->u.str); break;
         case nt_id: fprintf(o, "%s", node->u.str); break;
         case nt_opr: {
@@ -66,18 +514,14 @@ static void walk(Node *node) {
                         walk(node->u.opr.children[i]);
                 } break;
                 case STMTS: {
-					outline(node);
-					if(node->u.opr.nc>1) {
-						fputs("{", o);
-						for(i = 0; i < node->u.opr.nc; i++) {
-							walk(node->u.opr.children[i]);
-						}
-						fputs("}\n", o);
-					} else {						
-						for(i = 0; i < node->u.opr.nc; i++)
+					/* Top-level statements are emitted by emit_stmts(),
+					so these are the statements of an IF */
+					fputs("{", o);
+					for(i = 0; i < node->u.opr.nc; i++) {
+						if(node->u.opr.children[i])
 							walk(node->u.opr.children[i]);
-						fputs("\n", o);
 					}
+					fputs("}", o);
                 } break;
                 case LINE: {
                     if(node->u.opr.nc == 2) {
@@ -116,12 +560,32 @@ static void walk(Node *node) {
                     walk(node->u.opr.children[1]);					
                 } break;
                 case FOR: {
-					fputs("{", o);
 					Node *loopVar = node->u.opr.children[0];
 					assert(loopVar->type == nt_opr && loopVar->u.opr.op == VARIABLE && loopVar->u.opr.nc == 1);
 					loopVar = loopVar->u.opr.children[0];					
                     assert(loopVar->type == nt_id);
                     char * looper = loopVar->u.str;
+                    if(is_structured(node)) {
+                        /* The body runs at least once, and the test happens in the NEXT */
+                        fprintf(o, "for(%s=", looper);
+                        walk(node->u.opr.children[1]);
+                        fprintf(o, ",loop_%s_to=", looper);
+                        walk(node->u.opr.children[2]);
+                        if(node->u.opr.nc > 3 && !is_constant(node->u.opr.children[3])) {
+                            fprintf(o, ",loop_%s_step=", looper);
+                            walk(node->u.opr.children[3]);
+                            fprintf(o, ";;%s+=loop_%s_step){", looper, looper);
+                        } else {
+                            fprintf(o, ";;%s+=", looper);
+                            if(node->u.opr.nc > 3)
+                                walk(node->u.opr.children[3]);
+                            else
+                                fputs("1", o);
+                            fputs("){", o);
+                        }
+                        break;
+                    }
+					fputs("{", o);
                     fprintf(o, "%s=", looper);
                     walk(node->u.opr.children[1]);
                     fputs(";", o);
@@ -144,6 +608,10 @@ static void walk(Node *node) {
                     char * looper = loopVar->u.str;
                     if(!ht_get(LoopVariables, looper))
                         error("NEXT %s does not have an associated FOR", looper);
+                    if(is_structured(node)) {
+                        fprintf(o, "if(!(%s<loop_%s_to))break;}", looper, looper);
+                        break;
+                    }
                     fprintf(o, "if(%s<loop_%s_to){%s+=loop_%s_step;addr=loop_%s;goto jump;}", looper, looper, looper, looper, looper);
                 } break;
                 case GOTO: {
@@ -153,7 +621,13 @@ static void walk(Node *node) {
                     fputs(";", o);
                 } break;
                 case GOSUB: {
-					fprintf(o, "{ret=%d;", NextDest);
+					if(is_function_call(node)) {
+						fputs("sub_", o);
+						walk(node->u.opr.children[0]);
+						fputs("();", o);
+						break;
+					}
+					fprintf(o, "{assert(ret<RET_SIZE);Ret[ret++]=%d;", NextDest);
                     assert(node->u.opr.nc == 1);
                     fputs("goto lbl_", o);
                     walk(node->u.opr.children[0]);
@@ -161,10 +635,18 @@ static void walk(Node *node) {
                     fprintf(o, " case %d:\n", NextDest++);
                 } break;
                 case RETURN: {
-					fputs("{addr=ret;goto jump;}",o);
+					if(InFunction)
+						fputs("return;",o);
+					else
+						fputs("{assert(ret>0);addr=Ret[--ret];goto jump;}",o);
                 } break;
                 case END: case STOP: {
-					fputs("return;",o);
+					/* A library must not exit its host, so it
+					unwinds to bas_run() instead */
+					if(!InFunction)
+						fputs("return;",o);
+					else
+						fputs(Library ? "longjmp(End,1);" : "exit(0);",o);
                 } break;
                 case PRINT: {
 					fputs("{",o);
@@ -175,16 +657,16 @@ static void walk(Node *node) {
                         if(c->type == nt_num) {
                             fprintf(o, "bprint(\"%%g\",(num_type)%g);", c->u.num);
                         } else if(c->type == nt_id){
-                            fprintf(o, "bprint(\"%%g\",%s);", c->u.str);
+                            fprintf(o, "bprint(\"%%g\",(num_type)%s);", c->u.str);
                         } else if(c->type == nt_str){
                             fprintf(o, "fputs(\"%s\",stdout);Col+=%d;", c->u.str, strlen(c->u.str));
                         } else if(c->type == nt_opr) {
 							if(c->u.opr.op == ',') {
 								nl = 0;
-								printf("pad(15);");
+								fputs("pad(15);", o);
 							} else if(c->u.opr.op == ';') {
 								nl = 0;
-								printf("pad(3);");
+								fputs("pad(3);", o);
 							} else {
 								fputs("bprint(\"%g\", (num_type)", o);
 								walk(c);
@@ -216,17 +698,36 @@ static void walk(Node *node) {
                     int ndims = node->u.opr.nc - 1;
 					Node *name = node->u.opr.children[0];
 					char *nm = name->u.str;
-					fprintf(o, "*arr(%s, %s_dims, %s_size, %d, ", nm, nm, nm, ndims);
+					fprintf(o, "%s[arr(%s_dims, %s_size, %d, ", nm, nm, nm, ndims);
                     for(i = 1; i < node->u.opr.nc; i++) {
 						fputs("(int)", o);
 						walk(node->u.opr.children[i]);
 						if(i < node->u.opr.nc-1) fputs(",", o);
 					}
-					fputs(")", o);
+					fputs(")]", o);
                 } break;
                 case DIM: break;
                 case DATA: break;
                 case DEF: break;
+                case '%': {
+                    /* C's % operator only works on integers */
+                    int real = !is_int_expr(node);
+                    assert(node->u.opr.nc == 2);
+                    fputs(real ? "fmod(" : "(", o);
+                    walk(node->u.opr.children[0]);
+                    fputs(real ? "," : "%", o);
+                    walk(node->u.opr.children[1]);
+                    fputs(")", o);
+                } break;
+                case '/': {
+                    /* BASIC division is never truncated */
+                    assert(node->u.opr.nc == 2);
+                    fputs("((num_type)", o);
+                    walk(node->u.opr.children[0]);
+                    fputs("/", o);
+                    walk(node->u.opr.children[1]);
+                    fputs(")", o);
+                } break;
                 case '+':case '-':
                     if(node->u.opr.nc == 1) {
                         /* unary */
@@ -234,7 +735,18 @@ static void walk(Node *node) {
                         walk(node->u.opr.children[0]);
                         break;
                     } /* else drop through... */
-                case '*':case '/':case '%':case '>':case '<': {
+                case '*': {
+                    /* Integer arithmetic is only used where it can't
+                    overflow, and is done in int_type rather than in the
+                    `int` of the literals. Everything else is a double */
+                    assert(node->u.opr.nc == 2);
+                    fputs(is_int_expr(node) ? "((int_type)" : "((num_type)", o);
+                    walk(node->u.opr.children[0]);
+                    fprintf(o, "%c", node->u.opr.op);
+                    walk(node->u.opr.children[1]);
+                    fputs(")", o);
+                } break;
+                case '>':case '<': {
                     assert(node->u.opr.nc == 2);
                     fputs("(", o);
                     walk(node->u.opr.children[0]);
@@ -271,14 +783,14 @@ void evaluate_dims(Node *node) {
 		Node *var = node->u.opr.children[i];
 		fprintf(o, "#line %d \"%s\"\n", var->line, Filename);
 		if(var->type == nt_id) {
-			fprintf(o, "static num_type %s;\n", var->u.str);
+			fprintf(o, "static %s %s;\n", var_type(var->u.str), var->u.str);
 			ht_put(DimmedVariables, var->u.str, node);
 		} else {
 			assert(var->type == nt_opr && var->u.opr.op == ARR);
 			Node *name = var->u.opr.children[0];
 			ht_put(DimmedVariables, name->u.str, node);
 			
-			fprintf(o, "static num_type %s[", name->u.str);
+			fprintf(o, "static %s %s[", var_type(name->u.str), name->u.str);
 			for(j = 1; j < var->u.opr.nc; j++) {
 				Node *child = var->u.opr.children[j];				
 				int size = (int)child->u.num;
@@ -303,14 +815,14 @@ void find_undimmed(Node *node) {
 	if(node->u.opr.op == VARIABLE && var->type == nt_id) {
 		if(!ht_get(DimmedVariables, var->u.str)) {
 			fprintf(o, "#line %d \"%s\"\n", var->line, Filename);
-			fprintf(o, "static num_type %s;/*Undimmed*/\n", var->u.str);
+			fprintf(o, "static %s %s;/*Undimmed*/\n", var_type(var->u.str), var->u.str);
 			ht_put(DimmedVariables, var->u.str, var);
 		}
 	} else if(node->u.opr.op == ARR && var->type == nt_id) {
 		if(!ht_get(DimmedVariables, var->u.str)) {
 			char *name = var->u.str;
 			fprintf(o, "#line %d \"%s\"\n", var->line, Filename);
-			fprintf(o, "static num_type %s[11];/*Undimmed*/\n", name);
+			fprintf(o, "static %s %s[11];/*Undimmed*/\n", var_type(name), name);
 			fprintf(o, "static int %s_dims=1, %s_size[]={11,};\n", name, name);
 			ht_put(DimmedVariables, var->u.str, var);
 		}
@@ -334,7 +846,9 @@ void evaluate_def(Node *node) {
 	fprintf(o, "(num_type ");
 	walk(node->u.opr.children[1]);
 	fputs("){return ", o);
+	FnParam = node->u.opr.children[1]->u.str;
 	walk(node->u.opr.children[2]);
+	FnParam = NULL;
 	fputs(";}\n", o);
 }
 	
@@ -349,6 +863,8 @@ void mark_loop(Node *node) {
 void mark_dest(Node *node) {
     assert(node->type == nt_opr && node->u.opr.nc == 1);
     Node *child = node->u.opr.children[0];
+    if(node->u.opr.op == GOSUB && is_function_call(node))
+        return;
     if(child->type == nt_num) {
         char name[20];
         snprintf(name, sizeof name, "lbl_%d", (int)child->u.num);
@@ -359,21 +875,26 @@ void mark_dest(Node *node) {
         error("unexpected destination type %d on %s node", child->type, nodename(node->u.opr.op));
 }
 
-void compile(Node *node) {
+void compile(Node *node, FILE *f, int library) {
     const char *k;
-	int has_print = 0;
+	int has_print = 0, i;
 
-    o = stdout;
+    o = f;
+    Library = library;
 
     fputs("#include <stdio.h>\n", o);
     fputs("#include <stdlib.h>\n", o);
     fputs("#include <math.h>\n", o);
     fputs("#include <string.h>\n", o);
+    fputs("#include <stdint.h>\n", o);
     fputs("#include <stdarg.h>\n", o);
     fputs("#include <time.h>\n", o);
     fputs("#include <assert.h>\n", o);
+    if(library)
+        fputs("#include <setjmp.h>\n", o);
 	
     fputs("typedef double num_type;\n", o);
+    fputs("typedef int64_t int_type;\n", o);
 
     fputs("#define SIN(a) sin(a)\n", o);
     fputs("#define COS(a) cos(a)\n", o);
@@ -385,7 +906,8 @@ void compile(Node *node) {
     fputs("#define SQR(a) sqrt(a)\n", o);
     fputs("#define RND(a) (rand()%((int)(a)))\n", o);
     fputs("#define INT(a) ((int)(a))\n", o);
-    fputs("#define READ(a) assert(read < DATA_SIZE); a = Data[read++]\n", o);
+    fputs("#define READ(a) assert(Read < DATA_SIZE); a = Data[Read++]\n", o);
+    fputs("#define RET_SIZE 256\n", o);
 
 	if(search_for(node, PRINT)) {
 	  has_print=1;
@@ -409,7 +931,7 @@ void compile(Node *node) {
 	  fputs("}\n",o);
 	}
 	
-	fputs("static num_type *arr(num_type a[], int dims, int sizes[], int n, ...) {", o);
+	fputs("static int arr(int dims, int sizes[], int n, ...) {", o);
 	fputs(" int idx=0, i;", o);
 	fputs(" va_list ap;", o);
 	fputs(" va_start(ap, n);", o);
@@ -423,9 +945,12 @@ void compile(Node *node) {
 	fputs(" }", o);
 	fputs(" va_end(ap);", o);
 	//fputs(" printf(\"arr(%p, %d, %d): %p\\n\", a, n, idx, &a[idx]);", o);
-	fputs(" return a+idx;", o);
+	fputs(" return idx;", o);
 	fputs("}\n", o);		
 	
+    ht_init(DoubleVariables);
+    infer_types(node);
+
     ht_init(DimmedVariables);
 	visit(node, DIM, evaluate_dims);
 	
@@ -436,43 +961,79 @@ void compile(Node *node) {
     ht_init(LoopVariables);
     visit(node, FOR, mark_loop);
 
+    flatten(node);
+    match_loops();
+    find_functions();
+
     ht_init(Destinations);
     visit(node, GOTO, mark_dest);
     visit(node, GOSUB, mark_dest);
 	
     for(k = ht_next(LoopVariables, NULL); k; k = ht_next(LoopVariables, k)) {
-        fprintf(o, "int loop_%s; num_type loop_%s_to, loop_%s_step;\n", k, k, k);
+        fprintf(o, "int loop_%s; %s loop_%s_to, loop_%s_step;\n", k, var_type(k), k, k);
     }
 	
 	DataCount = 0;
-	fputs("static num_type Data[] = {", o);
+	fputs("static int_type Data[] = {", o);
 	visit(node, DATA, evaluate_data);
     fputs("};\n", o);
     fprintf(o, "#define DATA_SIZE %d\n", DataCount);
+    if(library)
+        fputs("static jmp_buf End;\n", o);
+    fputs("static int Read = 0;\n", o);
+    fputs("static int Ret[RET_SIZE];\n", o);
 	
 	visit(node, DEF, evaluate_def);
+
+    for(i = 0; i < NStmts; i++) {
+        if(SubEnd[i] >= 0)
+            fprintf(o, "static void sub_%d(void);\n", Stmts[i]->basic_line);
+    }
+    InFunction = 1;
+    for(i = 0; i < NStmts; i++) {
+        if(SubEnd[i] < 0)
+            continue;
+        fprintf(o, "static void sub_%d(void){\n", Stmts[i]->basic_line);
+        emit_stmts(i, SubEnd[i]);
+        fputs("}\n", o);
+    }
+    InFunction = 0;
     
     fputs("\n", o);
-    fputs("void run(){\n", o);
-    fputs(" int addr=0,ret=0,read=0;\n", o);
-    fputs(" (void)addr;(void)ret;(void)read;(void)Data;\n", o);
+    /* A library exports bas_run() instead of having a main() */
+    fputs(library ? "void bas_run(){\n" : "static void run(){\n", o);
+    fputs(" int addr=0,ret=0;\n", o);
+    fputs(" (void)addr;(void)ret;(void)Read;(void)Ret;(void)Data;\n", o);
     if(has_print) fputs(" (void)pad;(void)bprint;\n", o);
+    if(library) {
+        /* A host may call bas_run() more than once,
+        so each run starts from a clean slate */
+        for(k = ht_next(DimmedVariables, NULL); k; k = ht_next(DimmedVariables, k))
+            fprintf(o, " memset(&%s,0,sizeof %s);\n", k, k);
+        fputs(" memset(Ret,0,sizeof Ret);Read=0;", o);
+        if(has_print) fputs("Col=0;", o);
+        fputs("\n if(setjmp(End))return;\n", o);
+    }
 	
-    if(search_for(node, RETURN) || search_for(node, FOR)) {
-        /* Don't generate the `jump:switch()` if the program does
-        not contain any `FOR` or `RETURN` statements else `gcc -Wall` will
+    if(needs_dispatcher()) {
+        /* Don't generate the `jump:switch()` if all the `FOR` loops and
+        `GOSUB`s could be structured, else `gcc -Wall` will
         complain about label jump being defined but not used  */
         fputs(" jump:switch(addr){\n", o);
         fputs(" case 0:\n", o);
-        walk(node);
+        emit_stmts(0, NStmts - 1);
         fputs(" }\n", o);
     } else {
-        walk(node);
+        emit_stmts(0, NStmts - 1);
     }
     fputs("}\n", o);
-    fputs("int main(int argc, char *argv[]){srand(time(NULL));run();return 0;}\n", o);
-		
+    if(!library) {
+        fputs("int main(int argc, char *argv[]){srand(time(NULL));run();return 0;}\n", o);
+    }
+
+	ht_destroy(DoubleVariables, NULL);
 	ht_destroy(DimmedVariables, NULL);
 	ht_destroy(LoopVariables, NULL);
 	ht_destroy(Destinations, NULL);
+	free_flow();
 }
@@ -4,88 +4,125 @@
 
 #include "hash.h"
 
-void ht_init(hash_table tbl) {
-    int i;
-    for(i = 0; i < HASH_SIZE; i++)
-        tbl[i] = NULL;
+#define MIN_CAP 16 /* Must be a power of 2 */
+
+#define POOL_BLOCK 4096
+
+static unsigned int hash(const char *s) {
+    unsigned int h = 2166136261u;
+    for(;s[0];s++)
+        h = (h ^ (unsigned char)s[0]) * 16777619u;
+    return h;
 }
 
-static void free_element(hash_element* v, void (*cfun)(void *)) {
-    if(!v) return;
-    free_element(v->next, cfun);
-    if(cfun) cfun(v->data);
-    free(v->name);
-    free(v);
+void ht_init(hash_table tbl) {
+    tbl->slots = NULL;
+    tbl->cap = 0;
+    tbl->count = 0;
 }
 
 void ht_destroy(hash_table tbl, void (*cfun)(void *)) {
-    int i;
-    for(i = 0; i < HASH_SIZE; i++)
-        free_element(tbl[i], cfun);
+    unsigned int i;
+    if(cfun) {
+        for(i = 0; i < tbl->cap; i++)
+            if(tbl->slots[i].name)
+                cfun(tbl->slots[i].data);
+    }
+    free(tbl->slots);
+    ht_init(tbl);
 }
 
-static unsigned int hash(const char *s) {
-    unsigned int i = 0x5555;
-    for(;s[0];s++)
-        i = i << 3 ^ (s[0] | (s[0] << 8));
-    return i % HASH_SIZE;
+/* Finds the slot of `name`, or the empty slot where it should go */
+static hash_element *search(hash_table tbl, const char *name, unsigned int h) {
+    unsigned int mask = tbl->cap - 1, i;
+    for(i = h & mask;; i = (i + 1) & mask) {
+        hash_element *v = &tbl->slots[i];
+        if(!v->name || (v->hash == h && (v->name == name || !strcmp(v->name, name))))
+            return v;
+    }
 }
 
-static hash_element *search(hash_table tbl, const char *name, int *bucket) {
-    hash_element* v;
-    unsigned int h = hash(name);
-    if(tbl[h]) {
-        for(v = tbl[h]; v; v = v->next)
-            if(!strcmp(v->name, name)) {
-                if(bucket) *bucket = h;
-                return v;
-            }
-    }
-    return NULL;
+static void grow(hash_table tbl) {
+    hash_element *old = tbl->slots;
+    unsigned int oldcap = tbl->cap, i;
+    tbl->cap = oldcap ? oldcap * 2 : MIN_CAP;
+    tbl->slots = calloc(tbl->cap, sizeof *tbl->slots);
+    assert(tbl->slots);
+    for(i = 0; i < oldcap; i++)
+        if(old[i].name)
+            *search(tbl, old[i].name, old[i].hash) = old[i];
+    free(old);
 }
 
 void *ht_get(hash_table tbl, const char *name) {
-    struct hash_element* v = search(tbl, name, NULL);
-    if(v)
-        return v->data;
-    return NULL;
+    hash_element *v;
+    if(!tbl->count)
+        return NULL;
+    v = search(tbl, name, hash(name));
+    return v->name ? v->data : NULL;
 }
 
-void ht_put(hash_table tbl, const char *name, void *val) {
-    hash_element* v = search(tbl, name, NULL);
-    if(v) /* duplicates not allowed */
+static void put(hash_table tbl, const char *name, unsigned int h, void *val) {
+    hash_element *v;
+    if(tbl->count + 1 > tbl->cap / 4 * 3)
+        grow(tbl);
+    v = search(tbl, name, h);
+    if(v->name) /* duplicates not allowed */
         return;
-    v = malloc(sizeof *v);
-    unsigned int h = hash(name);
-    v->name = strdup(name);
+    v->name = name;
+    v->hash = h;
     v->data = val;
-    v->next = tbl[h];
-    tbl[h] = v;
+    tbl->count++;
+}
+
+void ht_put(hash_table tbl, const char *name, void *val) {
+    put(tbl, ht_intern(name), hash(name), val);
 }
 
 const char *ht_next(hash_table tbl, const char *key) {
-    int f;
-    hash_element *i;
+    unsigned int f = 0;
 
-    if (key == NULL) {
-        for (f = 0; f < HASH_SIZE && !tbl[f]; f++);
-        if (f >= HASH_SIZE)
+    if (key != NULL) {
+        hash_element *v;
+        if (!tbl->count)
             return NULL;
-        assert (tbl[f]);
-        return tbl[f]->name;
-    }
-    i = search(tbl, key, &f);
-    if (!i)
-        return NULL;
-    if (i->next)
-        return i->next->name;
-    else {
-        f++;
-        while (f < HASH_SIZE && !tbl[f])
-            f++;
-        if (f >= HASH_SIZE)
+        v = search(tbl, key, hash(key));
+        if (!v->name)
             return NULL;
-        assert (tbl[f]);
-        return tbl[f]->name;
+        f = v - tbl->slots + 1;
+    }
+    for (; f < tbl->cap; f++)
+        if (tbl->slots[f].name)
+            return tbl->slots[f].name;
+    return NULL;
+}
+
+/* The interned strings live for as long as the program */
+static hash_table Strings;
+
+static char *Pool;
+static size_t PoolLeft;
+
+const char *ht_intern(const char *name) {
+    unsigned int h = hash(name);
+    size_t len;
+    char *s;
+    if(Strings->count) {
+        hash_element *v = search(Strings, name, h);
+        if(v->name)
+            return v->name;
+    }
+    len = strlen(name) + 1;
+    if(len > PoolLeft) {
+        size_t size = len > POOL_BLOCK ? len : POOL_BLOCK;
+        Pool = malloc(size);
+        assert(Pool);
+        PoolLeft = size;
     }
+    s = Pool;
+    memcpy(s, name, len);
+    Pool += len;
+    PoolLeft -= len;
+    put(Strings, s, h, s);
+    return s;
 }
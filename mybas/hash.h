@@ -1,16 +1,22 @@
-#define HASH_SIZE 31 // Must be prime
-
+/* Open addressing hash table that grows as needed.
+Keys are interned, so they are stored once no matter how many
+tables they're in. */
 typedef struct hash_element {
-	char *name;
+	const char *name; /* Interned; NULL if the slot is empty */
+	unsigned int hash;
 	void *data;
-	struct hash_element *next;
 } hash_element;
 
-typedef hash_element *hash_table[HASH_SIZE];
+typedef struct hash_table_s {
+	hash_element *slots;
+	unsigned int cap, count;
+} hash_table[1];
 
 void ht_init(hash_table tbl);
 void ht_destroy(hash_table tbl, void (*cfun)(void *));
 void *ht_get(hash_table tbl, const char *name);
 void ht_put(hash_table tbl, const char *name, void *val);
 
-const char *ht_next(hash_table tbl, const char *key);
\ No newline at end of file
+const char *ht_next(hash_table tbl, const char *key);
+
+const char *ht_intern(const char *name);
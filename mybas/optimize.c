@@ -0,0 +1,371 @@
+/*
+Optimisation passes that rewrite the AST between parsing and compiling:
+
+- `DEF FN` functions are inlined at their call sites.
+- Constant expressions are folded.
+- Statements that can't be reached are removed.
+- Unused variables are removed from `DIM` statements.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "bas.h"
+#include "ast.h"
+#include "hash.h"
+
+static int is_op(Node *node, int op) {
+    return node && node->type == nt_opr && node->u.opr.op == op;
+}
+
+static void remove_child(Node *node, int i) {
+    memmove(&node->u.opr.children[i], &node->u.opr.children[i + 1],
+        (node->u.opr.nc - i - 1) * sizeof *node->u.opr.children);
+    node->u.opr.nc--;
+}
+
+/* Inlining DEF FN */
+
+static hash_table Functions;
+
+static void mark_def(Node *node) {
+    ht_put(Functions, node->u.opr.children[0]->u.str, node);
+}
+
+static int count_uses(Node *node, const char *param) {
+    int i, n = 0;
+    if(!node || node->type != nt_opr)
+        return 0;
+    if(is_op(node, VARIABLE) && !strcmp(node->u.opr.children[0]->u.str, param))
+        return 1;
+    for(i = 0; i < node->u.opr.nc; i++)
+        n += count_uses(node->u.opr.children[i], param);
+    return n;
+}
+
+/* Does evaluating the expression do more than compute a value?
+Calls to functions that weren't inlined might call RND() */
+static int has_side_effects(Node *node) {
+    int i;
+    if(!node || node->type != nt_opr)
+        return 0;
+    if(is_op(node, FUN)) {
+        const char *name = node->u.opr.children[0]->u.str;
+        if(!strcmp(name, "RND") || !strncmp(name, "FN", 2))
+            return 1;
+    }
+    for(i = 0; i < node->u.opr.nc; i++)
+        if(has_side_effects(node->u.opr.children[i]))
+            return 1;
+    return 0;
+}
+
+static Node *copy_tree(Node *node) {
+    Node *copy;
+    int i;
+    switch(node->type) {
+        case nt_num: copy = node_number(node->u.num); break;
+        case nt_str: copy = node_string(node->u.str); break;
+        case nt_id: copy = node_id(node->u.str); break;
+        default:
+            copy = node_operator(node->u.opr.op, 0);
+            for(i = 0; i < node->u.opr.nc; i++)
+                node_add_child(copy, copy_tree(node->u.opr.children[i]));
+            break;
+    }
+    copy->line = node->line;
+    copy->basic_line = node->basic_line;
+    return copy;
+}
+
+/* Copies the body of a function, replacing its parameter with `arg`.
+Each use gets its own copy of `arg` so that the result stays a tree */
+static Node *copy_body(Node *node, const char *param, Node *arg, Node *call) {
+    Node *copy;
+    int i;
+    switch(node->type) {
+        case nt_num: copy = node_number(node->u.num); break;
+        case nt_str: copy = node_string(node->u.str); break;
+        case nt_id: copy = node_id(node->u.str); break;
+        default:
+            if(is_op(node, VARIABLE) && !strcmp(node->u.opr.children[0]->u.str, param))
+                return copy_tree(arg);
+            copy = node_operator(node->u.opr.op, 0);
+            for(i = 0; i < node->u.opr.nc; i++)
+                node_add_child(copy, copy_body(node->u.opr.children[i], param, arg, call));
+            break;
+    }
+    copy->line = call->line;
+    copy->basic_line = call->basic_line;
+    return copy;
+}
+
+static Node *inline_calls(Node *node, int depth) {
+    int i;
+    if(!node || node->type != nt_opr)
+        return node;
+    for(i = 0; i < node->u.opr.nc; i++)
+        node->u.opr.children[i] = inline_calls(node->u.opr.children[i], depth);
+    if(is_op(node, FUN) && depth < 8) {
+        Node *def = ht_get(Functions, node->u.opr.children[0]->u.str), *arg = node->u.opr.children[1];
+        if(def) {
+            const char *param = def->u.opr.children[1]->u.str;
+            int uses = count_uses(def->u.opr.children[2], param);
+            /* Only inline if the argument is still evaluated exactly
+            once, or evaluating it more or less often doesn't matter */
+            if(uses == 1 || (!has_side_effects(arg)
+                    && (uses == 0 || arg->type == nt_num || is_op(arg, VARIABLE))))
+                return inline_calls(copy_body(def->u.opr.children[2], param, arg, node), depth + 1);
+        }
+    }
+    return node;
+}
+
+static void inline_functions(Node *prog) {
+    int i;
+    ht_init(Functions);
+    /* DEFs are only found at the top level of lines */
+    for(i = 0; i < prog->u.opr.nc; i++) {
+        Node *stmts = prog->u.opr.children[i]->u.opr.children[1];
+        int j;
+        for(j = 0; j < stmts->u.opr.nc; j++)
+            if(is_op(stmts->u.opr.children[j], DEF))
+                mark_def(stmts->u.opr.children[j]);
+    }
+    if(Functions->count) {
+        for(i = 0; i < prog->u.opr.nc; i++) {
+            Node *stmts = prog->u.opr.children[i]->u.opr.children[1];
+            int j;
+            for(j = 0; j < stmts->u.opr.nc; j++)
+                if(!is_op(stmts->u.opr.children[j], DEF))
+                    stmts->u.opr.children[j] = inline_calls(stmts->u.opr.children[j], 0);
+        }
+    }
+    ht_destroy(Functions, NULL);
+}
+
+/* Constant folding */
+
+/* Integral results are only folded if they stay in the range of the
+integers that the type inference in compile.c would give them */
+static int small_int(double num) {
+    return num > -2147483648.0 && num < 2147483648.0 && num == (long)num;
+}
+
+static Node *fold_constants(Node *node) {
+    int i;
+    double a, b, r;
+    if(!node || node->type != nt_opr)
+        return node;
+    for(i = 0; i < node->u.opr.nc; i++)
+        node->u.opr.children[i] = fold_constants(node->u.opr.children[i]);
+
+    if(node->u.opr.nc == 1 && node->u.opr.children[0]->type == nt_num) {
+        a = node->u.opr.children[0]->u.num;
+        switch(node->u.opr.op) {
+            case '-': r = -a; break;
+            case '+': r = a; break;
+            default: return node;
+        }
+    } else if(is_op(node, FUN) && node->u.opr.children[1]->type == nt_num) {
+        const char *name = node->u.opr.children[0]->u.str;
+        a = node->u.opr.children[1]->u.num;
+        /* Casting a double that doesn't fit in a long is undefined */
+        if(!strcmp(name, "INT") && a > -2147483648.0 && a < 2147483648.0)
+            r = (long)a;
+        else if(!strcmp(name, "ABS"))
+            r = a < 0 ? -a : a;
+        else
+            return node;
+    } else if(node->u.opr.nc == 2 && node->u.opr.children[0]->type == nt_num && node->u.opr.children[1]->type == nt_num) {
+        int ints;
+        a = node->u.opr.children[0]->u.num;
+        b = node->u.opr.children[1]->u.num;
+        ints = small_int(a) && small_int(b);
+        switch(node->u.opr.op) {
+            case '+': r = a + b; break;
+            case '-': r = a - b; break;
+            case '*': r = a * b; break;
+            case '/':
+                if(b == 0) return node;
+                r = a / b;
+                break;
+            case '%':
+                if(!ints || b == 0) return node;
+                r = (long)a % (long)b;
+                break;
+            case '^':
+                /* Only small integral powers are folded exactly */
+                if(!ints || b < 0 || b > 62) return node;
+                for(r = 1; b > 0; b--) {
+                    r *= a;
+                    if(!small_int(r)) return node;
+                }
+                break;
+            case '<': r = a < b; break;
+            case '>': r = a > b; break;
+            case LTE: r = a <= b; break;
+            case GTE: r = a >= b; break;
+            case NEQ: r = a != b; break;
+            case EQ: r = a == b; break;
+            default: return node;
+        }
+        if(ints && !small_int(r) && node->u.opr.op != '/')
+            return node;
+    } else
+        return node;
+
+    {
+        Node *num = node_number(r);
+        num->line = node->line;
+        num->basic_line = node->basic_line;
+        return num;
+    }
+}
+
+/* Dead code elimination */
+
+typedef struct {
+    Node *line, *stmts;
+    int index; /* of the statement in stmts */
+} Stmt;
+
+static Stmt *Stmts;
+static int NStmts;
+static char *Reachable;
+static int *Work, NWork;
+static hash_table LineStart;
+
+static void reach(int i) {
+    if(i >= 0 && i < NStmts && !Reachable[i]) {
+        Reachable[i] = 1;
+        Work[NWork++] = i;
+    }
+}
+
+static void reach_dest(Node *node) {
+    char name[20];
+    Stmt *stmt;
+    if(node->type != nt_opr || node->u.opr.children[0]->type != nt_num)
+        return;
+    snprintf(name, sizeof name, "%d", (int)node->u.opr.children[0]->u.num);
+    if((stmt = ht_get(LineStart, name)))
+        reach(stmt - Stmts);
+}
+
+static void find_dests(Node *node) {
+    int i;
+    if(!node || node->type != nt_opr)
+        return;
+    if(is_op(node, GOTO) || is_op(node, GOSUB))
+        reach_dest(node);
+    for(i = 0; i < node->u.opr.nc; i++)
+        find_dests(node->u.opr.children[i]);
+}
+
+static Node *stmt_node(int i) {
+    return Stmts[i].stmts->u.opr.children[Stmts[i].index];
+}
+
+static void remove_dead_code(Node *prog) {
+    int i, j;
+
+    NStmts = 0;
+    for(i = 0; i < prog->u.opr.nc; i++)
+        NStmts += prog->u.opr.children[i]->u.opr.children[1]->u.opr.nc;
+    Stmts = malloc((NStmts + 1) * sizeof *Stmts);
+    Reachable = calloc(NStmts + 1, 1);
+    Work = malloc((NStmts + 1) * sizeof *Work);
+    ht_init(LineStart);
+    NStmts = 0;
+    for(i = 0; i < prog->u.opr.nc; i++) {
+        Node *line = prog->u.opr.children[i], *stmts = line->u.opr.children[1];
+        char name[20];
+        snprintf(name, sizeof name, "%d", (int)line->u.opr.children[0]->u.num);
+        ht_put(LineStart, name, &Stmts[NStmts]);
+        for(j = 0; j < stmts->u.opr.nc; j++) {
+            Stmts[NStmts].line = line;
+            Stmts[NStmts].stmts = stmts;
+            Stmts[NStmts].index = j;
+            NStmts++;
+        }
+    }
+
+    NWork = 0;
+    reach(0);
+    while(NWork > 0) {
+        Node *stmt;
+        i = Work[--NWork];
+        stmt = stmt_node(i);
+        find_dests(stmt);
+        if(!is_op(stmt, GOTO) && !is_op(stmt, RETURN) && !is_op(stmt, END) && !is_op(stmt, STOP))
+            reach(i + 1);
+    }
+
+    /* DATA, DEF and DIM are declarations, and a FOR must stay
+    for the sake of its NEXT, so they're kept even if unreachable */
+    for(i = NStmts - 1; i >= 0; i--) {
+        Node *stmt = stmt_node(i);
+        if(Reachable[i] || is_op(stmt, DATA) || is_op(stmt, DEF) || is_op(stmt, DIM) || is_op(stmt, FOR))
+            continue;
+        remove_child(Stmts[i].stmts, Stmts[i].index);
+    }
+    for(i = prog->u.opr.nc - 1; i >= 0; i--) {
+        if(!prog->u.opr.children[i]->u.opr.children[1]->u.opr.nc)
+            remove_child(prog, i);
+    }
+
+    ht_destroy(LineStart, NULL);
+    free(Stmts);
+    free(Reachable);
+    free(Work);
+}
+
+/* Unused DIMs */
+
+static hash_table UsedVariables;
+
+static void find_uses(Node *node) {
+    int i;
+    if(!node || node->type != nt_opr)
+        return;
+    if(is_op(node, DIM))
+        return;
+    if(is_op(node, VARIABLE) || is_op(node, ARR))
+        ht_put(UsedVariables, node->u.opr.children[0]->u.str, node);
+    for(i = 0; i < node->u.opr.nc; i++)
+        find_uses(node->u.opr.children[i]);
+}
+
+static void remove_unused(Node *node) {
+    int i;
+    if(!node || node->type != nt_opr)
+        return;
+    if(is_op(node, DIM)) {
+        for(i = node->u.opr.nc - 1; i >= 0; i--) {
+            Node *var = node->u.opr.children[i];
+            const char *name = var->type == nt_id ? var->u.str : var->u.opr.children[0]->u.str;
+            if(!ht_get(UsedVariables, name))
+                remove_child(node, i);
+        }
+        return;
+    }
+    for(i = 0; i < node->u.opr.nc; i++)
+        remove_unused(node->u.opr.children[i]);
+}
+
+static void remove_unused_dims(Node *prog) {
+    ht_init(UsedVariables);
+    find_uses(prog);
+    remove_unused(prog);
+    ht_destroy(UsedVariables, NULL);
+}
+
+void optimize(Node *prog) {
+    assert(is_op(prog, PROG));
+    inline_functions(prog);
+    fold_constants(prog);
+    remove_dead_code(prog);
+    remove_unused_dims(prog);
+}
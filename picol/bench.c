@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Count the allocations made by the interpreter */
+static unsigned long allocs;
+
+static void *countMalloc(size_t n) {
+    allocs++;
+    return malloc(n);
+}
+
+static void *countRealloc(void *p, size_t n) {
+    allocs++;
+    return realloc(p,n);
+}
+
+#define PICOL_MALLOC(n) countMalloc(n)
+#define PICOL_REALLOC(p,n) countRealloc(p,n)
+#define PICOL_FREE(p) free(p)
+
+#define PICOL_IMPLEMENTATION
+#include "picol.h"
+
+#define HOST_COMMANDS 200
+
+static int picolCommandHost(struct picolInterp *i, int argc, char **argv, void *pd) {
+    (void)pd;
+    if (argc != 2) return picolArityErr(i,argv[0]);
+    picolSetResult(i,argv[1]);
+    return PICOL_OK;
+}
+
+static void registerHostCommands(struct picolInterp *i) {
+    char name[32];
+    int j;
+    for (j = 0; j < HOST_COMMANDS; j++) {
+        sprintf(name,"host%d",j);
+        picolRegisterCommand(i,name,picolCommandHost,NULL);
+    }
+}
+
+struct workload {
+    const char *name;
+    const char *setup; /* Evaluated once, not measured */
+    const char *script; /* Evaluated `evals` times */
+    int evals;
+};
+
+static struct workload workloads[] = {
+    {"fib",
+     "proc fib {n} {if {< $n 2} {return $n}; return [+ [fib [- $n 1]] [fib [- $n 2]]]}",
+     "fib 18", 20},
+    {"string",
+     "",
+     "set s {}; set i 0; while {< $i 500} {set s \"$s$i,\"; incr i}", 50},
+    {"while",
+     "",
+     "set i 0; set n 0; while {< $i 50000} {set n [+ $n $i]; incr i}", 20},
+    {"host",
+     "",
+     "set i 0; while {< $i 10000} {host0 $i; host57 a; host123 [host199 $i]; incr i}", 20},
+    {"expr",
+     "",
+     "set i 0; set n 0; while {expr {$i < 50000}} {set n [expr {($n + $i * 3) % 1000}]; incr i}", 20},
+};
+
+static int runWorkload(struct workload *w) {
+    struct picolInterp interp;
+    unsigned long before;
+    clock_t start, elapsed;
+    double secs;
+    int j;
+
+    picolInitInterp(&interp);
+    picolRegisterCoreCommands(&interp);
+    registerHostCommands(&interp);
+    if (picolEval(&interp,(char*)w->setup) != PICOL_OK ||
+        picolEval(&interp,(char*)w->script) != PICOL_OK) {
+        printf("%-8s error: %s\n", w->name, interp.result);
+        picolFreeInterp(&interp);
+        return 1;
+    }
+
+    before = allocs;
+    start = clock();
+    for (j = 0; j < w->evals; j++)
+        picolEval(&interp,(char*)w->script);
+    elapsed = clock() - start;
+    secs = (double)elapsed / CLOCKS_PER_SEC;
+    printf("%-8s %10.1f evals/s %10.1f ms/eval %12.1f allocs/eval\n", w->name,
+        secs > 0 ? w->evals / secs : 0.0, secs * 1000 / w->evals,
+        (double)(allocs - before) / w->evals);
+    picolFreeInterp(&interp);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int j, errors = 0;
+    for (j = 0; j < (int)(sizeof(workloads)/sizeof(workloads[0])); j++) {
+        if (argc > 1 && strcmp(argv[1],workloads[j].name)) continue;
+        errors += runWorkload(&workloads[j]);
+    }
+    return errors != 0;
+}
@@ -26,6 +26,40 @@
  * paramters passed, and `picolSetResult()` to set the value that will be returned
  * by the command.
  *
+ * Call `picolFreeInterp()` to release all the memory used by an interpreter.
+ *
+ * Interpreters don't share any state, so separate interpreters can be used
+ * concurrently on separate threads. To avoid registering the same commands
+ * in every interpreter, register them once in a prototype interpreter and
+ * then initialize the other interpreters with `picolInitInterpShared()`:
+ *
+ *     struct picolInterp proto, interp;
+ *     picolInitInterp(&proto);
+ *     picolRegisterCoreCommands(&proto);
+ *     picolRegisterCommand(&proto, "mycommand", myCommand, NULL);
+ *     ...
+ *     picolInitInterpShared(&interp, &proto);
+ *     int retcode = picolEval(&interp, text);
+ *     picolFreeInterp(&interp);
+ *
+ * The new interpreter looks up commands in its own table first, and then in
+ * the prototype's, so commands and `proc`s it defines are private to it.
+ * The prototype is only ever read by the interpreters that share it, so
+ * after its commands are registered it must not be modified or used to
+ * evaluate scripts while other interpreters share it, and it must outlive
+ * them. The commands' `privdata` is shared as well.
+ *
+ * All memory is allocated through the `PICOL_MALLOC()`, `PICOL_REALLOC()`
+ * and `PICOL_FREE()` macros, which can be defined before including the
+ * implementation to use a custom allocator.
+ *
+ * Proc calls and command substitutions don't recurse on the C stack, and a
+ * proc that ends by calling another proc (directly, as `return [proc ...]`
+ * or in the last branch of an `if`) reuses its caller's frame, so tail
+ * recursive procs run in constant space. Nesting is limited by
+ * `PICOL_MAX_FRAMES`, and by `PICOL_MAX_LEVEL` for commands like `while`
+ * that evaluate their scripts from C.
+ *
  * I've kept the original REPL. It can be accessed by compiling this
  * file with the `PICOL_REPL` symbol defined
  *
@@ -73,15 +107,59 @@ extern "C"
 
 enum {PICOL_OK, PICOL_ERR, PICOL_RETURN, PICOL_BREAK, PICOL_CONTINUE};
 
+/* Number of buckets in the command hash table; must be a power of 2 */
+#ifndef PICOL_CMD_BUCKETS
+#  define PICOL_CMD_BUCKETS 256
+#endif
+
+/* Number of buckets in each call frame's variable hash table;
+ * must be a power of 2 */
+#ifndef PICOL_VAR_BUCKETS
+#  define PICOL_VAR_BUCKETS 16
+#endif
+
+/* Number of compiled scripts cached by the interpreter; must be a power of 2 */
+#ifndef PICOL_SCRIPT_CACHE
+#  define PICOL_SCRIPT_CACHE 64
+#endif
+
+/* Maximum number of nested proc calls and command substitutions */
+#ifndef PICOL_MAX_FRAMES
+#  define PICOL_MAX_FRAMES 100000
+#endif
+
+/* Maximum nesting of commands like while that evaluate scripts from C */
+#ifndef PICOL_MAX_LEVEL
+#  define PICOL_MAX_LEVEL 1000
+#endif
+
+/* Size of the blocks in the scratch area used while evaluating */
+#ifndef PICOL_BLOCK_SIZE
+#  define PICOL_BLOCK_SIZE 4096
+#endif
+
 struct picolInterp {
     int level; /* Level of nesting */
     struct picolCallFrame *callframe;
-    struct picolCmd *commands;
+    struct picolCmd *commands[PICOL_CMD_BUCKETS];
+    const struct picolInterp *shared; /* Prototype with shared commands */
+    struct picolScript *scripts[PICOL_SCRIPT_CACHE];
+    struct picolExpr *exprs[PICOL_SCRIPT_CACHE];
     char *result;
+    int resultcap;
+    struct picolBlock *scratch, *spare; /* Scratch area for arguments */
+    struct picolCallFrame *freeframes; /* Call frames for reuse */
+    struct picolVar *freevars; /* Variables for reuse */
+    struct picolFrame *frames; /* Evaluation stack */
+    int nframes, framecap;
 };
 
 void picolInitInterp(struct picolInterp *i);
 
+void picolInitInterpShared(struct picolInterp *i, const struct picolInterp *proto);
+
+void picolFreeInterp(struct picolInterp *i);
+
 typedef int (*picolCmdFunc)(struct picolInterp *i, int argc, char **argv, void *privdata);
 
 int picolRegisterCommand(struct picolInterp *i, char *name, picolCmdFunc f, void *privdata);
@@ -104,6 +182,13 @@ void picolSetResult(struct picolInterp *i, char *s);
 #include <stdlib.h>
 #include <string.h>
 
+/* Define these to use your own allocator */
+#ifndef PICOL_MALLOC
+#  define PICOL_MALLOC(n) malloc(n)
+#  define PICOL_REALLOC(p,n) realloc(p,n)
+#  define PICOL_FREE(p) free(p)
+#endif
+
 enum {PT_ESC,PT_STR,PT_CMD,PT_VAR,PT_SEP,PT_EOL,PT_EOF};
 
 struct picolParser {
@@ -118,21 +203,115 @@ struct picolParser {
 
 struct picolVar {
     char *name, *val;
+    int namecap, valcap;
+    int ival, isint; /* Cached integer value, if isint is set */
+    unsigned int hash;
     struct picolVar *next;
 };
 
 struct picolCmd {
     char *name;
+    unsigned int hash;
     picolCmdFunc func;
     void *privdata;
     struct picolCmd *next;
 };
 
 struct picolCallFrame {
-    struct picolVar *vars;
+    struct picolVar *vars[PICOL_VAR_BUCKETS];
     struct picolCallFrame *parent; /* parent is NULL at top level */
 };
 
+/* A script is compiled into a list of commands, each command is a list
+ * of words and each word is a list of parts that are substituted and
+ * concatenated to form the command's arguments. */
+struct picolPart {
+    int type; /* PT_ESC or PT_STR for literals, PT_VAR or PT_CMD */
+    char *text; /* literal text, variable name or command source */
+    unsigned int hash; /* hash of text, for command and variable lookups */
+    struct picolScript *script; /* compiled command for PT_CMD parts */
+};
+
+struct picolRange {
+    int first, count;
+};
+
+struct picolScript {
+    int refs;
+    char *source;
+    unsigned int hash; /* hash of the source */
+    struct picolRange *cmds; /* words of each command */
+    struct picolRange *words; /* parts of each word */
+    struct picolPart *parts;
+    int ncmds, nwords, nparts;
+};
+
+/* Expressions for the expr command are compiled to a list of operations
+ * on a stack of integers */
+enum {EX_NUM,EX_VAR,EX_CMD,EX_NEG,EX_NOT,EX_BIN,EX_JZ,EX_JNZ,EX_BOOL};
+
+struct picolExprOp {
+    int op; /* EX_... */
+    int arg; /* number, binary operator or jump target */
+    char *name; /* variable name for EX_VAR */
+    unsigned int hash;
+    struct picolScript *script; /* compiled command for EX_CMD */
+};
+
+struct picolExpr {
+    int refs;
+    char *source;
+    unsigned int hash; /* hash of the source */
+    char *error; /* syntax error message, if any */
+    struct picolExprOp *ops;
+    int nops;
+};
+
+struct picolProc {
+    int nargs;
+    char **args;
+    struct picolScript *body;
+};
+
+/* The arguments of commands are built in a scratch area of blocks that are
+ * never moved, so a command's argv stays valid while it evaluates other
+ * scripts. Each command releases the scratch area back to where it started. */
+struct picolBlock {
+    struct picolBlock *prev;
+    size_t size, used;
+};
+
+struct picolMark {
+    struct picolBlock *block;
+    size_t used;
+};
+
+/* Scripts are evaluated on an explicit stack of frames rather than through
+ * recursive calls, so command substitutions, proc calls and if bodies don't
+ * use the C stack. */
+enum {FR_SCRIPT,FR_SUBST,FR_PROC,FR_BODY};
+
+struct picolFrame {
+    int kind; /* FR_SCRIPT for the bottom frame of picolRun(), FR_SUBST for a
+               * command substitution, FR_PROC for a proc body and FR_BODY for
+               * the body of an if */
+    struct picolScript *script;
+    int release; /* Release the script when the frame ends */
+    int procframe; /* Index of the proc frame this frame is part of, or -1 */
+    int tail; /* The frame's result becomes the result of procframe */
+    int cmd, word, part; /* Current command, word and part of the word */
+    int argc;
+    char **argv; /* Arguments of the current command, NULL between commands */
+    char **vals; /* Values of the parts of the current word */
+    struct picolMark mark; /* Scratch area at the start of the frame */
+};
+
+static unsigned int picolHash(const char *s) {
+    unsigned int h = 5381;
+    while(*s) h = h*33 + (unsigned char)*s++;
+    return h;
+}
+
 static void picolInitParser(struct picolParser *p, char *text) {
     p->text = p->p = text;
     p->len = strlen(text);
@@ -319,152 +498,560 @@ static int picolGetToken(struct picolParser *p) {
     return PICOL_OK; /* unreached */
 }
 
+static char *picolStrdup(const char *s) {
+    size_t len = strlen(s);
+    char *t = PICOL_MALLOC(len+1);
+    memcpy(t,s,len+1);
+    return t;
+}
+
+static struct picolCallFrame *picolNewCallFrame(struct picolInterp *i, struct picolCallFrame *parent) {
+    struct picolCallFrame *cf = i->freeframes;
+    int j;
+    if (cf)
+        i->freeframes = cf->parent;
+    else
+        cf = PICOL_MALLOC(sizeof(*cf));
+    for (j = 0; j < PICOL_VAR_BUCKETS; j++) cf->vars[j] = NULL;
+    cf->parent = parent;
+    return cf;
+}
+
+/* Copies s into the buffer *buf of capacity *cap, growing it if needed.
+ * s may point into *buf itself. */
+static void picolAssign(char **buf, int *cap, const char *s) {
+    int len = strlen(s);
+    if (len >= *cap) {
+        int ncap = (len + 16) & ~15;
+        char *n = PICOL_MALLOC(ncap);
+        memcpy(n, s, len+1);
+        PICOL_FREE(*buf);
+        *buf = n;
+        *cap = ncap;
+    } else {
+        memmove(*buf, s, len+1);
+    }
+}
+
+static void picolMarkScratch(struct picolInterp *i, struct picolMark *m) {
+    m->block = i->scratch;
+    m->used = i->scratch ? i->scratch->used : 0;
+}
+
+static void picolReleaseScratch(struct picolInterp *i, struct picolMark *m) {
+    while(i->scratch != m->block) {
+        struct picolBlock *b = i->scratch;
+        i->scratch = b->prev;
+        /* Keep the largest block around for the next allocation */
+        if (i->spare && i->spare->size >= b->size) {
+            PICOL_FREE(b);
+        } else {
+            PICOL_FREE(i->spare);
+            i->spare = b;
+        }
+    }
+    if (m->block) m->block->used = m->used;
+}
+
+static void *picolScratchAlloc(struct picolInterp *i, size_t n) {
+    struct picolBlock *b = i->scratch;
+    void *p;
+    n = (n + sizeof(char*) - 1) & ~(sizeof(char*) - 1);
+    if (!b || b->used + n > b->size) {
+        if (i->spare && i->spare->size >= n) {
+            b = i->spare;
+            i->spare = NULL;
+        } else {
+            size_t size = PICOL_BLOCK_SIZE;
+            while(size < n) size *= 2;
+            b = PICOL_MALLOC(sizeof(*b) + size);
+            b->size = size;
+        }
+        b->used = 0;
+        b->prev = i->scratch;
+        i->scratch = b;
+    }
+    p = (char*)(b + 1) + b->used;
+    b->used += n;
+    return p;
+}
+
 void picolInitInterp(struct picolInterp *i) {
+    int j;
     i->level = 0;
-    i->callframe = malloc(sizeof(struct picolCallFrame));
-    i->callframe->vars = NULL;
-    i->callframe->parent = NULL;
-    i->commands = NULL;
-    i->result = strdup("");
+    i->freeframes = NULL;
+    i->freevars = NULL;
+    i->scratch = i->spare = NULL;
+    i->shared = NULL;
+    i->frames = NULL;
+    i->nframes = i->framecap = 0;
+    i->callframe = picolNewCallFrame(i,NULL);
+    for (j = 0; j < PICOL_CMD_BUCKETS; j++) i->commands[j] = NULL;
+    for (j = 0; j < PICOL_SCRIPT_CACHE; j++) i->scripts[j] = NULL;
+    for (j = 0; j < PICOL_SCRIPT_CACHE; j++) i->exprs[j] = NULL;
+    i->result = NULL;
+    i->resultcap = 0;
+    picolAssign(&i->result,&i->resultcap,"");
+}
+
+void picolInitInterpShared(struct picolInterp *i, const struct picolInterp *proto) {
+    picolInitInterp(i);
+    i->shared = proto;
 }
 
 void picolSetResult(struct picolInterp *i, char *s) {
-    free(i->result);
-    i->result = strdup(s);
+    picolAssign(&i->result,&i->resultcap,s);
+}
+
+/* Formats n in decimal into buf, which must hold at least 12 chars */
+static char *picolFormatInt(char *buf, int n) {
+    char tmp[12], *p = buf;
+    unsigned int u = (n < 0) ? 0u - (unsigned int)n : (unsigned int)n;
+    int k = 0;
+    do {
+        tmp[k++] = '0' + u % 10;
+        u /= 10;
+    } while(u);
+    if (n < 0) *p++ = '-';
+    while(k) *p++ = tmp[--k];
+    *p = '\0';
+    return buf;
 }
 
-static struct picolVar *picolGetVar(struct picolInterp *i, char *name) {
-    struct picolVar *v = i->callframe->vars;
+static void picolSetResultInt(struct picolInterp *i, int n) {
+    char buf[12];
+    picolSetResult(i,picolFormatInt(buf,n));
+}
+
+static struct picolVar *picolLookupVar(struct picolInterp *i, char *name, unsigned int h) {
+    struct picolVar *v = i->callframe->vars[h & (PICOL_VAR_BUCKETS-1)];
     while(v) {
-        if (strcmp(v->name,name) == 0) return v;
+        if (v->hash == h && strcmp(v->name,name) == 0) return v;
         v = v->next;
     }
     return NULL;
 }
 
+static struct picolVar *picolStoreVar(struct picolInterp *i, char *name, unsigned int h, char *val) {
+    struct picolVar *v = picolLookupVar(i,name,h);
+    if (!v) {
+        struct picolVar **bucket;
+        if ((v = i->freevars) != NULL) {
+            i->freevars = v->next;
+        } else {
+            v = PICOL_MALLOC(sizeof(*v));
+            v->name = v->val = NULL;
+            v->namecap = v->valcap = 0;
+        }
+        picolAssign(&v->name,&v->namecap,name);
+        v->hash = h;
+        bucket = &i->callframe->vars[h & (PICOL_VAR_BUCKETS-1)];
+        v->next = *bucket;
+        *bucket = v;
+    }
+    picolAssign(&v->val,&v->valcap,val);
+    v->isint = 0;
+    return v;
+}
+
 static int picolSetVar(struct picolInterp *i, char *name, char *val) {
-    struct picolVar *v = picolGetVar(i,name);
-    if (v) {
-        free(v->val);
-        v->val = strdup(val);
-    } else {
-        v = malloc(sizeof(*v));
-        v->name = strdup(name);
-        v->val = strdup(val);
-        v->next = i->callframe->vars;
-        i->callframe->vars = v;
+    picolStoreVar(i,name,picolHash(name),val);
+    return PICOL_OK;
+}
+
+/* Returns the integer value of the variable, parsing its string only
+ * if it changed since the last time */
+static int picolVarInt(struct picolVar *v) {
+    if (!v->isint) {
+        v->ival = atoi(v->val);
+        v->isint = 1;
     }
+    return v->ival;
+}
+
+static int picolSetVarInt(struct picolInterp *i, char *name, int n) {
+    char buf[12];
+    struct picolVar *v = picolStoreVar(i,name,picolHash(name),picolFormatInt(buf,n));
+    v->ival = n;
+    v->isint = 1;
     return PICOL_OK;
 }
 
-static struct picolCmd *picolGetCommand(struct picolInterp *i, char *name) {
-    struct picolCmd *c = i->commands;
-    while(c) {
-        if (strcmp(c->name,name) == 0) return c;
-        c = c->next;
+static struct picolCmd *picolLookupCommand(const struct picolInterp *i, char *name, unsigned int h) {
+    for (; i; i = i->shared) {
+        struct picolCmd *c = i->commands[h & (PICOL_CMD_BUCKETS-1)];
+        while(c) {
+            if (c->hash == h && strcmp(c->name,name) == 0) return c;
+            c = c->next;
+        }
     }
     return NULL;
 }
 
+static struct picolCmd *picolGetCommand(struct picolInterp *i, char *name) {
+    return picolLookupCommand(i,name,picolHash(name));
+}
+
 int picolRegisterCommand(struct picolInterp *i, char *name, picolCmdFunc f, void *privdata) {
-    struct picolCmd *c = picolGetCommand(i,name);
+    struct picolCmd *c = picolGetCommand(i,name), **bucket;
     char errbuf[1024];
     if (c) {
         snprintf(errbuf,1024,"Command '%s' already defined",name);
         picolSetResult(i,errbuf);
         return PICOL_ERR;
     }
-    c = malloc(sizeof(*c));
-    c->name = strdup(name);
+    c = PICOL_MALLOC(sizeof(*c));
+    c->name = picolStrdup(name);
     c->func = f;
     c->privdata = privdata;
-    c->next = i->commands;
-    i->commands = c;
+    c->hash = picolHash(name);
+    bucket = &i->commands[c->hash & (PICOL_CMD_BUCKETS-1)];
+    c->next = *bucket;
+    *bucket = c;
     return PICOL_OK;
 }
 
-/* EVAL! */
-int picolEval(struct picolInterp *i, char *t) {
+/* Grows the array *a of n elements so that there is room for one more */
+static void *picolGrow(void *a, int n, int *cap, size_t size) {
+    if (n < *cap) return a;
+    *cap = *cap ? *cap * 2 : 8;
+    return PICOL_REALLOC(a, size * *cap);
+}
+
+static void picolReleaseScript(struct picolScript *s) {
+    int j;
+    if (--s->refs > 0) return;
+    for (j = 0; j < s->nparts; j++) {
+        PICOL_FREE(s->parts[j].text);
+        if (s->parts[j].script) picolReleaseScript(s->parts[j].script);
+    }
+    PICOL_FREE(s->parts);
+    PICOL_FREE(s->words);
+    PICOL_FREE(s->cmds);
+    PICOL_FREE(s->source);
+    PICOL_FREE(s);
+}
+
+/* Splits the script t into commands, words and parts so that
+ * it can be evaluated repeatedly without parsing it again. */
+static struct picolScript *picolCompile(char *t) {
     struct picolParser p;
-    int argc = 0, j;
-    char **argv = NULL;
-    char errbuf[1024];
-    int retcode = PICOL_OK;
-    picolSetResult(i,"");
+    struct picolScript *s = PICOL_MALLOC(sizeof(*s));
+    int capc = 0, capw = 0, capp = 0, incmd = 0;
+    memset(s,0,sizeof(*s));
+    s->refs = 1;
+    s->source = picolStrdup(t);
+    s->hash = picolHash(t);
     picolInitParser(&p,t);
     while(1) {
-        char *t;
+        struct picolPart *part;
         int tlen;
         int prevtype = p.type;
         picolGetToken(&p);
         if (p.type == PT_EOF) break;
+        if (p.type == PT_SEP) continue;
+        if (p.type == PT_EOL) {
+            incmd = 0;
+            continue;
+        }
+        /* A new token starts a new word, or is appended to the previous one */
+        if (prevtype == PT_SEP || prevtype == PT_EOL) {
+            if (!incmd) {
+                s->cmds = picolGrow(s->cmds,s->ncmds,&capc,sizeof(*s->cmds));
+                s->cmds[s->ncmds].first = s->nwords;
+                s->cmds[s->ncmds++].count = 0;
+                incmd = 1;
+            }
+            s->words = picolGrow(s->words,s->nwords,&capw,sizeof(*s->words));
+            s->words[s->nwords].first = s->nparts;
+            s->words[s->nwords++].count = 0;
+            s->cmds[s->ncmds-1].count++;
+        }
+        s->parts = picolGrow(s->parts,s->nparts,&capp,sizeof(*s->parts));
+        part = &s->parts[s->nparts++];
+        s->words[s->nwords-1].count++;
         tlen = p.end-p.start+1;
         if (tlen < 0) tlen = 0;
-        t = malloc(tlen+1);
-        memcpy(t, p.start, tlen);
-        t[tlen] = '\0';
-        if (p.type == PT_VAR) {
-            struct picolVar *v = picolGetVar(i,t);
-            if (!v) {
-                snprintf(errbuf,1024,"No such variable '%s'",t);
-                free(t);
-                picolSetResult(i,errbuf);
-                retcode = PICOL_ERR;
-                goto err;
+        part->type = p.type;
+        part->text = PICOL_MALLOC(tlen+1);
+        memcpy(part->text, p.start, tlen);
+        part->text[tlen] = '\0';
+        part->hash = picolHash(part->text);
+        part->script = (p.type == PT_CMD) ? picolCompile(part->text) : NULL;
+    }
+    return s;
+}
+
+/* Returns the compiled form of the script t from the interpreter's cache,
+ * compiling it if necessary. Release it with picolReleaseScript() */
+static struct picolScript *picolGetScript(struct picolInterp *i, char *t) {
+    unsigned int h = picolHash(t);
+    struct picolScript **slot = &i->scripts[h & (PICOL_SCRIPT_CACHE-1)];
+    if (!*slot || (*slot)->hash != h || strcmp((*slot)->source,t)) {
+        if (*slot) picolReleaseScript(*slot);
+        *slot = picolCompile(t);
+    }
+    (*slot)->refs++;
+    return *slot;
+}
+
+static int picolEvalScript(struct picolInterp *i, struct picolScript *s);
+static int picolCommandIf(struct picolInterp *i, int argc, char **argv, void *pd);
+static int picolCommandCallProc(struct picolInterp *i, int argc, char **argv, void *pd);
+static int picolCommandReturn(struct picolInterp *i, int argc, char **argv, void *pd);
+static void picolDropCallFrame(struct picolInterp *i);
+
+static int picolNoSuch(struct picolInterp *i, const char *what, const char *name) {
+    char errbuf[1024];
+    snprintf(errbuf,1024,"No such %s '%s'",what,name);
+    picolSetResult(i,errbuf);
+    return PICOL_ERR;
+}
+
+static int picolProcArityErr(struct picolInterp *i, const char *name) {
+    char errbuf[1024];
+    snprintf(errbuf,1024,"Proc '%s' called with wrong arg num",name);
+    picolSetResult(i,errbuf);
+    return PICOL_ERR;
+}
+
+static char *picolScratchStrdup(struct picolInterp *i, const char *s) {
+    size_t len = strlen(s);
+    char *t = picolScratchAlloc(i,len+1);
+    memcpy(t,s,len+1);
+    return t;
+}
+
+/* Pushes a frame to evaluate s, returning its index, or -1 on error */
+static int picolPushFrame(struct picolInterp *i, int kind, struct picolScript *s, int release) {
+    struct picolFrame *f;
+    if (i->nframes >= PICOL_MAX_FRAMES) {
+        picolSetResult(i,"Too many nested evaluations");
+        if (release) picolReleaseScript(s);
+        return -1;
+    }
+    i->frames = picolGrow(i->frames,i->nframes,&i->framecap,sizeof(*i->frames));
+    f = &i->frames[i->nframes];
+    f->kind = kind;
+    f->script = s;
+    f->release = release;
+    f->procframe = (kind == FR_PROC) ? i->nframes : -1;
+    f->tail = (kind == FR_PROC);
+    f->cmd = 0;
+    f->argv = NULL;
+    picolMarkScratch(i,&f->mark);
+    picolSetResult(i,"");
+    return i->nframes++;
+}
+
+/* Pops the top frame, returning the frame's return code */
+static int picolPopFrame(struct picolInterp *i, int retcode) {
+    struct picolFrame *f = &i->frames[--i->nframes];
+    picolReleaseScratch(i,&f->mark);
+    if (f->release) picolReleaseScript(f->script);
+    if (f->kind == FR_PROC) {
+        picolDropCallFrame(i); /* remove the called proc callframe */
+        if (retcode == PICOL_RETURN) retcode = PICOL_OK;
+    }
+    return retcode;
+}
+
+/* Is the current command of f of the form `return [...]`? */
+static int picolIsReturnSubst(struct picolInterp *i, struct picolFrame *f) {
+    struct picolScript *s = f->script;
+    struct picolRange *cmd = &s->cmds[f->cmd];
+    struct picolRange *w0 = &s->words[cmd->first], *w1 = w0 + 1;
+    struct picolCmd *c;
+    if (cmd->count != 2 || w0->count != 1 || w1->count != 1) return 0;
+    if (s->parts[w1->first].type != PT_CMD) return 0;
+    if (s->parts[w0->first].type != PT_ESC && s->parts[w0->first].type != PT_STR) return 0;
+    c = picolLookupCommand(i,s->parts[w0->first].text,s->parts[w0->first].hash);
+    return c && c->func == picolCommandReturn;
+}
+
+/* Adds the value v of the current part to the arguments of frame f */
+static void picolAddPart(struct picolInterp *i, struct picolFrame *f, char *v) {
+    struct picolRange *word = &f->script->words[f->word];
+    if (word->count == 1) {
+        f->argv[f->argc++] = v;
+    } else {
+        f->vals[f->part++] = v;
+        if (f->part < word->count) return;
+        {
+            /* Interpolation */
+            size_t len = 0, vlen;
+            char *t;
+            int k;
+            for (k = 0; k < word->count; k++) len += strlen(f->vals[k]);
+            f->argv[f->argc++] = t = picolScratchAlloc(i,len+1);
+            for (k = 0; k < word->count; k++) {
+                vlen = strlen(f->vals[k]);
+                memcpy(t, f->vals[k], vlen);
+                t += vlen;
             }
-            free(t);
-            t = strdup(v->val);
-        } else if (p.type == PT_CMD) {
-            retcode = picolEval(i,t);
-            free(t);
-            if (retcode != PICOL_OK) goto err;
-            t = strdup(i->result);
-        } else if (p.type == PT_ESC) {
-            /* XXX: escape handling missing! */
-        } else if (p.type == PT_SEP) {
-            prevtype = p.type;
-            free(t);
-            continue;
+            *t = '\0';
         }
-        /* We have a complete command + args. Call it! */
-        if (p.type == PT_EOL) {
-            struct picolCmd *c;
-            free(t);
-            prevtype = p.type;
-            if (argc) {
-                if ((c = picolGetCommand(i,argv[0])) == NULL) {
-                    snprintf(errbuf,1024,"No such command '%s'",argv[0]);
-                    picolSetResult(i,errbuf);
+    }
+    f->word++;
+    f->part = 0;
+}
+
+/* EVAL! Runs the frame at index base and everything it pushes */
+static int picolRun(struct picolInterp *i, int base) {
+    struct picolFrame *f;
+    struct picolScript *s;
+    struct picolRange *cmd;
+    struct picolCmd *pc = NULL;
+    int retcode = PICOL_OK, kind, n, j;
+
+    if (++i->level > PICOL_MAX_LEVEL) {
+        picolSetResult(i,"Too many nested evaluations");
+        retcode = PICOL_ERR;
+        while(i->nframes > base) retcode = picolPopFrame(i,PICOL_ERR);
+        i->level--;
+        return PICOL_ERR;
+    }
+
+    while(1) {
+        f = &i->frames[i->nframes-1];
+        s = f->script;
+        if (f->cmd >= s->ncmds) {
+            retcode = PICOL_OK;
+            goto endframe;
+        }
+        cmd = &s->cmds[f->cmd];
+        if (!f->argv) {
+            f->argv = picolScratchAlloc(i,sizeof(char*)*cmd->count);
+            f->argc = 0;
+            f->word = cmd->first;
+            f->part = 0;
+        }
+        if (f->word < cmd->first + cmd->count) {
+            /* Substitute the next part of the current word */
+            struct picolRange *word = &s->words[f->word];
+            struct picolPart *part = &s->parts[word->first + f->part];
+            if (f->part == 0 && word->count > 1)
+                f->vals = picolScratchAlloc(i,sizeof(char*)*word->count);
+            if (part->type == PT_CMD) {
+                int tail = f->procframe >= 0 && picolIsReturnSubst(i,f);
+                int procframe = f->procframe;
+                if ((n = picolPushFrame(i,FR_SUBST,part->script,0)) < 0) {
                     retcode = PICOL_ERR;
-                    goto err;
+                    goto endframe;
                 }
-                retcode = c->func(i,argc,argv,c->privdata);
-                if (retcode != PICOL_OK) goto err;
+                i->frames[n].procframe = procframe;
+                i->frames[n].tail = tail;
+            } else if (part->type == PT_VAR) {
+                struct picolVar *var = picolLookupVar(i,part->text,part->hash);
+                if (!var) {
+                    retcode = picolNoSuch(i,"variable",part->text);
+                    goto endframe;
+                }
+                picolAddPart(i,f,picolScratchStrdup(i,var->val));
+            } else {
+                /* XXX: escape handling missing! */
+                picolAddPart(i,f,picolScratchStrdup(i,part->text));
             }
-            /* Prepare for the next command */
-            for (j = 0; j < argc; j++) free(argv[j]);
-            free(argv);
-            argv = NULL;
-            argc = 0;
             continue;
         }
-        /* We have a new token, append to the previous or as new arg? */
-        if (prevtype == PT_SEP || prevtype == PT_EOL) {
-            argv = realloc(argv, sizeof(char*)*(argc+1));
-            argv[argc] = t;
-            argc++;
-        } else { /* Interpolation */
-            int oldlen = strlen(argv[argc-1]), tlen = strlen(t);
-            argv[argc-1] = realloc(argv[argc-1], oldlen+tlen+1);
-            memcpy(argv[argc-1]+oldlen, t, tlen);
-            argv[argc-1][oldlen+tlen]='\0';
-            free(t);
+
+        /* We have a complete command + args. Call it! */
+        {
+            struct picolPart *first = &s->parts[s->words[cmd->first].first];
+            if (s->words[cmd->first].count == 1 && (first->type == PT_ESC || first->type == PT_STR))
+                pc = picolLookupCommand(i,f->argv[0],first->hash);
+            else
+                pc = picolGetCommand(i,f->argv[0]);
+        }
+        if (pc == NULL) {
+            retcode = picolNoSuch(i,"command",f->argv[0]);
+            goto endframe;
         }
-        prevtype = p.type;
+        if (pc->func == picolCommandCallProc) {
+            struct picolProc *proc = pc->privdata;
+            struct picolCallFrame *cf;
+            if (proc->nargs != f->argc-1) {
+                retcode = picolProcArityErr(i,f->argv[0]);
+                goto endframe;
+            }
+            cf = picolNewCallFrame(i,i->callframe);
+            i->callframe = cf;
+            for (j = 0; j < proc->nargs; j++)
+                picolSetVar(i,proc->args[j],f->argv[j+1]);
+            if (f->tail && f->cmd == s->ncmds-1) {
+                /* Tail call: the caller's frames are done, so replace them */
+                int q = f->procframe;
+                i->callframe = cf->parent;
+                while(i->nframes > q) picolPopFrame(i,PICOL_OK);
+                cf->parent = i->callframe;
+                i->callframe = cf;
+            }
+            if (picolPushFrame(i,FR_PROC,proc->body,0) < 0) {
+                picolDropCallFrame(i);
+                retcode = PICOL_ERR;
+                f = &i->frames[i->nframes-1];
+                goto cmddone;
+            }
+            continue;
+        }
+        if (pc->func == picolCommandIf && (f->argc == 3 || f->argc == 5)) {
+            /* Evaluate the body in a frame of its own */
+            struct picolScript *cond = picolGetScript(i,f->argv[1]), *body = NULL;
+            int tail = f->tail && f->cmd == s->ncmds-1;
+            int procframe = f->procframe;
+            retcode = picolEvalScript(i,cond);
+            picolReleaseScript(cond);
+            f = &i->frames[i->nframes-1];
+            if (retcode != PICOL_OK) goto cmddone;
+            if (atoi(i->result)) body = picolGetScript(i,f->argv[2]);
+            else if (f->argc == 5) body = picolGetScript(i,f->argv[4]);
+            if (!body) goto cmddone;
+            if ((n = picolPushFrame(i,FR_BODY,body,1)) < 0) {
+                retcode = PICOL_ERR;
+                goto cmddone;
+            }
+            i->frames[n].procframe = procframe;
+            i->frames[n].tail = tail;
+            continue;
+        }
+        retcode = pc->func(i,f->argc,f->argv,pc->privdata);
+        f = &i->frames[i->nframes-1];
+
+cmddone:
+        if (retcode != PICOL_OK) goto endframe;
+        /* Prepare for the next command */
+        picolReleaseScratch(i,&f->mark);
+        f->argv = NULL;
+        f->cmd++;
+        continue;
+
+endframe:
+        kind = f->kind;
+        retcode = picolPopFrame(i,retcode);
+        if (i->nframes == base) break;
+        f = &i->frames[i->nframes-1];
+        if (kind == FR_SUBST) {
+            if (retcode != PICOL_OK) goto endframe;
+            picolAddPart(i,f,picolScratchStrdup(i,i->result));
+            continue;
+        }
+        /* A proc or if body finished the command that pushed it */
+        goto cmddone;
     }
-err:
-    for (j = 0; j < argc; j++) free(argv[j]);
-    free(argv);
+    i->level--;
+    return retcode;
+}
+
+static int picolEvalScript(struct picolInterp *i, struct picolScript *s) {
+    int base = picolPushFrame(i,FR_SCRIPT,s,0);
+    if (base < 0) return PICOL_ERR;
+    return picolRun(i,base);
+}
+
+int picolEval(struct picolInterp *i, char *t) {
+    struct picolScript *s = picolGetScript(i,t);
+    int retcode = picolEvalScript(i,s);
+    picolReleaseScript(s);
     return retcode;
 }
 
@@ -477,7 +1064,7 @@ int picolArityErr(struct picolInterp *i, char *name) {
 }
 
 static int picolCommandMath(struct picolInterp *i, int argc, char **argv, void *pd) {
-    char buf[64]; int a, b, c;
+    int a, b, c;
     if (argc != 3) return picolArityErr(i,argv[0]);
     a = atoi(argv[1]); b = atoi(argv[2]);
     if (argv[0][0] == '+') c = a+b;
@@ -491,8 +1078,305 @@ static int picolCommandMath(struct picolInterp *i, int argc, char **argv, void *
     else if (argv[0][0] == '=' && argv[0][1] == '=') c = a == b;
     else if (argv[0][0] == '!' && argv[0][1] == '=') c = a != b;
     else c = 0; /* I hate warnings */
-    snprintf(buf,64,"%d",c);
-    picolSetResult(i,buf);
+    picolSetResultInt(i,c);
+    return PICOL_OK;
+}
+
+static void picolReleaseExpr(struct picolExpr *e) {
+    int j;
+    if (--e->refs > 0) return;
+    for (j = 0; j < e->nops; j++) {
+        PICOL_FREE(e->ops[j].name);
+        if (e->ops[j].script) picolReleaseScript(e->ops[j].script);
+    }
+    PICOL_FREE(e->ops);
+    PICOL_FREE(e->error);
+    PICOL_FREE(e->source);
+    PICOL_FREE(e);
+}
+
+struct picolExprParser {
+    char *p;
+    struct picolExpr *e;
+    int cap;
+};
+
+static int picolExprEmit(struct picolExprParser *ep, int op, int arg) {
+    struct picolExprOp *o;
+    ep->e->ops = picolGrow(ep->e->ops,ep->e->nops,&ep->cap,sizeof(*ep->e->ops));
+    o = &ep->e->ops[ep->e->nops];
+    o->op = op;
+    o->arg = arg;
+    o->name = NULL;
+    o->hash = 0;
+    o->script = NULL;
+    return ep->e->nops++;
+}
+
+static void picolExprError(struct picolExprParser *ep, const char *msg) {
+    char errbuf[1024];
+    if (ep->e->error) return;
+    snprintf(errbuf,1024,"%s in expression '%s'",msg,ep->e->source);
+    ep->e->error = picolStrdup(errbuf);
+}
+
+/* Skips whitespace and checks whether the operator op is next */
+static int picolExprMatch(struct picolExprParser *ep, const char *op) {
+    size_t len = strlen(op);
+    while(*ep->p == ' ' || *ep->p == '\t' || *ep->p == '\n' || *ep->p == '\r') ep->p++;
+    if (strncmp(ep->p,op,len)) return 0;
+    /* Don't mistake '<=' for '<', '==' for '=', etc. */
+    if (len == 1 && ep->p[1] == '=' && strchr("<>!=",op[0])) return 0;
+    if (len == 1 && (op[0] == '&' || op[0] == '|') && ep->p[1] == op[0]) return 0;
+    ep->p += len;
+    return 1;
+}
+
+static void picolExprOr(struct picolExprParser *ep);
+
+static void picolExprPrimary(struct picolExprParser *ep) {
+    char *start;
+    if (picolExprMatch(ep,"(")) {
+        picolExprOr(ep);
+        if (!picolExprMatch(ep,")")) picolExprError(ep,"missing ')'");
+    } else if (picolExprMatch(ep,"-")) {
+        picolExprPrimary(ep);
+        picolExprEmit(ep,EX_NEG,0);
+    } else if (picolExprMatch(ep,"+")) {
+        picolExprPrimary(ep);
+    } else if (picolExprMatch(ep,"!")) {
+        picolExprPrimary(ep);
+        picolExprEmit(ep,EX_NOT,0);
+    } else if (*ep->p >= '0' && *ep->p <= '9') {
+        picolExprEmit(ep,EX_NUM,(int)strtol(ep->p,&ep->p,10));
+    } else if (*ep->p == '$') {
+        struct picolExprOp *o;
+        int k;
+        start = ++ep->p;
+        while((*ep->p >= 'a' && *ep->p <= 'z') || (*ep->p >= 'A' && *ep->p <= 'Z') ||
+              (*ep->p >= '0' && *ep->p <= '9') || *ep->p == '_') ep->p++;
+        if (start == ep->p) {
+            picolExprError(ep,"variable name expected");
+            return;
+        }
+        k = picolExprEmit(ep,EX_VAR,0);
+        o = &ep->e->ops[k];
+        o->name = PICOL_MALLOC(ep->p-start+1);
+        memcpy(o->name,start,ep->p-start);
+        o->name[ep->p-start] = '\0';
+        o->hash = picolHash(o->name);
+    } else if (*ep->p == '[') {
+        struct picolParser p;
+        char *text;
+        int tlen, k;
+        picolInitParser(&p,ep->p);
+        picolParseCommand(&p);
+        tlen = p.end-p.start+1;
+        if (tlen < 0) tlen = 0;
+        text = PICOL_MALLOC(tlen+1);
+        memcpy(text,p.start,tlen);
+        text[tlen] = '\0';
+        k = picolExprEmit(ep,EX_CMD,0);
+        ep->e->ops[k].script = picolCompile(text);
+        PICOL_FREE(text);
+        ep->p = p.p;
+    } else {
+        picolExprError(ep,"syntax error");
+    }
+}
+
+static void picolExprMul(struct picolExprParser *ep) {
+    picolExprPrimary(ep);
+    while(!ep->e->error) {
+        if (picolExprMatch(ep,"*")) { picolExprPrimary(ep); picolExprEmit(ep,EX_BIN,'*'); }
+        else if (picolExprMatch(ep,"/")) { picolExprPrimary(ep); picolExprEmit(ep,EX_BIN,'/'); }
+        else if (picolExprMatch(ep,"%")) { picolExprPrimary(ep); picolExprEmit(ep,EX_BIN,'%'); }
+        else break;
+    }
+}
+
+static void picolExprAdd(struct picolExprParser *ep) {
+    picolExprMul(ep);
+    while(!ep->e->error) {
+        if (picolExprMatch(ep,"+")) { picolExprMul(ep); picolExprEmit(ep,EX_BIN,'+'); }
+        else if (picolExprMatch(ep,"-")) { picolExprMul(ep); picolExprEmit(ep,EX_BIN,'-'); }
+        else break;
+    }
+}
+
+static void picolExprRel(struct picolExprParser *ep) {
+    picolExprAdd(ep);
+    while(!ep->e->error) {
+        if (picolExprMatch(ep,"<=")) { picolExprAdd(ep); picolExprEmit(ep,EX_BIN,'l'); }
+        else if (picolExprMatch(ep,">=")) { picolExprAdd(ep); picolExprEmit(ep,EX_BIN,'g'); }
+        else if (picolExprMatch(ep,"<")) { picolExprAdd(ep); picolExprEmit(ep,EX_BIN,'<'); }
+        else if (picolExprMatch(ep,">")) { picolExprAdd(ep); picolExprEmit(ep,EX_BIN,'>'); }
+        else break;
+    }
+}
+
+static void picolExprEq(struct picolExprParser *ep) {
+    picolExprRel(ep);
+    while(!ep->e->error) {
+        if (picolExprMatch(ep,"==")) { picolExprRel(ep); picolExprEmit(ep,EX_BIN,'='); }
+        else if (picolExprMatch(ep,"!=")) { picolExprRel(ep); picolExprEmit(ep,EX_BIN,'!'); }
+        else break;
+    }
+}
+
+static void picolExprAnd(struct picolExprParser *ep) {
+    picolExprEq(ep);
+    while(!ep->e->error && picolExprMatch(ep,"&&")) {
+        int jump = picolExprEmit(ep,EX_JZ,0);
+        picolExprEq(ep);
+        picolExprEmit(ep,EX_BOOL,0);
+        ep->e->ops[jump].arg = ep->e->nops;
+    }
+}
+
+static void picolExprOr(struct picolExprParser *ep) {
+    picolExprAnd(ep);
+    while(!ep->e->error && picolExprMatch(ep,"||")) {
+        int jump = picolExprEmit(ep,EX_JNZ,0);
+        picolExprAnd(ep);
+        picolExprEmit(ep,EX_BOOL,0);
+        ep->e->ops[jump].arg = ep->e->nops;
+    }
+}
+
+static struct picolExpr *picolCompileExpr(char *t) {
+    struct picolExprParser ep;
+    struct picolExpr *e = PICOL_MALLOC(sizeof(*e));
+    memset(e,0,sizeof(*e));
+    e->refs = 1;
+    e->source = picolStrdup(t);
+    e->hash = picolHash(t);
+    ep.p = t;
+    ep.e = e;
+    ep.cap = 0;
+    picolExprOr(&ep);
+    if (!picolExprMatch(&ep,"") || *ep.p) picolExprError(&ep,"syntax error");
+    return e;
+}
+
+/* Returns the compiled form of the expression t from the interpreter's
+ * cache, compiling it if necessary. Release it with picolReleaseExpr() */
+static struct picolExpr *picolGetExpr(struct picolInterp *i, char *t) {
+    unsigned int h = picolHash(t);
+    struct picolExpr **slot = &i->exprs[h & (PICOL_SCRIPT_CACHE-1)];
+    if (!*slot || (*slot)->hash != h || strcmp((*slot)->source,t)) {
+        if (*slot) picolReleaseExpr(*slot);
+        *slot = picolCompileExpr(t);
+    }
+    (*slot)->refs++;
+    return *slot;
+}
+
+static int picolEvalExpr(struct picolInterp *i, struct picolExpr *e, int *result) {
+    struct picolMark mark;
+    char errbuf[1024];
+    int *stack, sp = 0, pc, a, b, retcode = PICOL_OK;
+    if (e->error) {
+        picolSetResult(i,e->error);
+        return PICOL_ERR;
+    }
+    picolMarkScratch(i,&mark);
+    stack = picolScratchAlloc(i,sizeof(int)*(e->nops+1));
+    for (pc = 0; pc < e->nops; pc++) {
+        struct picolExprOp *o = &e->ops[pc];
+        switch(o->op) {
+        case EX_NUM: stack[sp++] = o->arg; break;
+        case EX_VAR: {
+            struct picolVar *v = picolLookupVar(i,o->name,o->hash);
+            if (!v) {
+                snprintf(errbuf,1024,"No such variable '%s'",o->name);
+                picolSetResult(i,errbuf);
+                retcode = PICOL_ERR;
+                goto done;
+            }
+            stack[sp++] = picolVarInt(v);
+        } break;
+        case EX_CMD:
+            if ((retcode = picolEvalScript(i,o->script)) != PICOL_OK) goto done;
+            stack[sp++] = atoi(i->result);
+            break;
+        case EX_NEG: stack[sp-1] = -stack[sp-1]; break;
+        case EX_NOT: stack[sp-1] = !stack[sp-1]; break;
+        case EX_BOOL: stack[sp-1] = stack[sp-1] != 0; break;
+        case EX_JZ:
+            if (!stack[sp-1]) pc = o->arg - 1; else sp--;
+            break;
+        case EX_JNZ:
+            if (stack[sp-1]) { stack[sp-1] = 1; pc = o->arg - 1; } else sp--;
+            break;
+        case EX_BIN:
+            b = stack[--sp];
+            a = stack[sp-1];
+            switch(o->arg) {
+            case '+': a = a + b; break;
+            case '-': a = a - b; break;
+            case '*': a = a * b; break;
+            case '/': case '%':
+                if (b == 0) {
+                    picolSetResult(i,"divide by zero");
+                    retcode = PICOL_ERR;
+                    goto done;
+                }
+                a = (o->arg == '/') ? a / b : a % b;
+                break;
+            case '<': a = a < b; break;
+            case '>': a = a > b; break;
+            case 'l': a = a <= b; break;
+            case 'g': a = a >= b; break;
+            case '=': a = a == b; break;
+            case '!': a = a != b; break;
+            }
+            stack[sp-1] = a;
+            break;
+        }
+    }
+    *result = stack[0];
+done:
+    picolReleaseScratch(i,&mark);
+    return retcode;
+}
+
+static int picolCommandExpr(struct picolInterp *i, int argc, char **argv, void *pd) {
+    struct picolMark mark;
+    struct picolExpr *e;
+    char *text;
+    int retcode, result = 0, j;
+    if (argc < 2) return picolArityErr(i,argv[0]);
+    picolMarkScratch(i,&mark);
+    if (argc == 2) {
+        text = argv[1];
+    } else {
+        /* Join the arguments with spaces, as Tcl does */
+        size_t len = 0;
+        for (j = 1; j < argc; j++) len += strlen(argv[j]) + 1;
+        text = picolScratchAlloc(i,len);
+        text[0] = '\0';
+        for (j = 1; j < argc; j++) {
+            if (j > 1) strcat(text," ");
+            strcat(text,argv[j]);
+        }
+    }
+    e = picolGetExpr(i,text);
+    retcode = picolEvalExpr(i,e,&result);
+    picolReleaseExpr(e);
+    picolReleaseScratch(i,&mark);
+    if (retcode == PICOL_OK) picolSetResultInt(i,result);
+    return retcode;
+}
+
+static int picolCommandIncr(struct picolInterp *i, int argc, char **argv, void *pd) {
+    struct picolVar *v;
+    int n;
+    if (argc != 2 && argc != 3) return picolArityErr(i,argv[0]);
+    v = picolLookupVar(i,argv[1],picolHash(argv[1]));
+    n = (v ? picolVarInt(v) : 0) + (argc == 3 ? atoi(argv[2]) : 1);
+    picolSetVarInt(i,argv[1],n);
+    picolSetResultInt(i,n);
     return PICOL_OK;
 }
 
@@ -519,19 +1403,27 @@ static int picolCommandIf(struct picolInterp *i, int argc, char **argv, void *pd
 }
 
 static int picolCommandWhile(struct picolInterp *i, int argc, char **argv, void *pd) {
+    struct picolScript *cond, *body;
+    int retcode;
     if (argc != 3) return picolArityErr(i,argv[0]);
+    cond = picolGetScript(i,argv[1]);
+    body = picolGetScript(i,argv[2]);
     while(1) {
-        int retcode = picolEval(i,argv[1]);
-        if (retcode != PICOL_OK) return retcode;
+        retcode = picolEvalScript(i,cond);
+        if (retcode != PICOL_OK) break;
         if (atoi(i->result)) {
-            if ((retcode = picolEval(i,argv[2])) == PICOL_CONTINUE) continue;
+            if ((retcode = picolEvalScript(i,body)) == PICOL_CONTINUE) continue;
             else if (retcode == PICOL_OK) continue;
-            else if (retcode == PICOL_BREAK) return PICOL_OK;
-            else return retcode;
+            else if (retcode == PICOL_BREAK) retcode = PICOL_OK;
+            break;
         } else {
-            return PICOL_OK;
+            retcode = PICOL_OK;
+            break;
         }
     }
+    picolReleaseScript(cond);
+    picolReleaseScript(body);
+    return retcode;
 }
 
 static int picolCommandRetCodes(struct picolInterp *i, int argc, char **argv, void *pd) {
@@ -543,59 +1435,65 @@ static int picolCommandRetCodes(struct picolInterp *i, int argc, char **argv, vo
 
 static void picolDropCallFrame(struct picolInterp *i) {
     struct picolCallFrame *cf = i->callframe;
-    struct picolVar *v = cf->vars, *t;
-    while(v) {
-        t = v->next;
-        free(v->name);
-        free(v->val);
-        free(v);
-        v = t;
+    struct picolVar *v, *t;
+    int j;
+    for (j = 0; j < PICOL_VAR_BUCKETS; j++) {
+        v = cf->vars[j];
+        while(v) {
+            t = v->next;
+            v->next = i->freevars;
+            i->freevars = v;
+            v = t;
+        }
     }
     i->callframe = cf->parent;
-    free(cf);
+    cf->parent = i->freeframes;
+    i->freeframes = cf;
 }
 
+/* Procs are normally called by picolRun() directly; this is
+ * for hosts that call a command's function themselves */
 static int picolCommandCallProc(struct picolInterp *i, int argc, char **argv, void *pd) {
-    char **x=pd, *alist=x[0], *body=x[1], *p=strdup(alist), *tofree;
-    struct picolCallFrame *cf = malloc(sizeof(*cf));
-    int arity = 0, done = 0, errcode = PICOL_OK;
-    char errbuf[1024];
-    cf->vars = NULL;
-    cf->parent = i->callframe;
-    i->callframe = cf;
-    tofree = p;
-    while(1) {
-        char *start = p;
-        while(*p != ' ' && *p != '\0') p++;
-        if (*p != '\0' && p == start) {
-            p++; continue;
-        }
-        if (p == start) break;
-        if (*p == '\0') done=1; else *p = '\0';
-        if (++arity > argc-1) goto arityerr;
-        picolSetVar(i,start,argv[arity]);
-        p++;
-        if (done) break;
-    }
-    free(tofree);
-    if (arity != argc-1) goto arityerr;
-    errcode = picolEval(i,body);
-    if (errcode == PICOL_RETURN) errcode = PICOL_OK;
-    picolDropCallFrame(i); /* remove the called proc callframe */
-    return errcode;
-arityerr:
-    snprintf(errbuf,1024,"Proc '%s' called with wrong arg num",argv[0]);
-    picolSetResult(i,errbuf);
-    picolDropCallFrame(i); /* remove the called proc callframe */
-    return PICOL_ERR;
+    struct picolProc *proc = pd;
+    int j, base;
+    if (proc->nargs != argc-1) return picolProcArityErr(i,argv[0]);
+    i->callframe = picolNewCallFrame(i,i->callframe);
+    for (j = 0; j < proc->nargs; j++)
+        picolSetVar(i,proc->args[j],argv[j+1]);
+    if ((base = picolPushFrame(i,FR_PROC,proc->body,0)) < 0) {
+        picolDropCallFrame(i);
+        return PICOL_ERR;
+    }
+    return picolRun(i,base);
 }
 
 static int picolCommandProc(struct picolInterp *i, int argc, char **argv, void *pd) {
-    char **procdata = malloc(sizeof(char*)*2);
+    struct picolProc *proc;
+    char *p, *start;
+    int j;
     if (argc != 4) return picolArityErr(i,argv[0]);
-    procdata[0] = strdup(argv[2]); /* arguments list */
-    procdata[1] = strdup(argv[3]); /* procedure body */
-    return picolRegisterCommand(i,argv[1],picolCommandCallProc,procdata);
+    proc = PICOL_MALLOC(sizeof(*proc));
+    /* Split the arguments list */
+    proc->nargs = 0;
+    proc->args = PICOL_MALLOC(sizeof(char*)*(strlen(argv[2])/2+1));
+    for (p = argv[2]; *p;) {
+        if (*p == ' ') {
+            p++; continue;
+        }
+        for (start = p; *p != ' ' && *p != '\0'; p++);
+        proc->args[proc->nargs] = PICOL_MALLOC(p-start+1);
+        memcpy(proc->args[proc->nargs], start, p-start);
+        proc->args[proc->nargs++][p-start] = '\0';
+    }
+    proc->body = picolCompile(argv[3]); /* procedure body */
+    if (picolRegisterCommand(i,argv[1],picolCommandCallProc,proc) != PICOL_OK) {
+        for (j = 0; j < proc->nargs; j++) PICOL_FREE(proc->args[j]);
+        PICOL_FREE(proc->args);
+        picolReleaseScript(proc->body);
+        PICOL_FREE(proc);
+        return PICOL_ERR;
+    }
+    return PICOL_OK;
 }
 
 static int picolCommandReturn(struct picolInterp *i, int argc, char **argv, void *pd) {
@@ -609,6 +1507,8 @@ void picolRegisterCoreCommands(struct picolInterp *i) {
     for (j = 0; j < (int)(sizeof(name)/sizeof(char*)); j++)
         picolRegisterCommand(i,name[j],picolCommandMath,NULL);
     picolRegisterCommand(i,"set",picolCommandSet,NULL);
+    picolRegisterCommand(i,"expr",picolCommandExpr,NULL);
+    picolRegisterCommand(i,"incr",picolCommandIncr,NULL);
     picolRegisterCommand(i,"puts",picolCommandPuts,NULL);
     picolRegisterCommand(i,"if",picolCommandIf,NULL);
     picolRegisterCommand(i,"while",picolCommandWhile,NULL);
@@ -618,6 +1518,50 @@ void picolRegisterCoreCommands(struct picolInterp *i) {
     picolRegisterCommand(i,"return",picolCommandReturn,NULL);
 }
 
+void picolFreeInterp(struct picolInterp *i) {
+    struct picolCallFrame *cf;
+    struct picolVar *v;
+    struct picolCmd *c;
+    struct picolBlock *b;
+    int j, k;
+    while(i->callframe) picolDropCallFrame(i);
+    while((cf = i->freeframes) != NULL) {
+        i->freeframes = cf->parent;
+        PICOL_FREE(cf);
+    }
+    while((v = i->freevars) != NULL) {
+        i->freevars = v->next;
+        PICOL_FREE(v->name);
+        PICOL_FREE(v->val);
+        PICOL_FREE(v);
+    }
+    for (j = 0; j < PICOL_CMD_BUCKETS; j++) {
+        while((c = i->commands[j]) != NULL) {
+            i->commands[j] = c->next;
+            if (c->func == picolCommandCallProc) {
+                struct picolProc *proc = c->privdata;
+                for (k = 0; k < proc->nargs; k++) PICOL_FREE(proc->args[k]);
+                PICOL_FREE(proc->args);
+                picolReleaseScript(proc->body);
+                PICOL_FREE(proc);
+            }
+            PICOL_FREE(c->name);
+            PICOL_FREE(c);
+        }
+    }
+    for (j = 0; j < PICOL_SCRIPT_CACHE; j++) {
+        if (i->scripts[j]) picolReleaseScript(i->scripts[j]);
+        if (i->exprs[j]) picolReleaseExpr(i->exprs[j]);
+    }
+    while((b = i->scratch) != NULL) {
+        i->scratch = b->prev;
+        PICOL_FREE(b);
+    }
+    PICOL_FREE(i->spare);
+    PICOL_FREE(i->result);
+    PICOL_FREE(i->frames);
+}
+
 #endif /* PICOL_IMPLEMENTATION */
 
 #ifdef PICOL_REPL
@@ -630,7 +1574,7 @@ int main(int argc, char **argv) {
             char clibuf[1024];
             int retcode;
             printf("picol> "); fflush(stdout);
-            if (fgets(clibuf,1024,stdin) == NULL) return 0;
+            if (fgets(clibuf,1024,stdin) == NULL) break;
             retcode = picolEval(&interp,clibuf);
             if (interp.result[0] != '\0')
                 printf("[%d] %s\n", retcode, interp.result);
@@ -645,6 +1589,7 @@ int main(int argc, char **argv) {
         fclose(fp);
         if (picolEval(&interp,buf) != PICOL_OK) printf("%s\n", interp.result);
     }
+    picolFreeInterp(&interp);
     return 0;
 }
 #endif /* PICOL_REPL */
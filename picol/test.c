@@ -25,7 +25,7 @@ int main(int argc, char **argv) {
             char clibuf[1024];
             int retcode;
             printf("picol> "); fflush(stdout);
-            if (fgets(clibuf,1024,stdin) == NULL) return 0;
+            if (fgets(clibuf,1024,stdin) == NULL) break;
             retcode = picolEval(&interp,clibuf);
             if (interp.result[0] != '\0')
                 printf("[%d] %s\n", retcode, interp.result);
@@ -40,5 +40,6 @@ int main(int argc, char **argv) {
         fclose(fp);
         if (picolEval(&interp,buf) != PICOL_OK) printf("%s\n", interp.result);
     }
+    picolFreeInterp(&interp);
     return 0;
 }
@@ -31,6 +31,45 @@ static void usage(const char *name, FILE *f) {
 	fprintf(f, "   -g var        : get variable after executing\n");
 	fprintf(f, "   -d dbfile     : specify database file\n");
 	fprintf(f, "   -u subroutine : call subroutine after execing\n");
+	fprintf(f, "   -c cachedir   : cache scanned labels in cachedir\n");
+}
+
+/* FNV-1a hash of the program text, used to name label cache files */
+static unsigned long hash_program(const char *p) {
+	unsigned long h = 2166136261UL;
+	for(; *p; p++) {
+		h ^= (unsigned char)*p;
+		h = (h * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return h;
+}
+
+/* Loads the program's label table from `cachedir`, or scans
+ * the program and stores its labels there if it isn't cached yet. */
+static void cache_labels(char *p_buf, const char *cachedir) {
+	char filename[FILENAME_MAX];
+	FILE *f;
+	int ok = 0;
+
+	if(strlen(cachedir) + 16 >= sizeof filename) {
+		fprintf(stderr, "warning: cache directory name too long\n");
+		return;
+	}
+	sprintf(filename, "%s/%08lx.lbl", cachedir, hash_program(p_buf));
+
+	if((f = fopen(filename, "rb"))) {
+		ok = sb_load_labels(p_buf, f);
+		fclose(f);
+		if(ok)
+			return;
+	}
+
+	if((f = fopen(filename, "wb"))) {
+		ok = sb_save_labels(p_buf, f);
+		fclose(f);
+		if(!ok)
+			remove(filename);
+	}
 }
 
 static ppdb_t DB;
@@ -189,11 +228,11 @@ static void call_function(struct value *result, int argc, struct value argv[]) {
 int main(int argc, char *argv[]) {
 	char *p_buf;	
 	int c, i;
-	const char *getter = NULL, *dbfile = NULL;
+	const char *getter = NULL, *dbfile = NULL, *cachedir = NULL;
 	const char *subs[MAX_SUBS];
 	int nsubs = 0;
 
-	while ((c = getopt(argc, argv, "s:g:d:u:")) != -1) {
+	while ((c = getopt(argc, argv, "s:g:d:u:c:")) != -1) {
 		switch (c) {
 			case 's': {
 				char *var = optarg, *val;
@@ -219,6 +258,7 @@ int main(int argc, char *argv[]) {
 				}
 				subs[nsubs++] = optarg;
 				break;
+			case 'c': cachedir = optarg; break;
 			default: usage(argv[0], stderr); return 1;
 		}
 	}		
@@ -256,6 +296,9 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	if(cachedir)
+		cache_labels(p_buf, cachedir);
+
 	if(!execute(p_buf)) {
 		fprintf(stderr, "execution failed.\n");
 		return 1;	
@@ -153,6 +153,18 @@ static int curr_line = 0;
 
 static struct label label_table[NUM_LAB];
 
+/* The program whose labels were loaded by `sb_load_labels()`,
+ * so that `execute()` doesn't need to scan it again */
+static const char *labels_prog = NULL;
+
+/* Label table entries as stored by `sb_save_labels()` */
+#define LABELS_MAGIC "SBL1"
+struct label_rec {
+	char name[LAB_LEN];
+	long offset;
+	int line;
+};
+
 /* For-loop stack */
 static struct for_stack fstack[FOR_NEST];
 static int ftos;
@@ -161,6 +173,9 @@ static int ftos;
 static struct gloc gstack[SUB_NEST];
 static int gtos;
 
+/* Set while a program started with `sb_start()` can be resumed */
+static int running = 0;
+
 static struct label *find_label(const char *s);
 static int get_token();
 static void get_exp(value_t *result);
@@ -458,6 +473,99 @@ static void scan_labels() {
 	prog = temp;
 }
 
+int sb_save_labels(char *program, FILE *f) {
+	struct label_rec rec;
+	unsigned long len = strlen(program);
+	int t, n;
+
+	assert(!has_jmp);
+
+	prog = program;
+	if(setjmp(e_buf)) {
+		has_jmp = 0;
+		curr_line = 0;
+		return 0;
+	}
+	has_jmp = 1;
+	scan_labels();
+	has_jmp = 0;
+	curr_line = 0;
+
+	for(n = 0; n < NUM_LAB && label_table[n].name[0]; n++);
+
+	if(fwrite(LABELS_MAGIC, 4, 1, f) != 1
+		|| fwrite(&len, sizeof len, 1, f) != 1
+		|| fwrite(&n, sizeof n, 1, f) != 1)
+		return 0;
+	for(t = 0; t < n; t++) {
+		memset(&rec, 0, sizeof rec);
+		memcpy(rec.name, label_table[t].name, LAB_LEN);
+		rec.offset = label_table[t].p - program;
+		rec.line = label_table[t].line;
+		if(fwrite(&rec, sizeof rec, 1, f) != 1)
+			return 0;
+	}
+	labels_prog = program;
+	return 1;
+}
+
+/* Checks that a cached label really is at the start of its line
+ * in `program`, since a different program could have the same hash.
+ * The labels are stored in the order of the program, so `*from` and
+ * `*line` track how far the lines have been counted. */
+static int check_label(char *program, struct label_rec *rec, char **from, int *line) {
+	size_t n = strlen(rec->name);
+	char *s;
+
+	if((unsigned long)rec->offset < n)
+		return 0;
+	s = program + rec->offset - n;
+	if(s < *from || memcmp(s, rec->name, n) || isalnum((unsigned char)program[rec->offset]))
+		return 0;
+	if(s > program && s[-1] == '@')
+		s--;
+	while(s > program && isspace((unsigned char)s[-1]) && s[-1] != '\n')
+		s--;
+	if(s > program && s[-1] != '\n')
+		return 0;
+
+	for(; *from < s; (*from)++)
+		if(**from == '\n')
+			(*line)++;
+	return rec->line == *line;
+}
+
+int sb_load_labels(char *program, FILE *f) {
+	struct label_rec rec;
+	char magic[4], *from = program;
+	unsigned long len;
+	int t, n, line = 1;
+
+	labels_prog = NULL;
+	if(fread(magic, 4, 1, f) != 1 || memcmp(magic, LABELS_MAGIC, 4)
+		|| fread(&len, sizeof len, 1, f) != 1
+		|| fread(&n, sizeof n, 1, f) != 1)
+		return 0;
+	if(len != strlen(program) || n < 0 || n > NUM_LAB)
+		return 0;
+
+	for(t = 0; t < n; t++) {
+		if(fread(&rec, sizeof rec, 1, f) != 1)
+			return 0;
+		if(!rec.name[0] || rec.name[LAB_LEN - 1] || rec.offset < 0 || rec.offset > len
+			|| !check_label(program, &rec, &from, &line))
+			return 0;
+		memcpy(label_table[t].name, rec.name, LAB_LEN);
+		label_table[t].p = program + rec.offset;
+		label_table[t].line = rec.line;
+	}
+	for(; t < NUM_LAB; t++)
+		label_table[t].name[0] = '\0';
+
+	labels_prog = program;
+	return 1;
+}
+
 /* find the start of the next line. */
 static void find_eol() {
 	while(*prog != '\n' && *prog != '\0') ++prog;
@@ -972,9 +1080,14 @@ static void putback() {
 		curr_line--;
 }
 
-static int execute_lines() {
+/* Executes statements until END or the end of the program.
+ * If `steps` > 0, returns SB_YIELD after that many statements. */
+static int execute_lines(int steps) {
+	int count = 0;
 
 	do {
+		if(steps > 0 && count++ == steps)
+			return SB_YIELD;
 		string_bump = string_base;
 		/*printf("on line %d:\n", curr_line);*/
 		switch(get_token()) {
@@ -1092,29 +1205,59 @@ do_call:
 	return 1;
 }
 
-int execute(char *program) {
-	int result = 0;
+int sb_start(char *program) {
+	assert(!has_jmp); /* don't call recursively */
 
 	prog = program;
+	running = 0;
 
 	curr_line = 1;
-	scan_labels();
+	if(program != labels_prog) {
+		if(setjmp(e_buf)) {
+			has_jmp = 0;
+			curr_line = 0;
+			return 0;
+		}
+		has_jmp = 1;
+		scan_labels();
+		has_jmp = 0;
+	}
+	labels_prog = NULL;
 
 	ftos = 0;
 	gtos = 0;
 	curr_line = 1;
 
+	running = 1;
+	return 1;
+}
+
+int sb_resume(int steps) {
+	int result = SB_ERROR;
+
 	assert(!has_jmp); /* don't call recursively */
 
+	if(!running)
+		return SB_DONE;
+
 	if(!setjmp(e_buf)) {
 		has_jmp = 1;
-		result = execute_lines();
+		result = execute_lines(steps);
 	}
 	has_jmp = 0;
-	curr_line = 0;
+	if(result != SB_YIELD) {
+		running = 0;
+		curr_line = 0;
+	}
 	return result;
 }
 
+int execute(char *program) {
+	if(!sb_start(program))
+		return 0;
+	return sb_resume(0);
+}
+
 int sb_gosub(const char *sub) {
 	struct label *label;
 	char *save_prog;
@@ -1140,7 +1283,7 @@ int sb_gosub(const char *sub) {
 	prog = label->p;
 	curr_line = label->line;
 
-	result = execute_lines();
+	result = execute_lines(0);
 
 	prog = save_prog;
 	get_token();
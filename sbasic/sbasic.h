@@ -23,6 +23,8 @@
 #ifndef SBASIC_H
 #define SBASIC_H
 
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -120,6 +122,34 @@ value_t *set_variablei(const char *name, int val);
  */
 char *load_program(const char *fname);
 
+/**
+ * ### Caching Labels
+ *
+ * Before a program is executed, the interpreter scans the entire program
+ * text for line numbers and `@labels`. If the same script is run many
+ * times, the label table can be cached in a file to skip the scan.
+ *
+ * `int sb_save_labels(char *program, FILE *f)`
+ *
+ * Scans the labels in `program` and writes the label table to `f`, which
+ * must be opened in binary mode. Returns 0 on error.
+ *
+ * `int sb_load_labels(char *program, FILE *f)`
+ *
+ * Reads a label table previously written by `sb_save_labels()` for the
+ * same `program` from `f`. Returns 0 if the file is invalid or does not
+ * match `program`.
+ *
+ * After either function succeeds, the next call to `execute(program)`
+ * uses the label table as is instead of scanning `program` again.
+ *
+ * The file stores offsets into the program text, so it is only valid for
+ * exactly the same text, built with the same compiler, on the same platform.
+ */
+int sb_save_labels(char *program, FILE *f);
+
+int sb_load_labels(char *program, FILE *f);
+
 /**
  * ### Executing the interpreter
  *
@@ -136,6 +166,44 @@ int execute(char *program);
 
 int sb_gosub(const char *sub);
 
+/**
+ * ### Resumable execution
+ *
+ * `execute()` only returns once the program reaches `END` or an error.
+ * To run a long script inside a host's main loop (once per frame, for
+ * example), start it with `sb_start()` and then call `sb_resume()`
+ * periodically to run it a few statements at a time.
+ *
+ * `int sb_start(char *program);`
+ *
+ * Prepares `program` for execution, scanning its labels unless they were
+ * loaded through `sb_load_labels()`. Returns 0 on error.
+ *
+ * `int sb_resume(int steps);`
+ *
+ * Continues executing the program from where it left off, for at most
+ * `steps` statements (empty lines and labels count as statements).
+ * If `steps` is zero, it runs to completion, like `execute()`.
+ *
+ * It returns one of these values:
+ *
+ * * `SB_YIELD` if the budget ran out. Variables and the `FOR` and `GOSUB`
+ *   stacks are preserved, so the next call to `sb_resume()` continues
+ *   with the following statement.
+ * * `SB_DONE` if the program reached `END` or the end of the program.
+ * * `SB_ERROR` if an error occurred.
+ *
+ * The interpreter uses global state, so only one program can be in
+ * progress at a time. Don't call `execute()`, `sb_gosub()` or
+ * `sb_start()` from the host while a program is yielded; C functions
+ * called by the script may still use `sb_gosub()`.
+ */
+enum {SB_ERROR = 0, SB_DONE = 1, SB_YIELD = 2};
+
+int sb_start(char *program);
+
+int sb_resume(int steps);
+
 int sb_line(void);
 
 void sb_clear(void);